@@ -0,0 +1,73 @@
+#!/bin/sh
+# Run by `make bench`: starts the origin simulator, then measures the proxy
+# caching under each eviction policy and with caching off, under the same
+# closed- and open-loop load. The proxy always connects to origins on port
+# 80, so the simulator binds $ORIGIN:80 and this needs root (or
+# CAP_NET_BIND_SERVICE).
+#
+# Every knob can be overridden from the environment, e.g.
+#   DURATION=30 CONNS=128 RATE=20000 make bench
+
+ORIGIN=${ORIGIN:-127.0.0.2}
+PORT=${PORT:-18080}
+DURATION=${DURATION:-10}
+WARMUP=${WARMUP:-3}
+CONNS=${CONNS:-64}
+RATE=${RATE:-5000}
+OBJECTS=${OBJECTS:-10000}
+ZIPF=${ZIPF:-0.99}
+SCAN=${SCAN:-0.2}
+POLICIES=${POLICIES:-"lru tinylfu"}
+SEED=${SEED:-1}
+LATENCY=${LATENCY:-5}
+JITTER=${JITTER:-2}
+BANDWIDTH=${BANDWIDTH:-0}
+MIN_SIZE=${MIN_SIZE:-1024}
+MAX_SIZE=${MAX_SIZE:-65536}
+CACHE_CONTROL=${CACHE_CONTROL:-"max-age=600:70;max-age=2:10;no-store:10;private:5;:5"}
+CACHE_BYTES=${CACHE_BYTES:-32M}
+
+./bench_origin -a "$ORIGIN" -l "$LATENCY" -j "$JITTER" -r "$BANDWIDTH" \
+    -s "$MIN_SIZE" -S "$MAX_SIZE" -c "$CACHE_CONTROL" &
+origin_pid=$!
+proxy_pid=
+trap 'kill $origin_pid $proxy_pid 2>/dev/null' EXIT
+sleep 0.2
+if ! kill -0 $origin_pid 2>/dev/null; then
+    echo "bench: origin simulator could not bind $ORIGIN:80" >&2
+    exit 1
+fi
+
+load() {
+    ./bench_load -x 127.0.0.1:"$PORT" -o "$ORIGIN" -n "$OBJECTS" -z "$ZIPF" -u "$SCAN" "$@"
+}
+
+echo "origin: ${LATENCY}+-${JITTER} ms, ${MIN_SIZE}-${MAX_SIZE} bytes, $OBJECTS objects," \
+     "zipf $ZIPF, $SCAN scanning"
+for mode in $POLICIES off; do
+    # Connections cut at the end of each run make the proxy complain on
+    # stderr, so only its failure to start is reported
+    if [ $mode = off ]; then
+        label=caching-off
+        ./htproxy -p "$PORT" >/dev/null 2>&1 &
+    else
+        label=$mode
+        ./htproxy -p "$PORT" -c -m "$CACHE_BYTES" -e "$mode" >/dev/null 2>&1 &
+    fi
+    proxy_pid=$!
+    sleep 0.2
+    if ! kill -0 $proxy_pid 2>/dev/null; then
+        echo "bench: htproxy did not start on port $PORT" >&2
+        exit 1
+    fi
+
+    # Warm the cache, then measure. Each run has its own seed so scanned
+    # objects are never repeated, and every mode sees the same runs.
+    load -c "$CONNS" -d "$WARMUP" -s $((SEED + 2)) >/dev/null
+    load -c "$CONNS" -d "$DURATION" -s "$SEED" -L "$label"
+    load -c "$CONNS" -d "$DURATION" -R "$RATE" -s $((SEED + 1)) -L "$label"
+
+    kill $proxy_pid
+    wait $proxy_pid 2>/dev/null
+    proxy_pid=
+done
@@ -0,0 +1,507 @@
+/**
+ * Load generator for `make bench`. Requests /obj/<n> from an origin through
+ * the proxy, with n drawn from a Zipf distribution by a seeded generator so
+ * every run asks for the same sequence. In closed loop (the default) each
+ * connection sends its next request as soon as the last one completes. In
+ * open loop (-R) requests arrive as a Poisson process at the given rate and
+ * wait for a free connection, and latency counts from the scheduled arrival
+ * so a slow proxy cannot hide its queueing. With -u a share of requests
+ * instead asks for objects never requested before, as a crawler would,
+ * which tests how well the cache keeps its hot set. Prints throughput, exact
+ * p50/p99/p999 latency and the hit ratio from the proxy's own counters.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <math.h>
+#include <time.h>
+#include <signal.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+
+#define MAX_EVENTS 256
+#define HEADER_BUFFER 16384
+#define PENDING_MAX (1 << 20)           // open-loop arrivals waiting for a connection
+#define STATS_PATH "/__htproxy/stats"
+
+typedef enum {
+    CLIENT_CONNECTING,
+    CLIENT_IDLE,
+    CLIENT_WAITING,             // request sent, response not complete
+} client_state_t;
+
+typedef struct {
+    int fd;
+    client_state_t state;
+    uint64_t start_us;          // when the request was sent, or scheduled in open loop
+    char header[HEADER_BUFFER];
+    int header_len;
+    int header_done;
+    long body_left;             // -1 when the body ends at EOF
+    int close_after;
+} client_t;
+
+static struct sockaddr_storage proxy_addr;
+static socklen_t proxy_addr_len;
+static const char *origin = "127.0.0.2";
+static int epoll_fd;
+
+static double *zipf_cdf;
+static int num_objects = 10000;
+static double scan_fraction = 0;
+static uint64_t rng_state;
+
+static uint64_t *latencies;
+static long num_latencies = 0;
+static long latencies_size = 0;
+static long errors = 0;
+static long body_bytes = 0;
+
+static uint64_t pending[PENDING_MAX];       // scheduled arrival times, a ring
+static long pending_head = 0;
+static long pending_tail = 0;
+
+static void usage(const char *prog) {
+    fprintf(stderr, "Usage: %s -x proxy-host:port [-o origin-host] [-c connections] "
+                    "[-d seconds] [-R requests-per-sec] [-n objects] [-z zipf-exponent] "
+                    "[-u scan-fraction] [-s seed] [-L label]\n", prog);
+    exit(EXIT_FAILURE);
+}
+
+static uint64_t now_us(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
+// xorshift64*, reproducible for a given seed
+static uint64_t next_random(void) {
+    rng_state ^= rng_state >> 12;
+    rng_state ^= rng_state << 25;
+    rng_state ^= rng_state >> 27;
+    return rng_state * 0x2545f4914f6cdd1dULL;
+}
+
+// Uniform in [0, 1)
+static double next_uniform(void) {
+    return (next_random() >> 11) * (1.0 / 9007199254740992.0);
+}
+
+static void build_zipf(double exponent) {
+    zipf_cdf = malloc(num_objects * sizeof(double));
+    if (!zipf_cdf) {
+        perror("malloc");
+        exit(EXIT_FAILURE);
+    }
+    double sum = 0;
+    for (int i = 0; i < num_objects; i++) {
+        sum += 1.0 / pow(i + 1, exponent);
+        zipf_cdf[i] = sum;
+    }
+    for (int i = 0; i < num_objects; i++) {
+        zipf_cdf[i] /= sum;
+    }
+}
+
+// Object rank 1..num_objects, rank 1 the most popular, or for the scanning
+// share of requests one from a range too large to ever repeat
+static long next_object(void) {
+    if (scan_fraction > 0 && next_uniform() < scan_fraction) {
+        return num_objects + 1 + (long)(next_random() >> 24);
+    }
+    double u = next_uniform();
+    int low = 0, high = num_objects - 1;
+    while (low < high) {
+        int mid = (low + high) / 2;
+        if (zipf_cdf[mid] < u) {
+            low = mid + 1;
+        } else {
+            high = mid;
+        }
+    }
+    return low + 1;
+}
+
+static void parse_proxy(const char *arg, const char *prog) {
+    char host[256];
+    const char *colon = strrchr(arg, ':');
+    if (!colon || colon - arg >= (int)sizeof(host)) {
+        usage(prog);
+    }
+    memcpy(host, arg, colon - arg);
+    host[colon - arg] = '\0';
+
+    struct addrinfo hints = {.ai_family = AF_UNSPEC, .ai_socktype = SOCK_STREAM};
+    struct addrinfo *result;
+    int rv = getaddrinfo(host, colon + 1, &hints, &result);
+    if (rv != 0) {
+        fprintf(stderr, "getaddrinfo: %s\n", gai_strerror(rv));
+        exit(EXIT_FAILURE);
+    }
+    memcpy(&proxy_addr, result->ai_addr, result->ai_addrlen);
+    proxy_addr_len = result->ai_addrlen;
+    freeaddrinfo(result);
+}
+
+static void record_latency(uint64_t us) {
+    if (num_latencies == latencies_size) {
+        latencies_size = latencies_size ? latencies_size * 2 : 65536;
+        latencies = realloc(latencies, latencies_size * sizeof(uint64_t));
+        if (!latencies) {
+            perror("realloc");
+            exit(EXIT_FAILURE);
+        }
+    }
+    latencies[num_latencies++] = us;
+}
+
+static void client_connect(client_t *client) {
+    client->fd = socket(proxy_addr.ss_family, SOCK_STREAM | SOCK_NONBLOCK, 0);
+    if (client->fd < 0) {
+        perror("socket");
+        exit(EXIT_FAILURE);
+    }
+    int one = 1;
+    setsockopt(client->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    if (connect(client->fd, (struct sockaddr *)&proxy_addr, proxy_addr_len) < 0 &&
+        errno != EINPROGRESS) {
+        perror("connect");
+        exit(EXIT_FAILURE);
+    }
+    client->state = CLIENT_CONNECTING;
+    struct epoll_event ev = {.events = EPOLLOUT, .data.ptr = client};
+    epoll_ctl(epoll_fd, EPOLL_CTL_ADD, client->fd, &ev);
+}
+
+static void client_connected(client_t *client) {
+    int error = 0;
+    socklen_t error_len = sizeof(error);
+    getsockopt(client->fd, SOL_SOCKET, SO_ERROR, &error, &error_len);
+    if (error) {
+        fprintf(stderr, "connect: %s\n", strerror(error));
+        exit(EXIT_FAILURE);
+    }
+    client->state = CLIENT_IDLE;
+    struct epoll_event ev = {.events = EPOLLIN, .data.ptr = client};
+    epoll_ctl(epoll_fd, EPOLL_CTL_MOD, client->fd, &ev);
+}
+
+static void client_reconnect(client_t *client) {
+    close(client->fd);
+    client_connect(client);
+}
+
+/*
+ * Send the next request on an idle connection, stamped with start_us
+ */
+static void client_send(client_t *client, uint64_t start_us) {
+    char request[512];
+    int len = snprintf(request, sizeof(request),
+                       "GET http://%s/obj/%ld HTTP/1.1\r\nHost: %s\r\n\r\n", origin,
+                       next_object(), origin);
+    // A fresh request on an idle socket fits its send buffer
+    if (send(client->fd, request, len, MSG_NOSIGNAL) != len) {
+        errors++;
+        client_reconnect(client);
+        return;
+    }
+    client->state = CLIENT_WAITING;
+    client->start_us = start_us;
+    client->header_len = 0;
+    client->header_done = 0;
+    client->close_after = 0;
+}
+
+static void client_done(client_t *client, uint64_t now, uint64_t measure_start) {
+    if (client->start_us >= measure_start) {
+        record_latency(now - client->start_us);
+    }
+    client->state = CLIENT_IDLE;
+    if (client->close_after) {
+        client_reconnect(client);
+    }
+}
+
+// Value of a header, just past its name, or NULL
+static const char *find_header(const char *header, const char *name) {
+    size_t name_len = strlen(name);
+    for (const char *line = strstr(header, "\r\n"); line; line = strstr(line + 2, "\r\n")) {
+        if (strncasecmp(line + 2, name, name_len) == 0) {
+            return line + 2 + name_len;
+        }
+    }
+    return NULL;
+}
+
+/*
+ * Take response bytes for a waiting client. Returns 1 when its response is
+ * complete.
+ */
+static int client_consume(client_t *client, const char *data, long len) {
+    if (!client->header_done) {
+        int before = client->header_len;
+        int room = HEADER_BUFFER - 1 - client->header_len;
+        int take = len < room ? len : room;
+        memcpy(client->header + client->header_len, data, take);
+        client->header_len += take;
+        client->header[client->header_len] = '\0';
+
+        char *end = strstr(client->header, "\r\n\r\n");
+        if (!end) {
+            return 0;
+        }
+        *end = '\0';
+        const char *length = find_header(client->header, "Content-Length:");
+        client->body_left = length ? atol(length) : -1;
+        const char *connection = find_header(client->header, "Connection:");
+        client->close_after = client->body_left < 0 ||
+                              (connection && strcasestr(connection, "close") != NULL);
+        client->header_done = 1;
+
+        // Whatever followed the header is body
+        long consumed = end + 4 - client->header - before;
+        data += consumed;
+        len -= consumed;
+    }
+
+    if (client->body_left < 0) {
+        body_bytes += len;
+        return 0;
+    }
+    body_bytes += len;
+    client->body_left -= len;
+    return client->body_left <= 0;
+}
+
+static void client_readable(client_t *client, uint64_t measure_start) {
+    static char buffer[256 * 1024];
+    ssize_t n = recv(client->fd, buffer, sizeof(buffer), 0);
+    if (n < 0 && (errno == EAGAIN || errno == EINTR)) {
+        return;
+    }
+    if (n <= 0) {
+        if (client->state == CLIENT_WAITING && client->header_done && client->body_left < 0) {
+            client_done(client, now_us(), measure_start);    // reconnects
+        } else {
+            if (client->state == CLIENT_WAITING) {
+                errors++;
+            }
+            client_reconnect(client);
+        }
+        return;
+    }
+    if (client->state != CLIENT_WAITING) {
+        return;
+    }
+    if (client_consume(client, buffer, n)) {
+        client_done(client, now_us(), measure_start);
+    }
+}
+
+/*
+ * Counter from the proxy's stats endpoint, or -1 when the proxy does not
+ * serve one
+ */
+static long fetch_counter(const char *name) {
+    int fd = socket(proxy_addr.ss_family, SOCK_STREAM, 0);
+    if (fd < 0 || connect(fd, (struct sockaddr *)&proxy_addr, proxy_addr_len) < 0) {
+        if (fd >= 0) {
+            close(fd);
+        }
+        return -1;
+    }
+    const char *request = "GET " STATS_PATH " HTTP/1.1\r\nConnection: close\r\n\r\n";
+    send(fd, request, strlen(request), MSG_NOSIGNAL);
+
+    char response[65536];
+    int len = 0;
+    ssize_t n;
+    while (len < (int)sizeof(response) - 1 &&
+           (n = recv(fd, response + len, sizeof(response) - 1 - len, 0)) > 0) {
+        len += n;
+    }
+    close(fd);
+    response[len] = '\0';
+
+    char key[64];
+    snprintf(key, sizeof(key), "\"%s\": ", name);
+    const char *value = strstr(response, key);
+    return value ? atol(value + strlen(key)) : -1;
+}
+
+static int compare_latency(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+    return x < y ? -1 : x > y;
+}
+
+static double percentile_ms(double fraction) {
+    if (num_latencies == 0) {
+        return 0;
+    }
+    long index = (long)ceil(fraction * num_latencies) - 1;
+    if (index < 0) {
+        index = 0;
+    }
+    return latencies[index] / 1000.0;
+}
+
+int main(int argc, char **argv) {
+    int num_clients = 32;
+    double duration = 10;
+    double rate = 0;
+    double exponent = 0.99;
+    const char *label = "run";
+    int have_proxy = 0;
+    int opt;
+
+    rng_state = 1;
+    while ((opt = getopt(argc, argv, "x:o:c:d:R:n:z:u:s:L:")) != -1) {
+        switch (opt) {
+            case 'x':
+                parse_proxy(optarg, argv[0]);
+                have_proxy = 1;
+                break;
+            case 'o':
+                origin = optarg;
+                break;
+            case 'c':
+                num_clients = atoi(optarg);
+                break;
+            case 'd':
+                duration = atof(optarg);
+                break;
+            case 'R':
+                rate = atof(optarg);
+                break;
+            case 'n':
+                num_objects = atoi(optarg);
+                break;
+            case 'z':
+                exponent = atof(optarg);
+                break;
+            case 'u':
+                scan_fraction = atof(optarg);
+                break;
+            case 's':
+                rng_state = strtoull(optarg, NULL, 10) | 1;
+                break;
+            case 'L':
+                label = optarg;
+                break;
+            default:
+                usage(argv[0]);
+        }
+    }
+    if (!have_proxy || num_clients <= 0 || duration <= 0 || num_objects <= 0 || rate < 0) {
+        usage(argv[0]);
+    }
+
+    signal(SIGPIPE, SIG_IGN);
+    build_zipf(exponent);
+    epoll_fd = epoll_create1(0);
+    client_t *clients = calloc(num_clients, sizeof(client_t));
+    if (!clients) {
+        perror("calloc");
+        exit(EXIT_FAILURE);
+    }
+
+    long requests_before = fetch_counter("requests");
+    long hits_before = fetch_counter("hits") + fetch_counter("disk_hits");
+
+    // Open every connection before the clock starts, a SYN retried against a
+    // full listen backlog would otherwise show up as a second of queueing
+    for (int i = 0; i < num_clients; i++) {
+        client_connect(&clients[i]);
+    }
+    struct epoll_event events[MAX_EVENTS];
+    for (int connected = 0; connected < num_clients;) {
+        int n = epoll_wait(epoll_fd, events, MAX_EVENTS, -1);
+        for (int i = 0; i < n; i++) {
+            client_connected(events[i].data.ptr);
+            connected++;
+        }
+    }
+
+    uint64_t start = now_us();
+    uint64_t end = start + (uint64_t)(duration * 1000000);
+    double next_arrival = start;
+
+    for (;;) {
+        uint64_t now = now_us();
+        if (now >= end) {
+            break;
+        }
+
+        // Open loop: queue every arrival that is due
+        if (rate > 0) {
+            while (next_arrival <= now) {
+                if (pending_tail - pending_head == PENDING_MAX) {
+                    errors++;       // generator itself overloaded
+                } else {
+                    pending[pending_tail++ % PENDING_MAX] = (uint64_t)next_arrival;
+                }
+                next_arrival += -log(1 - next_uniform()) * 1000000 / rate;
+            }
+        }
+
+        // Hand work to idle connections
+        for (int i = 0; i < num_clients; i++) {
+            client_t *client = &clients[i];
+            if (client->state != CLIENT_IDLE) {
+                continue;
+            }
+            if (rate == 0) {
+                client_send(client, now);
+            } else if (pending_head < pending_tail) {
+                client_send(client, pending[pending_head++ % PENDING_MAX]);
+            }
+        }
+
+        int timeout = 1 + (int)((end - now) / 1000);
+        if (rate > 0) {
+            double wait = (next_arrival - now) / 1000;
+            timeout = wait < 1 ? 1 : (int)wait < timeout ? (int)wait : timeout;
+        }
+        int n = epoll_wait(epoll_fd, events, MAX_EVENTS, timeout);
+        for (int i = 0; i < n; i++) {
+            client_t *client = events[i].data.ptr;
+            if (client->state == CLIENT_CONNECTING) {
+                client_connected(client);
+            } else {
+                client_readable(client, start);
+            }
+        }
+    }
+    double elapsed = (now_us() - start) / 1000000.0;
+
+    for (int i = 0; i < num_clients; i++) {
+        close(clients[i].fd);
+    }
+    long requests = fetch_counter("requests") - requests_before;
+    long hits = fetch_counter("hits") + fetch_counter("disk_hits") - hits_before;
+
+    qsort(latencies, num_latencies, sizeof(uint64_t), compare_latency);
+    printf("%-12s %s %4d conns %9.1f req/s %8.1f MB/s  p50 %7.3f ms  p99 %7.3f ms  "
+           "p999 %7.3f ms  hit ratio ",
+           label, rate > 0 ? "open  " : "closed", num_clients, num_latencies / elapsed,
+           body_bytes / elapsed / 1e6, percentile_ms(0.5), percentile_ms(0.99),
+           percentile_ms(0.999));
+    if (requests_before >= 0 && requests > 0) {
+        printf("%.3f", (double)hits / requests);
+    } else {
+        printf("  n/a");
+    }
+    printf("  errors %ld\n", errors);
+    return 0;
+}
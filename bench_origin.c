@@ -0,0 +1,300 @@
+/**
+ * Origin simulator for `make bench`. Serves /obj/<n> for any n with a
+ * thread per connection and keep-alive. The size and Cache-Control of an
+ * object are fixed by a hash of n, so every run sees the same objects:
+ * sizes fall between -s and -S, and policies follow the weights of the -c
+ * mix. Each response waits the configured latency (plus jitter) before its
+ * header and is paced to the configured bandwidth.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <signal.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+#define MAX_POLICIES 16
+#define REQUEST_BUFFER 8192
+#define PACE_INTERVAL_MS 10            // bandwidth is paced in slices this long
+
+typedef struct {
+    char value[128];            // Cache-Control value, "" sends none
+    int weight;
+} policy_t;
+
+static policy_t policies[MAX_POLICIES];
+static int num_policies = 0;
+static int total_weight = 0;
+static long latency_ms = 0;
+static long jitter_ms = 0;
+static long bandwidth = 0;              // bytes per second per response, 0 = unlimited
+static long min_size = 1024;
+static long max_size = 1024;
+static char *body;                      // max_size bytes of filler
+
+static void usage(const char *prog) {
+    fprintf(stderr, "Usage: %s [-a addr] [-p port] [-l latency-ms] [-j jitter-ms] "
+                    "[-r bytes-per-sec] [-s min-size] [-S max-size] "
+                    "[-c 'cache-control:weight;...']\n", prog);
+    exit(EXIT_FAILURE);
+}
+
+// Same object, same answer: a 64-bit mix of its number
+static uint64_t object_hash(uint64_t n, uint64_t salt) {
+    uint64_t x = n * 0x9e3779b97f4a7c15ULL + salt;
+    x ^= x >> 33;
+    x *= 0xff51afd7ed558ccdULL;
+    x ^= x >> 33;
+    return x;
+}
+
+static long object_size(uint64_t n) {
+    return min_size + object_hash(n, 1) % (max_size - min_size + 1);
+}
+
+static const char *object_policy(uint64_t n) {
+    if (num_policies == 0) {
+        return "";
+    }
+    int pick = object_hash(n, 2) % total_weight;
+    for (int i = 0; i < num_policies; i++) {
+        if (pick < policies[i].weight) {
+            return policies[i].value;
+        }
+        pick -= policies[i].weight;
+    }
+    return "";
+}
+
+/*
+ * Parse a mix such as "max-age=300:70;no-store:20;:10", the part after the
+ * last colon of each entry being its weight
+ */
+static void parse_policies(const char *mix, const char *prog) {
+    char *copy = strdup(mix);
+    char *save;
+    for (char *entry = strtok_r(copy, ";", &save); entry; entry = strtok_r(NULL, ";", &save)) {
+        char *colon = strrchr(entry, ':');
+        if (!colon || num_policies == MAX_POLICIES || colon - entry >= 128) {
+            usage(prog);
+        }
+        *colon = '\0';
+        policy_t *policy = &policies[num_policies++];
+        strcpy(policy->value, entry);
+        policy->weight = atoi(colon + 1);
+        if (policy->weight <= 0) {
+            usage(prog);
+        }
+        total_weight += policy->weight;
+    }
+    free(copy);
+}
+
+static void sleep_ms(long ms) {
+    struct timespec delay = {ms / 1000, (ms % 1000) * 1000000};
+    while (nanosleep(&delay, &delay) < 0 && errno == EINTR) {
+    }
+}
+
+static int send_all(int fd, const char *data, long len) {
+    while (len > 0) {
+        ssize_t sent = send(fd, data, len, MSG_NOSIGNAL);
+        if (sent < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        data += sent;
+        len -= sent;
+    }
+    return 0;
+}
+
+/*
+ * Answer one request: wait the latency, send the header, then the body at
+ * the configured rate
+ */
+static int respond(int fd, const char *request) {
+    // The proxy forwards absolute-form targets, clients may send origin-form
+    const char *path = strstr(request, "/obj/");
+    uint64_t n = path ? strtoull(path + 5, NULL, 10) : 0;
+    long size = object_size(n);
+    const char *policy = object_policy(n);
+
+    long delay = latency_ms;
+    if (jitter_ms > 0) {
+        delay += object_hash(n ^ (uint64_t)time(NULL), 3) % (jitter_ms + 1);
+    }
+    if (delay > 0) {
+        sleep_ms(delay);
+    }
+
+    char header[512];
+    int header_len = snprintf(header, sizeof(header),
+                              "HTTP/1.1 200 OK\r\n"
+                              "Content-Type: application/octet-stream\r\n"
+                              "Content-Length: %ld\r\n"
+                              "%s%s%s"
+                              "\r\n",
+                              size, *policy ? "Cache-Control: " : "", policy,
+                              *policy ? "\r\n" : "");
+    // Unthrottled, the header and body leave together as a real server's would
+    if (bandwidth <= 0) {
+        struct iovec iov[2] = {{header, header_len}, {body, size}};
+        struct msghdr msg = {.msg_iov = iov, .msg_iovlen = 2};
+        ssize_t sent = sendmsg(fd, &msg, MSG_NOSIGNAL);
+        if (sent < 0) {
+            return -1;
+        }
+        if (sent < header_len) {
+            return send_all(fd, header + sent, header_len - sent) < 0 ? -1 : send_all(fd, body, size);
+        }
+        return send_all(fd, body + (sent - header_len), size - (sent - header_len));
+    }
+    if (send_all(fd, header, header_len) < 0) {
+        return -1;
+    }
+    long slice = bandwidth * PACE_INTERVAL_MS / 1000;
+    if (slice < 1) {
+        slice = 1;
+    }
+    for (long sent = 0; sent < size; sent += slice) {
+        if (send_all(fd, body + sent, size - sent < slice ? size - sent : slice) < 0) {
+            return -1;
+        }
+        if (sent + slice < size) {
+            sleep_ms(PACE_INTERVAL_MS);
+        }
+    }
+    return 0;
+}
+
+static void *connection_main(void *arg) {
+    int fd = (int)(intptr_t)arg;
+    char request[REQUEST_BUFFER];
+    int len = 0;
+
+    int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+    for (;;) {
+        char *end;
+        while (!(end = memmem(request, len, "\r\n\r\n", 4))) {
+            if (len == REQUEST_BUFFER - 1) {
+                goto done;
+            }
+            ssize_t got = recv(fd, request + len, REQUEST_BUFFER - 1 - len, 0);
+            if (got < 0 && errno == EINTR) {
+                continue;
+            }
+            if (got <= 0) {
+                goto done;
+            }
+            len += got;
+            request[len] = '\0';
+        }
+
+        *end = '\0';
+        if (respond(fd, request) < 0) {
+            break;
+        }
+
+        // Keep any pipelined request that followed
+        int used = end + 4 - request;
+        memmove(request, request + used, len - used);
+        len -= used;
+        request[len] = '\0';
+    }
+
+done:
+    close(fd);
+    return NULL;
+}
+
+int main(int argc, char **argv) {
+    const char *addr = "127.0.0.2";
+    int port = 80;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "a:p:l:j:r:s:S:c:")) != -1) {
+        switch (opt) {
+            case 'a':
+                addr = optarg;
+                break;
+            case 'p':
+                port = atoi(optarg);
+                break;
+            case 'l':
+                latency_ms = atol(optarg);
+                break;
+            case 'j':
+                jitter_ms = atol(optarg);
+                break;
+            case 'r':
+                bandwidth = atol(optarg);
+                break;
+            case 's':
+                min_size = atol(optarg);
+                break;
+            case 'S':
+                max_size = atol(optarg);
+                break;
+            case 'c':
+                parse_policies(optarg, argv[0]);
+                break;
+            default:
+                usage(argv[0]);
+        }
+    }
+    if (min_size < 0 || max_size < min_size) {
+        usage(argv[0]);
+    }
+
+    body = malloc(max_size + 1);
+    if (!body) {
+        perror("malloc");
+        exit(EXIT_FAILURE);
+    }
+    memset(body, 'x', max_size);
+    signal(SIGPIPE, SIG_IGN);
+
+    int listen_fd = socket(AF_INET, SOCK_STREAM, 0);
+    int one = 1;
+    setsockopt(listen_fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    struct sockaddr_in sin = {.sin_family = AF_INET, .sin_port = htons(port)};
+    if (inet_pton(AF_INET, addr, &sin.sin_addr) != 1) {
+        usage(argv[0]);
+    }
+    if (bind(listen_fd, (struct sockaddr *)&sin, sizeof(sin)) < 0 || listen(listen_fd, 1024) < 0) {
+        perror("bind origin");
+        exit(EXIT_FAILURE);
+    }
+
+    for (;;) {
+        int fd = accept(listen_fd, NULL, NULL);
+        if (fd < 0) {
+            if (errno != EINTR) {
+                perror("accept");
+            }
+            continue;
+        }
+        pthread_t thread;
+        if (pthread_create(&thread, NULL, connection_main, (void *)(intptr_t)fd) != 0) {
+            close(fd);
+            continue;
+        }
+        pthread_detach(thread);
+    }
+}
@@ -1,4 +1,8 @@
+#include "htproxy.h"
 #include "cache.h"
+#include "log.h"
+#include "scan.h"
+#include "stats.h"
 
 uint64_t get_monotonic_time_ms(void) {
     struct timeval tv;
@@ -6,350 +10,1587 @@ uint64_t get_monotonic_time_ms(void) {
     return (uint64_t)tv.tv_sec * 1000 + (uint64_t)tv.tv_usec / 1000;
 }
 
-void cache_init(cache_t *cache) {
+// A response moving to the disk tier, copied once the cache lock is dropped
+typedef struct disk_write {
+    disk_entry_t *record;
+    char *dest;                 // where the response goes in the record
+    cache_chunk_t *chunks;      // held until the copy is done
+    struct disk_write *next;
+} disk_write_t;
+
+static __thread disk_write_t *disk_writes = NULL;    // this thread's, in any order
+static __thread size_t disk_write_bytes = 0;         // chunk memory only they hold
+
+// FNV-1a over the key bytes
+static uint64_t cache_hash(const char *key, int key_len) {
+    uint64_t hash = 14695981039346656037ULL;
+    for (int i = 0; i < key_len; i++) {
+        hash ^= (unsigned char)key[i];
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
+void cache_init(cache_t *cache, const cache_config_t *config) {
     memset(cache, 0, sizeof(cache_t));
-    cache->access_sequence = 0;
+    cache->num_buckets = CACHE_INITIAL_BUCKETS;
+    cache->buckets = calloc(cache->num_buckets, sizeof(cache_entry_t *));
+    if (!cache->buckets) {
+        perror("calloc");
+        exit(EXIT_FAILURE);
+    }
+    
+    cache->mem_limit = config->mem_limit;
+    // Response lengths are ints
+    cache->max_object_size = config->max_object_size < INT_MAX ? config->max_object_size : INT_MAX;
+    cache->max_entries = config->max_entries;
+    cache->grace = config->grace;
+    cache->policy = config->policy;
+    
+    // A slab page must hold the largest item: an entry with its key,
+    // variant, validators, host and uri, or a full chunk of a response
+    size_t largest_item = sizeof(cache_entry_t) + 3 * MAX_REQUEST_SIZE_TO_CACHE +
+                          2 * MAX_VARY_SIZE + 2 * MAX_VALIDATOR_SIZE;
+    if (largest_item < sizeof(cache_chunk_t) + CACHE_CHUNK_SIZE) {
+        largest_item = sizeof(cache_chunk_t) + CACHE_CHUNK_SIZE;
+    }
+    size_t page_size = (largest_item + SLAB_PAGE_SIZE - 1) / SLAB_PAGE_SIZE * SLAB_PAGE_SIZE;
+    if (slab_init(&cache->slab, config->mem_limit, page_size, config->huge_pages) < 0) {
+        exit(EXIT_FAILURE);
+    }
+    if (config->huge_pages && !cache->slab.huge_pages) {
+        fprintf(stderr, "Huge pages unavailable, using normal pages\n");
+    }
+    cache->page_tally = calloc(cache->slab.num_pages, sizeof(cache_page_tally_t));
+    if (!cache->page_tally) {
+        perror("calloc");
+        exit(EXIT_FAILURE);
+    }
     cache->start_time = get_monotonic_time_ms();
+    pthread_mutex_init(&cache->lock, NULL);
+    
+    // The sketch tracks about as many keys as the cache holds entries
+    if (cache->policy == CACHE_POLICY_TINYLFU) {
+        size_t capacity = config->max_entries ? (size_t)config->max_entries :
+                          config->mem_limit / CACHE_SKETCH_OBJECT_SIZE;
+        if (sketch_init(&cache->sketch, capacity) < 0) {
+            exit(EXIT_FAILURE);
+        }
+    }
+    
+    if (config->disk_path &&
+        disk_init(&cache->disk, config->disk_path, config->disk_size, &cache->lock) < 0) {
+        exit(EXIT_FAILURE);
+    }
+}
+
+// Copy a response out of its chunks
+static void copy_chunks(const cache_chunk_t *chunk, char *dest) {
+    for (; chunk; chunk = chunk->next) {
+        memcpy(dest, chunk->data, chunk->len);
+        dest += chunk->len;
+    }
+}
+
+// Take this thread's disk writes and copy their responses into the records
+static disk_write_t *copy_disk_writes(void) {
+    disk_write_t *writes = disk_writes;
+    disk_writes = NULL;
+    disk_write_bytes = 0;
+    for (disk_write_t *write = writes; write; write = write->next) {
+        copy_chunks(write->chunks, write->dest);
+    }
+    return writes;
+}
+
+// Let hits find copied records and free their chunks. The lock must be held.
+static void commit_disk_writes(cache_t *cache, disk_write_t *writes) {
+    while (writes) {
+        disk_write_t *next = writes->next;
+        disk_commit(&cache->disk, writes->record);
+        cache_chunks_put(cache, writes->chunks, NULL);
+        free(writes);
+        writes = next;
+    }
+}
+
+/*
+ * Copy the responses this thread moved to the disk tier into their records,
+ * then let hits find them. The copies run without the lock; the evicted
+ * entries' chunks are held until they are done.
+ */
+static void finish_disk_writes(cache_t *cache) {
+    disk_write_t *writes = copy_disk_writes();
+    pthread_mutex_lock(&cache->lock);
+    commit_disk_writes(cache, writes);
+    pthread_mutex_unlock(&cache->lock);
+}
+
+void cache_lock(cache_t *cache) {
+    pthread_mutex_lock(&cache->lock);
+}
+
+void cache_unlock(cache_t *cache) {
+    pthread_mutex_unlock(&cache->lock);
+    if (disk_writes) {
+        finish_disk_writes(cache);
+    }
 }
 
 void cache_cleanup(cache_t *cache) {
-    for (int i = 0; i < MAX_CACHE_ENTRIES; i++) {
-        if (cache->entries[i].valid) {
-            free(cache->entries[i].request);
-            free(cache->entries[i].response);
-            free(cache->entries[i].host);
-            free(cache->entries[i].uri);
-            cache->entries[i].valid = 0;
+    // Entries live in the slab arena, which goes away in one piece
+    slab_destroy(&cache->slab);
+    free(cache->page_tally);
+    cache->page_tally = NULL;
+    disk_destroy(&cache->disk);
+    cache->mem_used = 0;
+    free(cache->buckets);
+    cache->buckets = NULL;
+    cache->num_buckets = 0;
+    memset(cache->lru, 0, sizeof(cache->lru));
+    sketch_destroy(&cache->sketch);
+    cache->size = 0;
+}
+
+static void lru_unlink(cache_t *cache, cache_entry_t *entry) {
+    cache_list_t *list = &cache->lru[entry->segment];
+    if (entry->lru_prev) {
+        entry->lru_prev->lru_next = entry->lru_next;
+    } else {
+        list->head = entry->lru_next;
+    }
+    if (entry->lru_next) {
+        entry->lru_next->lru_prev = entry->lru_prev;
+    } else {
+        list->tail = entry->lru_prev;
+    }
+    entry->lru_prev = entry->lru_next = NULL;
+    list->size--;
+    list->mem_used -= entry->mem_size;
+}
+
+static void lru_push_head(cache_t *cache, cache_entry_t *entry, cache_segment_t segment) {
+    cache_list_t *list = &cache->lru[segment];
+    entry->segment = segment;
+    entry->lru_prev = NULL;
+    entry->lru_next = list->head;
+    if (list->head) {
+        list->head->lru_prev = entry;
+    } else {
+        list->tail = entry;
+    }
+    list->head = entry;
+    list->size++;
+    list->mem_used += entry->mem_size;
+}
+
+static void lru_move(cache_t *cache, cache_entry_t *entry, cache_segment_t segment) {
+    lru_unlink(cache, entry);
+    lru_push_head(cache, entry, segment);
+}
+
+/*
+ * Whether a list with extra_entries and extra_bytes more would pass percent
+ * of the cache's entry and byte limits. A list may always hold one entry.
+ */
+static int lru_over_share(cache_t *cache, cache_segment_t segment, int percent,
+                          int extra_entries, size_t extra_bytes) {
+    const cache_list_t *list = &cache->lru[segment];
+    if (cache->max_entries) {
+        int share = cache->max_entries * percent / 100;
+        if (list->size + extra_entries > (share > 1 ? share : 1)) {
+            return 1;
         }
     }
-    cache->size = 0;
+    return list->mem_used + extra_bytes > cache->mem_limit / 100 * percent;
 }
 
-int is_cache_entry_stale(cache_t *cache, int index) {
-    if (!cache->entries[index].valid || cache->entries[index].max_age == 0) {
+// Double the bucket array once the load factor passes 1
+static void cache_grow(cache_t *cache) {
+    size_t new_num_buckets = cache->num_buckets * 2;
+    cache_entry_t **new_buckets = calloc(new_num_buckets, sizeof(cache_entry_t *));
+    if (!new_buckets) {
+        return; // Keep the old table, chains just get longer
+    }
+
+    for (size_t i = 0; i < cache->num_buckets; i++) {
+        cache_entry_t *entry = cache->buckets[i];
+        while (entry) {
+            cache_entry_t *next = entry->hash_next;
+            size_t bucket = entry->hash & (new_num_buckets - 1);
+            entry->hash_next = new_buckets[bucket];
+            new_buckets[bucket] = entry;
+            entry = next;
+        }
+    }
+
+    free(cache->buckets);
+    cache->buckets = new_buckets;
+    cache->num_buckets = new_num_buckets;
+}
+
+// Remove an entry from the table and LRU list without freeing it
+static void cache_unlink(cache_t *cache, cache_entry_t *entry) {
+    cache_entry_t **link = &cache->buckets[entry->hash & (cache->num_buckets - 1)];
+    while (*link && *link != entry) {
+        link = &(*link)->hash_next;
+    }
+    if (*link) {
+        *link = entry->hash_next;
+    }
+    lru_unlink(cache, entry);
+    cache->size--;
+}
+
+int is_cache_entry_stale(cache_entry_t *entry) {
+    if (!entry || entry->max_age == 0) {
         return 0; // Not valid or no expiration
     }
     
     uint64_t current_time = get_monotonic_time_ms();
-    uint64_t age_ms = current_time - cache->entries[index].cached_at;
-    uint64_t max_age_ms = (uint64_t)cache->entries[index].max_age * 1000;
+    uint64_t age_ms = current_time - entry->cached_at;
+    uint64_t max_age_ms = (uint64_t)entry->max_age * 1000;
     
     return age_ms > max_age_ms;
 }
 
-int cache_find(cache_t *cache, const char *request, int request_len) {
-    for (int i = 0; i < MAX_CACHE_ENTRIES; i++) {
-        if (cache->entries[i].valid &&
-            cache->entries[i].request_len == request_len &&
-            memcmp(cache->entries[i].request, request, request_len) == 0) {
+/*
+ * Find the value of a header in a header block of the given length. Returns
+ * a pointer to the value with surrounding spaces trimmed, or NULL.
+ */
+const char *find_header(const char *headers, int headers_len,
+                        const char *name, int name_len, int *value_len) {
+    const char *end = headers + headers_len;
+    const char *line = scan_crlf(headers, headers_len);
+    
+    // The first line is the request or status line
+    while (line && line + 2 < end && line[2] != '\r') {
+        line += 2;
+        const char *line_end = scan_crlf(line, end - line);
+        if (!line_end) {
+            return NULL;
+        }
+        
+        if (line_end - line > name_len && line[name_len] == ':' &&
+            scan_casecmp_eq(line, name, name_len)) {
+            const char *value = line + name_len + 1;
+            while (value < line_end && (*value == ' ' || *value == '\t')) value++;
+            const char *value_end = line_end;
+            while (value_end > value && (value_end[-1] == ' ' || value_end[-1] == '\t')) value_end--;
+            *value_len = value_end - value;
+            return value;
+        }
+        line = line_end;
+    }
+    return NULL;
+}
+
+// One directive of a Cache-Control value, arg is NULL without "=value"
+typedef struct {
+    const char *name;
+    int name_len;
+    const char *arg;
+    int arg_len;
+} directive_t;
+
+/*
+ * Split the next directive off a Cache-Control value. Returns where the
+ * one after it starts, or NULL once the value is used up.
+ */
+static const char *next_directive(const char *pos, const char *end, directive_t *directive) {
+    while (pos < end && (*pos == ' ' || *pos == '\t' || *pos == ',')) pos++;
+    if (pos == end) {
+        return NULL;
+    }
+    
+    const char *delimiter = scan_char2(pos, end - pos, ',', '=');
+    const char *name_end = delimiter ? delimiter : end;
+    while (name_end > pos && (name_end[-1] == ' ' || name_end[-1] == '\t')) name_end--;
+    directive->name = pos;
+    directive->name_len = name_end - pos;
+    directive->arg = NULL;
+    directive->arg_len = 0;
+    if (!delimiter || *delimiter == ',') {
+        return delimiter ? delimiter : end;
+    }
+    
+    const char *arg = delimiter + 1;
+    while (arg < end && (*arg == ' ' || *arg == '\t')) arg++;
+    const char *next = scan_char2(arg, end - arg, ',', ',');
+    if (!next) {
+        next = end;
+    }
+    const char *arg_end = next;
+    while (arg_end > arg && (arg_end[-1] == ' ' || arg_end[-1] == '\t')) arg_end--;
+    directive->arg = arg;
+    directive->arg_len = arg_end - arg;
+    return next;
+}
+
+static int directive_is(const directive_t *directive, const char *name) {
+    int name_len = strlen(name);
+    return directive->name_len == name_len && scan_casecmp_eq(directive->name, name, name_len);
+}
+
+/*
+ * Collect the Vary field names of a response header as a lowercase,
+ * comma-separated list. Returns its length, or -1 for "Vary: *" or a list
+ * longer than out_size.
+ */
+static int extract_vary(const char *response, int response_len, char *out, int out_size) {
+    const char *response_end = response + response_len;
+    int out_len = 0;
+    out[0] = '\0';
+    
+    int value_len;
+    const char *value = find_header(response, response_len, "Vary", 4, &value_len);
+    while (value) {
+        const char *value_end = value + value_len;
+        const char *token = value;
+        
+        while (token < value_end) {
+            while (token < value_end && (*token == ',' || *token == ' ' || *token == '\t')) token++;
+            const char *token_end = token;
+            while (token_end < value_end && *token_end != ',' && *token_end != ' ' &&
+                   *token_end != '\t') token_end++;
+            if (token_end == token) {
+                break;
+            }
             
-            // Check if entry is stale
-            if (is_cache_entry_stale(cache, i)) {
-                printf("Stale entry for %s %s\n", 
-                      cache->entries[i].host, 
-                      cache->entries[i].uri);
-                fflush(stdout);
-                
+            if (token_end - token == 1 && *token == '*') {
+                return -1; // Varies on things outside the request
+            }
+            if (out_len + (token_end - token) + 2 > out_size) {
                 return -1;
             }
-            
-            // Update LRU time for valid, non-stale entry
-            cache_update_lru(cache, i);
-            return i;
+            if (out_len > 0) {
+                out[out_len++] = ',';
+            }
+            while (token < token_end) {
+                out[out_len++] = tolower((unsigned char)*token++);
+            }
+            out[out_len] = '\0';
         }
+        
+        // Vary may be repeated, continue after this line
+        value = find_header(value_end, response_end - value_end, "Vary", 4, &value_len);
     }
-    return -1;  // Not found
+    return out_len;
 }
 
-void cache_update_lru(cache_t *cache, int index) {
-    if (index >= 0 && index < MAX_CACHE_ENTRIES && cache->entries[index].valid) {
-        cache->access_sequence++;
-        cache->entries[index].last_accessed = cache->access_sequence;
+/*
+ * Build the variant of a request: its value for every field named in vary,
+ * one per line. Returns the length, or -1 if it does not fit out_size.
+ */
+static int build_variant(const char *vary, const char *request,
+                         const request_parser_t *parsed, char *out, int out_size) {
+    int out_len = 0;
+    out[0] = '\0';
+    
+    while (*vary) {
+        const char *name_end = strchr(vary, ',');
+        if (!name_end) {
+            name_end = vary + strlen(vary);
+        }
+        
+        int value_len = 0;
+        const char *value = request_header(parsed, request, vary, name_end - vary, &value_len);
+        if (out_len + value_len + 2 > out_size) {
+            return -1;
+        }
+        if (value) {
+            memcpy(out + out_len, value, value_len);
+            out_len += value_len;
+        }
+        out[out_len++] = '\n';
+        out[out_len] = '\0';
+        
+        vary = *name_end ? name_end + 1 : name_end;
     }
+    return out_len;
 }
 
-int cache_find_lru(cache_t *cache) {
-    int lru_index = -1;
-    uint64_t oldest_time = UINT64_MAX;
+/*
+ * Whether a request selects the variant stored for a response with the
+ * given Vary field names
+ */
+int cache_variant_matches(const char *vary, const char *variant, const char *request,
+                          const request_parser_t *parsed) {
+    char request_variant[MAX_VARY_SIZE];
     
-    for (int i = 0; i < MAX_CACHE_ENTRIES; i++) {
-        if (cache->entries[i].valid && cache->entries[i].last_accessed < oldest_time) {
-            oldest_time = cache->entries[i].last_accessed;
-            lru_index = i;
-        }
+    if (vary[0] == '\0') {
+        return 1;
     }
+    return build_variant(vary, request, parsed, request_variant, sizeof(request_variant)) >= 0 &&
+           strcmp(request_variant, variant) == 0;
+}
+
+/*
+ * Find the entry for a request whether or not it is stale. Entries for the
+ * same key but a different Vary variant share a bucket, the request's
+ * header fields decide which of them matches.
+ */
+cache_entry_t *cache_lookup(cache_t *cache, const char *key, int key_len,
+                            const char *request, const request_parser_t *parsed) {
+    uint64_t hash = cache_hash(key, key_len);
+    cache_entry_t *entry = cache->buckets[hash & (cache->num_buckets - 1)];
     
-    // If we didn't find a valid entry, find the first invalid one
-    if (lru_index == -1) {
-        for (int i = 0; i < MAX_CACHE_ENTRIES; i++) {
-            if (!cache->entries[i].valid) {
-                return i;
+    while (entry) {
+        if (entry->hash == hash &&
+            entry->key_len == key_len &&
+            memcmp(entry->key, key, key_len) == 0) {
+            if (cache_variant_matches(entry->vary, entry->variant, request, parsed)) {
+                return entry;
             }
         }
+        entry = entry->hash_next;
+    }
+    return NULL;  // Not found
+}
+
+cache_entry_t *cache_find(cache_t *cache, const char *key, int key_len,
+                          const char *request, const request_parser_t *parsed) {
+    // Every request counts towards its key's frequency, found or not
+    if (cache->policy == CACHE_POLICY_TINYLFU) {
+        sketch_increment(&cache->sketch, cache_hash(key, key_len));
+    }
+    
+    cache_entry_t *entry = cache_lookup(cache, key, key_len, request, parsed);
+    if (!entry) {
+        return NULL;
     }
     
-    return lru_index;
+    // Check if entry is stale
+    if (is_cache_entry_stale(entry)) {
+        log_event(LOG_STALE, entry->host, entry->uri);
+        stats_count(STAT_STALE, 1);
+        
+        return NULL;
+    }
+    
+    // Update LRU position for valid, non-stale entry
+    cache_update_lru(cache, entry);
+    return entry;
 }
 
-int cache_add(cache_t *cache, const char *request, int request_len, 
-             const char *response, int response_len,
-             const char *host, const char *uri, uint32_t max_age) {
+/*
+ * The first entry for a key, if it is fresh and its response does not vary,
+ * for a request that has not been parsed. Counted and moved up as by
+ * cache_find(); anything else returns NULL and counts nothing, so the
+ * request can take the full lookup.
+ */
+cache_entry_t *cache_find_plain(cache_t *cache, const char *key, int key_len) {
+    uint64_t hash = cache_hash(key, key_len);
+    cache_entry_t *entry = cache->buckets[hash & (cache->num_buckets - 1)];
     
-    // Check if request is too large to cache
-    if (request_len > MAX_REQUEST_SIZE_TO_CACHE) {
+    while (entry) {
+        if (entry->hash == hash &&
+            entry->key_len == key_len &&
+            memcmp(entry->key, key, key_len) == 0) {
+            if (entry->vary[0] != '\0' || is_cache_entry_stale(entry)) {
+                return NULL;
+            }
+            if (cache->policy == CACHE_POLICY_TINYLFU) {
+                sketch_increment(&cache->sketch, hash);
+            }
+            cache_update_lru(cache, entry);
+            return entry;
+        }
+        entry = entry->hash_next;
+    }
+    return NULL;
+}
+
+/*
+ * Whether a stale entry is still within window seconds past its max-age
+ */
+int is_cache_entry_usable_stale(cache_entry_t *entry, uint32_t window) {
+    if (!entry || entry->max_age == 0 || window == 0) {
         return 0;
     }
     
-    // Check if response is too large to cache
-    if (response_len > MAX_CACHE_ENTRY_SIZE) {
+    uint64_t age_ms = get_monotonic_time_ms() - entry->cached_at;
+    return age_ms <= ((uint64_t)entry->max_age + window) * 1000;
+}
+
+/*
+ * When a response of the given age was generated, the time its entry's
+ * age is counted from
+ */
+static uint64_t freshness_birth_time(const freshness_t *freshness) {
+    uint64_t now = get_monotonic_time_ms();
+    uint64_t age_ms = (uint64_t)freshness->age * 1000;
+    return age_ms < now ? now - age_ms : 0;
+}
+
+/*
+ * Claim the background refresh of a stale entry. Returns 1 if the caller
+ * should start it, 0 if one is already running.
+ */
+int cache_start_refresh(cache_entry_t *entry) {
+    uint64_t now = get_monotonic_time_ms();
+    if (entry->refreshing_since && now - entry->refreshing_since < CACHE_REFRESH_TIMEOUT_MS) {
         return 0;
     }
+    entry->refreshing_since = now;
+    return 1;
+}
+
+/*
+ * The origin confirmed a stale entry is unchanged: its age starts over from
+ * the 304's, and a lifetime given by the 304 replaces the stored one
+ */
+void cache_refresh(cache_t *cache, cache_entry_t *entry, const freshness_t *freshness) {
+    entry->cached_at = freshness_birth_time(freshness);
+    if (freshness->lifetime > 0) {
+        entry->max_age = freshness->lifetime;
+    }
+    entry->refreshing_since = 0;
+    cache_update_lru(cache, entry);
+}
+
+/*
+ * Mark an entry used. Under W-TinyLFU a hit on probation promotes the entry
+ * to the protected list, whose overflow goes back to probation.
+ */
+void cache_update_lru(cache_t *cache, cache_entry_t *entry) {
+    if (!entry) {
+        return;
+    }
+    if (entry->segment != SEGMENT_PROBATION) {
+        if (cache->lru[entry->segment].head != entry) {
+            lru_move(cache, entry, entry->segment);
+        }
+        return;
+    }
+    
+    lru_move(cache, entry, SEGMENT_PROTECTED);
+    int protected_percent = (100 - CACHE_WINDOW_PERCENT) * CACHE_PROTECTED_PERCENT / 100;
+    while (cache->lru[SEGMENT_PROTECTED].size > 1 &&
+           lru_over_share(cache, SEGMENT_PROTECTED, protected_percent, 0, 0)) {
+        lru_move(cache, cache->lru[SEGMENT_PROTECTED].tail, SEGMENT_PROBATION);
+    }
+}
+
+/*
+ * The entry to give up to make room for one of incoming bytes. Under
+ * W-TinyLFU, when the window is full its oldest entry contests main's next
+ * victim: the sketch decides which was asked for more often, the winner
+ * stays (the window's entry moving to probation) and the other goes.
+ */
+static cache_entry_t *cache_choose_victim(cache_t *cache, size_t incoming) {
+    cache_entry_t *oldest = cache->lru[SEGMENT_WINDOW].tail;
+    if (cache->policy == CACHE_POLICY_LRU) {
+        return oldest;
+    }
     
-    int index;
+    cache_entry_t *victim = cache->lru[SEGMENT_PROBATION].tail;
+    if (!victim) {
+        victim = cache->lru[SEGMENT_PROTECTED].tail;
+    }
+    if (!victim) {
+        return oldest;
+    }
+    if (!oldest || !lru_over_share(cache, SEGMENT_WINDOW, CACHE_WINDOW_PERCENT, 1, incoming)) {
+        return victim;
+    }
     
-    // If cache is not full, find an empty slot
-    if (cache->size < MAX_CACHE_ENTRIES) {
-        for (int i = 0; i < MAX_CACHE_ENTRIES; i++) {
-            if (!cache->entries[i].valid) {
-                index = i;
-                cache->size++;
-                break;
+    if (sketch_frequency(&cache->sketch, oldest->hash) >
+        sketch_frequency(&cache->sketch, victim->hash)) {
+        lru_move(cache, oldest, SEGMENT_PROBATION);
+        return victim;
+    }
+    stats_count(STAT_REJECTED, 1);
+    return oldest;
+}
+
+/*
+ * Drop a reference on each chunk from first through last, or to the end of
+ * the chain if last is NULL, freeing the chunks no one holds any more.
+ * Returns the slab bytes of the chunks walked. The cache lock must be held.
+ */
+size_t cache_chunks_put(cache_t *cache, cache_chunk_t *first, cache_chunk_t *last) {
+    size_t walked = 0;
+    cache_chunk_t *chunk = first;
+    while (chunk) {
+        cache_chunk_t *next = chunk == last ? NULL : chunk->next;
+        size_t mem_size = sizeof(cache_chunk_t) + chunk->capacity;
+        walked += mem_size;
+        if (__atomic_sub_fetch(&chunk->refs, 1, __ATOMIC_ACQ_REL) == 0) {
+            if (chunk->sent_from_file) {
+                slab_discard(&cache->slab, chunk->data, chunk->capacity);
             }
+            slab_free(&cache->slab, chunk);
+            cache->mem_used -= mem_size;
         }
-    } else {
-        // Cache is full, find LRU entry to evict
-        index = cache_find_lru(cache);
-        
-        // Log eviction
-        if (cache->entries[index].valid) {
-            printf("Evicting %s %s from cache\n", 
-                  cache->entries[index].host, 
-                  cache->entries[index].uri);
-            fflush(stdout);
-            
-            // Free old entry
-            free(cache->entries[index].request);
-            free(cache->entries[index].response);
-            free(cache->entries[index].host);
-            free(cache->entries[index].uri);
-        }
+        chunk = next;
     }
-    
-    // Copy request
-    cache->entries[index].request = malloc(request_len);
-    if (!cache->entries[index].request) {
-        perror("malloc");
+    return walked;
+}
+
+/*
+ * Take a reference on every chunk of an entry's response, so it can be
+ * sent with the lock dropped even if the entry is evicted meanwhile. Give
+ * them back with cache_chunks_put(). Called with the cache locked.
+ */
+cache_chunk_t *cache_hold_response(cache_entry_t *entry) {
+    for (cache_chunk_t *chunk = entry->chunks; chunk; chunk = chunk->next) {
+        cache_chunk_get(chunk);
+    }
+    return entry->chunks;
+}
+
+/*
+ * The whole pages of the cache file within len bytes at data, when there are
+ * enough of them to be worth a sendfile(). Returns their length, or 0, and
+ * sets skip to the bytes before them and file_offset to where they start.
+ */
+size_t cache_file_span(cache_t *cache, const char *data, size_t len, size_t *skip,
+                       off_t *file_offset) {
+    slab_t *slab = &cache->slab;
+    if (slab->fd < 0) {
         return 0;
     }
-    memcpy(cache->entries[index].request, request, request_len);
-    cache->entries[index].request_len = request_len;
-    
-    // Copy response
-    cache->entries[index].response = malloc(response_len);
-    if (!cache->entries[index].response) {
-        free(cache->entries[index].request);
-        perror("malloc");
+    size_t start = data - slab->arena;
+    size_t first = (start + slab->file_page - 1) / slab->file_page * slab->file_page;
+    size_t end = (start + len) / slab->file_page * slab->file_page;
+    if (end < first + CACHE_SENDFILE_MIN) {
         return 0;
     }
-    memcpy(cache->entries[index].response, response, response_len);
-    cache->entries[index].response_len = response_len;
+    *skip = first - start;
+    *file_offset = first;
+    return end - first;
+}
+
+/*
+ * Drop an entry from the cache and release its memory. Chunks still being
+ * sent are freed, and leave the byte count, once the last sender is done.
+ */
+void cache_remove(cache_t *cache, cache_entry_t *entry) {
+    cache_unlink(cache, entry);
+    size_t chunks_size = cache_chunks_put(cache, entry->chunks, NULL);
+    cache->mem_used -= entry->mem_size - chunks_size;
+    slab_free(&cache->slab, entry);
+}
+
+/*
+ * Drop an entry from the cache, logging the eviction
+ */
+void cache_evict(cache_t *cache, cache_entry_t *entry) {
+    log_event(LOG_EVICTING, entry->host, entry->uri);
+    stats_count(STAT_EVICTIONS, 1);
     
-    // Store host and URI for logging
-    cache->entries[index].host = strdup(host);
-    cache->entries[index].uri = strdup(uri);
+    cache_remove(cache, entry);
+}
+
+/*
+ * Evict an entry, moving it to the disk tier if there is one and the entry
+ * is still fresh. The response is copied there by cache_unlock(), or at
+ * once if copy_now is set because its chunks are needed at once.
+ */
+static void cache_demote(cache_t *cache, cache_entry_t *entry, int copy_now) {
+    disk_write_t *write = NULL;
+    if (cache->disk.enabled && !is_cache_entry_stale(entry)) {
+        char *dest;
+        disk_entry_t *record = disk_store(&cache->disk, entry, &dest);
+        write = record && !copy_now ? malloc(sizeof(disk_write_t)) : NULL;
+        if (write) {
+            // Copied by cache_unlock()
+            write->record = record;
+            write->dest = dest;
+            write->chunks = cache_hold_response(entry);
+            write->next = disk_writes;
+            disk_writes = write;
+        } else if (record) {
+            copy_chunks(entry->chunks, dest);
+            disk_commit(&cache->disk, record);
+        }
+    }
+    cache_evict(cache, entry);
+    
+    // Chunks no sender holds come free once the write is done
+    for (cache_chunk_t *chunk = write ? write->chunks : NULL; chunk; chunk = chunk->next) {
+        if (__atomic_load_n(&chunk->refs, __ATOMIC_ACQUIRE) == 1) {
+            disk_write_bytes += sizeof(cache_chunk_t) + chunk->capacity;
+        }
+    }
+}
+
+/*
+ * Make room for incoming bytes by evicting the entry the policy chooses
+ */
+static void cache_evict_next(cache_t *cache, size_t incoming) {
+    cache_demote(cache, cache_choose_victim(cache, incoming), 0);
+}
+
+// Lists from least to most worth keeping, each walked from its least
+// recently used end: the order entries are saved in and looked at for
+// eviction by size class
+static const cache_segment_t keep_order[CACHE_NUM_SEGMENTS] = {
+    SEGMENT_PROBATION, SEGMENT_PROTECTED, SEGMENT_WINDOW,
+};
+
+// The next item after item that evicting entry would free: the entry, then
+// each chunk no one else holds. Start from NULL; NULL means no more.
+static void *next_freed_item(cache_entry_t *entry, void *item) {
+    if (!item) {
+        return entry;
+    }
+    cache_chunk_t *chunk = item == entry ? entry->chunks : ((cache_chunk_t *)item)->next;
+    while (chunk && __atomic_load_n(&chunk->refs, __ATOMIC_ACQUIRE) > 1) {
+        chunk = chunk->next;
+    }
+    return chunk;
+}
+
+/*
+ * Free an item of mem_size bytes when its size class has none and no page
+ * is left for it, evicting from the CACHE_EVICT_SEARCH coldest entries
+ * rather than down the whole cache in policy order. The first that holds
+ * an item of that class is enough. Failing that, the page those entries
+ * alone fill for the fewest bytes goes back to the pool for any class, if
+ * that takes no more than CACHE_EVICT_PAGES pages of entries. Returns
+ * whether anything was evicted.
+ */
+static int cache_evict_for_class(cache_t *cache, size_t mem_size) {
+    slab_t *slab = &cache->slab;
+    cache_page_tally_t *tally = cache->page_tally;
+    for (int page = 0; page < slab->num_pages; page++) {
+        tally[page].items = 0;
+        tally[page].last_owner = -1;
+        tally[page].owners_size = 0;
+    }
     
-    // Set time and validity
-    cache->access_sequence++;
-    cache->entries[index].last_accessed = cache->access_sequence;
-    cache->entries[index].cached_at = get_monotonic_time_ms();
-    cache->entries[index].max_age = max_age;
-    cache->entries[index].valid = 1;
+    int seen = 0;
+    for (int i = 0; i < CACHE_NUM_SEGMENTS; i++) {
+        for (cache_entry_t *entry = cache->lru[keep_order[i]].tail;
+             entry && seen < CACHE_EVICT_SEARCH; entry = entry->lru_prev, seen++) {
+            for (void *item = next_freed_item(entry, NULL); item;
+                 item = next_freed_item(entry, item)) {
+                int page = slab_page_of(slab, item);
+                if (slab->classes[slab->pages[page].class_id].item_size == mem_size) {
+                    cache_demote(cache, entry, 1);
+                    return 1;
+                }
+                tally[page].items++;
+                if (tally[page].last_owner != seen) {
+                    tally[page].last_owner = seen;
+                    tally[page].owners_size += entry->mem_size;
+                }
+            }
+        }
+    }
     
+    // Items held by senders, bodies being filled or other entries keep a
+    // page from emptying
+    int best = -1;
+    for (int page = 0; page < slab->num_pages; page++) {
+        if (tally[page].items > 0 && tally[page].items == slab->pages[page].used &&
+            tally[page].owners_size <= CACHE_EVICT_PAGES * slab->page_size &&
+            (best < 0 || tally[page].owners_size < tally[best].owners_size)) {
+            best = page;
+        }
+    }
+    if (best < 0) {
+        return 0;
+    }
+    
+    seen = 0;
+    for (int i = 0; i < CACHE_NUM_SEGMENTS; i++) {
+        cache_entry_t *entry = cache->lru[keep_order[i]].tail;
+        while (entry && seen < CACHE_EVICT_SEARCH) {
+            cache_entry_t *next = entry->lru_prev;
+            void *item = next_freed_item(entry, NULL);
+            while (item && slab_page_of(slab, item) != best) {
+                item = next_freed_item(entry, item);
+            }
+            if (item) {
+                cache_demote(cache, entry, 1);
+            }
+            entry = next;
+            seen++;
+        }
+    }
     return 1;
 }
 
-int cache_prepare_eviction_if_needed(cache_t *cache, int request_len) {
-    // Check if request is too large to cache
-    if (request_len > MAX_REQUEST_SIZE_TO_CACHE) {
-        return 0;
+/*
+ * Allocate a slab item of len bytes, evicting until one is free and its
+ * size fits the limits. Returns the item and its slab size, or NULL, also
+ * when the memory is held by this thread's disk writes: the caller then
+ * finishes them and tries again.
+ */
+static void *cache_alloc(cache_t *cache, size_t len, size_t *mem_size) {
+    *mem_size = slab_class_size(&cache->slab, len);
+    if (*mem_size == 0) {
+        return NULL;
+    }
+    while (cache->size > 0 &&
+           cache->mem_used - disk_write_bytes + *mem_size > cache->mem_limit) {
+        cache_evict_next(cache, *mem_size);
     }
     
-    // If cache is full, we need to evict regardless
-    if (cache->size >= MAX_CACHE_ENTRIES) {
-        int index = cache_find_lru(cache);
+    // A free item of this size class may still be missing
+    void *item = slab_alloc(&cache->slab, len);
+    if (!item && cache->size > 0 && !disk_writes && cache_evict_for_class(cache, *mem_size)) {
+        item = slab_alloc(&cache->slab, len);
+    }
+    if (item) {
+        cache->mem_used += *mem_size;
+    }
+    return item;
+}
+
+/*
+ * Room for the next bytes of a response at the end of its body, in the last
+ * chunk or a new one once that is full: sized to what remains when the
+ * length is known, otherwise to the hint of how many bytes are coming or
+ * doubling from CACHE_CHUNK_MIN, whichever is larger. Takes the cache
+ * lock only to allocate, so it must not be held. Returns the free space,
+ * its size in *space, or NULL once the body reaches the object size limit,
+ * unless it is unbounded, or memory runs out; the body is then released and
+ * marked failed.
+ */
+char *cache_body_reserve(cache_t *cache, cache_body_t *body, int hint, int *space) {
+    if (body->failed) {
+        return NULL;
+    }
+    if (!body->unbounded && (size_t)body->len >= cache->max_object_size) {
+        goto fail;
+    }
+    
+    cache_chunk_t *tail = body->tail;
+    if (!tail || tail->len == tail->capacity) {
+        long want = tail ? (long)tail->capacity * 2 : CACHE_CHUNK_MIN;
+        if (body->expected > body->len) {
+            want = body->expected - body->len;
+        } else if (hint > want) {
+            want = hint;
+        }
+        if (want > CACHE_CHUNK_SIZE) {
+            want = CACHE_CHUNK_SIZE;
+        }
         
-        // Log evict message
-        if (index >= 0 && cache->entries[index].valid) {
-            printf("Evicting %s %s from cache\n", 
-                  cache->entries[index].host, 
-                  cache->entries[index].uri);
-            fflush(stdout);
-            
-            // Free old entry
-            free(cache->entries[index].request);
-            free(cache->entries[index].response);
-            free(cache->entries[index].host);
-            free(cache->entries[index].uri);
-            cache->entries[index].valid = 0;
-            cache->size--;
+        size_t mem_size;
+        cache_lock(cache);
+        tail = cache_alloc(cache, sizeof(cache_chunk_t) + want, &mem_size);
+        if (!tail && disk_writes) {
+            // Unlocking copies out the responses moved to disk, freeing
+            // their chunks
+            cache_unlock(cache);
+            cache_lock(cache);
+            tail = cache_alloc(cache, sizeof(cache_chunk_t) + want, &mem_size);
         }
-        return 1;
+        cache_unlock(cache);
+        if (!tail) {
+            goto fail;
+        }
+        tail->next = NULL;
+        tail->len = 0;
+        tail->capacity = mem_size - sizeof(cache_chunk_t);
+        tail->refs = 1;
+        tail->sent_from_file = 0;
+        if (body->tail) {
+            body->tail->next = tail;
+        } else {
+            body->head = tail;
+        }
+        body->tail = tail;
+        body->mem_size += mem_size;
+    }
+    
+    *space = tail->capacity - tail->len;
+    if (!body->unbounded && (size_t)(body->len + *space) > cache->max_object_size) {
+        *space = cache->max_object_size - body->len;
     }
+    return tail->data + tail->len;
     
+fail:
+    cache_lock(cache);
+    cache_body_release(cache, body);
+    cache_unlock(cache);
+    body->failed = 1;
+    return NULL;
+}
+
+/*
+ * The first len bytes of the space cache_body_reserve() gave were filled
+ */
+void cache_body_commit(cache_body_t *body, int len) {
+    body->tail->len += len;
+    body->len += len;
+}
+
+/*
+ * Keep a copy of len bytes at the end of a body. Returns 0, or -1 if the
+ * body failed.
+ */
+int cache_body_append(cache_t *cache, cache_body_t *body, const char *data, int len) {
+    while (len > 0) {
+        int space;
+        char *dest = cache_body_reserve(cache, body, len, &space);
+        if (!dest) {
+            return -1;
+        }
+        int n = space < len ? space : len;
+        memcpy(dest, data, n);
+        cache_body_commit(body, n);
+        data += n;
+        len -= n;
+    }
     return 0;
 }
 
-uint32_t extract_max_age(const char *response_header) {
-    // Find Cache-Control header
-    char *cache_control_start = strcasestr(response_header, "Cache-Control:");
-    if (!cache_control_start) {
+/*
+ * Give up a body's references on its chunks, leaving it empty. The cache
+ * lock must be held.
+ */
+void cache_body_release(cache_t *cache, cache_body_t *body) {
+    cache_chunks_put(cache, body->head, NULL);
+    body->head = body->tail = NULL;
+    body->len = 0;
+    body->mem_size = 0;
+}
+
+/*
+ * Copy an entry described by fields into the cache with body as its
+ * response, evicting as needed. Only the strings and freshness fields of
+ * fields are used. The body's chunks pass to the entry, or are released if
+ * it cannot be added.
+ */
+static int cache_insert(cache_t *cache, const cache_entry_t *fields, cache_body_t *body) {
+    size_t vary_len = strlen(fields->vary);
+    size_t variant_len = strlen(fields->variant);
+    size_t etag_len = strlen(fields->etag);
+    size_t last_modified_len = strlen(fields->last_modified);
+    size_t host_len = strlen(fields->host) + 1;
+    size_t uri_len = strlen(fields->uri) + 1;
+    size_t entry_len = sizeof(cache_entry_t) + fields->key_len + vary_len + 1 + variant_len + 1 +
+                       etag_len + 1 + last_modified_len + 1 + host_len + uri_len;
+    
+    // Evict entries until the new one fits the entry limit, cache_alloc()
+    // sees to the byte limit
+    while (cache->size > 0 && cache->max_entries && cache->size >= cache->max_entries) {
+        cache_evict_next(cache, 0);
+    }
+    size_t mem_size;
+    cache_entry_t *entry = cache_alloc(cache, entry_len, &mem_size);
+    if (!entry && disk_writes) {
+        // The caller holds the lock throughout, so the responses moved to
+        // disk are copied under it to free their chunks
+        commit_disk_writes(cache, copy_disk_writes());
+        entry = cache_alloc(cache, entry_len, &mem_size);
+    }
+    if (!entry) {
+        cache_body_release(cache, body);
         return 0;
     }
+    memset(entry, 0, sizeof(cache_entry_t));
     
-    cache_control_start += 14; // Skip "Cache-Control:"
-    while (*cache_control_start == ' ' || *cache_control_start == '\t') {
-        cache_control_start++;
+    // The read that found the end of the response may have left its last
+    // chunk empty
+    if (body->tail && body->tail->len == 0) {
+        cache_chunk_t **link = &body->head;
+        while (*link != body->tail) {
+            link = &(*link)->next;
+        }
+        *link = NULL;
+        body->mem_size -= cache_chunks_put(cache, body->tail, body->tail);
+        body->tail = NULL;
     }
+    entry->mem_size = mem_size + body->mem_size;
     
-    char *line_end = strstr(cache_control_start, "\r\n");
-    if (!line_end) {
-        return 0;
+    // Copy key, variant, validators, host and uri behind the entry
+    char *data = (char *)(entry + 1);
+    entry->key = data;
+    memcpy(entry->key, fields->key, fields->key_len);
+    entry->key_len = fields->key_len;
+    entry->hash = cache_hash(fields->key, fields->key_len);
+    data += fields->key_len;
+    
+    entry->vary = data;
+    memcpy(entry->vary, fields->vary, vary_len + 1);
+    data += vary_len + 1;
+    entry->variant = data;
+    memcpy(entry->variant, fields->variant, variant_len + 1);
+    data += variant_len + 1;
+    
+    entry->etag = data;
+    memcpy(entry->etag, fields->etag, etag_len + 1);
+    data += etag_len + 1;
+    entry->last_modified = data;
+    memcpy(entry->last_modified, fields->last_modified, last_modified_len + 1);
+    data += last_modified_len + 1;
+    
+    // Store host and URI for logging
+    entry->host = data;
+    memcpy(entry->host, fields->host, host_len);
+    data += host_len;
+    entry->uri = data;
+    memcpy(entry->uri, fields->uri, uri_len);
+    data += uri_len;
+    
+    entry->chunks = body->head;
+    entry->response_len = body->len;
+    body->head = body->tail = NULL;
+    body->len = 0;
+    body->mem_size = 0;
+    
+    entry->delimited = fields->delimited;
+    entry->cached_at = fields->cached_at;
+    entry->max_age = fields->max_age;
+    entry->stale_while_revalidate = fields->stale_while_revalidate;
+    entry->stale_if_error = fields->stale_if_error;
+    
+    if ((size_t)cache->size >= cache->num_buckets) {
+        cache_grow(cache);
+    }
+    
+    size_t bucket = entry->hash & (cache->num_buckets - 1);
+    entry->hash_next = cache->buckets[bucket];
+    cache->buckets[bucket] = entry;
+    lru_push_head(cache, entry, SEGMENT_WINDOW);
+    cache->size++;
+    
+    // While the cache has room, entries leaving the window go on probation
+    // without a contest
+    if (cache->policy == CACHE_POLICY_TINYLFU) {
+        while (cache->lru[SEGMENT_WINDOW].size > 1 &&
+               lru_over_share(cache, SEGMENT_WINDOW, CACHE_WINDOW_PERCENT, 0, 0)) {
+            lru_move(cache, cache->lru[SEGMENT_WINDOW].tail, SEGMENT_PROBATION);
+        }
     }
     
-    // Extract Cache-Control tag
-    int value_len = line_end - cache_control_start;
-    char cache_control_value[value_len + 1];
-    strncpy(cache_control_value, cache_control_start, value_len);
-    cache_control_value[value_len] = '\0';
+    return 1;
+}
+
+/*
+ * Add a response for a request, its header given apart from the body that
+ * holds the whole response. The request's parsed header is needed to
+ * record its variant when the response carries a Vary header. The body's
+ * chunks pass to the cache either way.
+ */
+int cache_add(cache_t *cache, const char *key, int key_len,
+             const char *request, const request_parser_t *parsed,
+             const char *header, int header_len, cache_body_t *body,
+             const char *host, const char *uri, const freshness_t *freshness) {
     
-    // Look for max-age directive
-    char *max_age_pos = strcasestr(cache_control_value, "max-age");
-    if (!max_age_pos) {
-        return 0; // No max-age directive
+    // Check if key or response is too large to cache
+    if (key_len > MAX_REQUEST_SIZE_TO_CACHE || body->failed ||
+        (size_t)body->len > cache->max_object_size) {
+        cache_body_release(cache, body);
+        return 0;
     }
     
-    // Find the equals sign
-    char *equals_pos = strchr(max_age_pos, '=');
-    if (!equals_pos) {
-        return 0; // Invalid max-age directive
+    char vary[MAX_VARY_SIZE];
+    char variant[MAX_VARY_SIZE];
+    int vary_len = extract_vary(header, header_len, vary, sizeof(vary));
+    if (vary_len < 0 || build_variant(vary, request, parsed, variant, sizeof(variant)) < 0) {
+        cache_body_release(cache, body);
+        return 0;
     }
     
-    equals_pos++; // Skip the '='
-    while (*equals_pos == ' ' || *equals_pos == '\t') {
-        equals_pos++; // Skip whitespace after =
+    // Validators too long to keep just mean no revalidation
+    char etag[MAX_VALIDATOR_SIZE];
+    char last_modified[MAX_VALIDATOR_SIZE];
+    int value_len;
+    const char *value = find_header(header, header_len, "ETag", 4, &value_len);
+    etag[0] = '\0';
+    if (value && value_len < MAX_VALIDATOR_SIZE) {
+        memcpy(etag, value, value_len);
+        etag[value_len] = '\0';
+    }
+    value = find_header(header, header_len, "Last-Modified", 13, &value_len);
+    last_modified[0] = '\0';
+    if (value && value_len < MAX_VALIDATOR_SIZE) {
+        memcpy(last_modified, value, value_len);
+        last_modified[value_len] = '\0';
     }
     
-    // Parse the number
-    char *end_ptr;
-    long max_age_value = strtol(equals_pos, &end_ptr, 10);
+    cache_entry_t fields = {
+        .key = (char *)key,
+        .key_len = key_len,
+        .vary = vary,
+        .variant = variant,
+        .etag = etag,
+        .last_modified = last_modified,
+        .host = (char *)host,
+        .uri = (char *)uri,
+        .cached_at = freshness_birth_time(freshness),
+        .max_age = freshness->lifetime > 0 ? (uint32_t)freshness->lifetime : 0,
+    };
+    
+    // Without a length or chunked coding the client relies on the close
+    const char *transfer_encoding = find_header(header, header_len, "Transfer-Encoding", 17,
+                                                &value_len);
+    fields.delimited = find_header(header, header_len, "Content-Length", 14, &value_len) ||
+                       (transfer_encoding && value_len >= 7 &&
+                        strncasecmp(transfer_encoding + value_len - 7, "chunked", 7) == 0);
     
-    // Check we got a valid number
-    if (end_ptr == equals_pos || max_age_value < 0) {
+    // How long the entry may be served stale, the proxy's grace period
+    // unless the response says otherwise
+    fields.stale_while_revalidate = freshness->stale_while_revalidate >= 0 ?
+                                    freshness->stale_while_revalidate : cache->grace;
+    fields.stale_if_error = freshness->stale_if_error >= 0 ?
+                            freshness->stale_if_error : cache->grace;
+    
+    if (!cache_insert(cache, &fields, body)) {
         return 0;
     }
     
-    // Ensure it fits in uint32_t
-    if (max_age_value > UINT32_MAX) {
-        return UINT32_MAX;
+    // The new response replaces any copy on disk
+    if (cache->disk.enabled) {
+        disk_remove(&cache->disk, key, key_len, request, parsed);
     }
     
-    return (uint32_t)max_age_value;
+    return 1;
 }
 
-// Stage 3: Check if response is cacheable
-int is_cacheable_response(const char *response_header) {
-    // Check "Cache-Control" header
-    char *cache_control_start = strcasestr(response_header, "Cache-Control:");
-    if (!cache_control_start) {
-        // No "Cache-Control", respect response
-        return 1;
+// One snapshot record: the fixed part, then the strings and response
+static void write_snapshot_record(FILE *file, const cache_entry_t *entry) {
+    cache_snapshot_record_t record = {
+        .cached_at = entry->cached_at,
+        .max_age = entry->max_age,
+        .stale_while_revalidate = entry->stale_while_revalidate,
+        .stale_if_error = entry->stale_if_error,
+        .delimited = entry->delimited,
+        .key_len = entry->key_len,
+        .vary_len = strlen(entry->vary),
+        .variant_len = strlen(entry->variant),
+        .etag_len = strlen(entry->etag),
+        .last_modified_len = strlen(entry->last_modified),
+        .host_len = strlen(entry->host),
+        .uri_len = strlen(entry->uri),
+        .response_len = entry->response_len,
+    };
+    fwrite(&record, sizeof(record), 1, file);
+    fwrite(entry->key, 1, record.key_len, file);
+    fwrite(entry->vary, 1, record.vary_len + 1, file);
+    fwrite(entry->variant, 1, record.variant_len + 1, file);
+    fwrite(entry->etag, 1, record.etag_len + 1, file);
+    fwrite(entry->last_modified, 1, record.last_modified_len + 1, file);
+    fwrite(entry->host, 1, record.host_len + 1, file);
+    fwrite(entry->uri, 1, record.uri_len + 1, file);
+    for (const cache_chunk_t *chunk = entry->chunks; chunk; chunk = chunk->next) {
+        fwrite(chunk->data, 1, chunk->len, file);
     }
+}
 
-    cache_control_start += 14;
-    while (*cache_control_start == ' ' || *cache_control_start == '\t') {
-        cache_control_start++;
+/*
+ * Write the entries that are still fresh to a snapshot file, least worth
+ * keeping first so loading them in order restores the eviction order. The
+ * file is written beside path and renamed over it once complete.
+ */
+int cache_save(cache_t *cache, const char *path) {
+    char tmp_path[strlen(path) + 5];
+    snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", path);
+    
+    FILE *file = fopen(tmp_path, "wb");
+    if (!file) {
+        perror("fopen snapshot");
+        return -1;
     }
     
-    char *line_end = strstr(cache_control_start, "\r\n");
-    if (!line_end) {
-        return 1; // Treat it as cacheable just in case
+    cache_snapshot_header_t header = {
+        .magic = CACHE_SNAPSHOT_MAGIC,
+        .version = CACHE_SNAPSHOT_VERSION,
+        .num_entries = 0,
+    };
+    for (int i = 0; i < CACHE_NUM_SEGMENTS; i++) {
+        for (cache_entry_t *entry = cache->lru[keep_order[i]].tail; entry;
+             entry = entry->lru_prev) {
+            if (!is_cache_entry_stale(entry)) {
+                header.num_entries++;
+            }
+        }
+    }
+    fwrite(&header, sizeof(header), 1, file);
+    
+    for (int i = 0; i < CACHE_NUM_SEGMENTS; i++) {
+        for (cache_entry_t *entry = cache->lru[keep_order[i]].tail; entry;
+             entry = entry->lru_prev) {
+            if (!is_cache_entry_stale(entry)) {
+                write_snapshot_record(file, entry);
+            }
+        }
+    }
+    
+    if (ferror(file) | fclose(file)) {
+        perror("write snapshot");
+        unlink(tmp_path);
+        return -1;
+    }
+    if (rename(tmp_path, path) < 0) {
+        perror("rename snapshot");
+        unlink(tmp_path);
+        return -1;
+    }
+    return 0;
+}
+
+// Take a NUL-terminated field of len bytes off the front of a snapshot record
+static char *snapshot_string(const char **data, const char *end, uint32_t len) {
+    if ((size_t)(end - *data) <= len || (*data)[len] != '\0') {
+        return NULL;
+    }
+    char *value = (char *)*data;
+    *data += len + 1;
+    return value;
+}
+
+/*
+ * Load the entries of a snapshot written by cache_save(). Entries that have
+ * expired since are skipped, the rest keep their remaining lifetime. A
+ * missing file is an empty snapshot. Returns the number of entries loaded,
+ * -1 if the file is unusable.
+ */
+int cache_load(cache_t *cache, const char *path) {
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        if (errno == ENOENT) {
+            return 0;
+        }
+        perror("open snapshot");
+        return -1;
     }
     
-    // Extract the value of Cache-Control
-    int value_len = line_end - cache_control_start;
-    char cache_control_value[value_len + 1];
-    strncpy(cache_control_value, cache_control_start, value_len);
-    cache_control_value[value_len] = '\0';
+    struct stat st;
+    if (fstat(fd, &st) < 0 || (size_t)st.st_size < sizeof(cache_snapshot_header_t)) {
+        fprintf(stderr, "Snapshot %s is not a cache snapshot\n", path);
+        close(fd);
+        return -1;
+    }
+    const char *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        perror("mmap snapshot");
+        return -1;
+    }
+    madvise((void *)map, st.st_size, MADV_SEQUENTIAL);
     
-    // Convert to lowercase
-    for (int i = 0; i < value_len; i++) {
-        cache_control_value[i] = tolower(cache_control_value[i]);
+    cache_snapshot_header_t header;
+    memcpy(&header, map, sizeof(header));
+    if (header.magic != CACHE_SNAPSHOT_MAGIC || header.version != CACHE_SNAPSHOT_VERSION) {
+        fprintf(stderr, "Snapshot %s is not a cache snapshot\n", path);
+        munmap((void *)map, st.st_size);
+        return -1;
     }
     
-    // Check for directives
-    char *check_directive = cache_control_value;
-    while (check_directive && *check_directive) {
-        // Skip whitespace and commas
-        while (*check_directive == ' ' || *check_directive == '\t' || *check_directive == ',') {
-            check_directive++;
+    const char *data = map + sizeof(header);
+    const char *end = map + st.st_size;
+    uint64_t now = get_monotonic_time_ms();
+    int loaded = 0;
+    
+    for (uint32_t i = 0; i < header.num_entries; i++) {
+        cache_snapshot_record_t record;
+        if ((size_t)(end - data) < sizeof(record)) {
+            break;
         }
+        memcpy(&record, data, sizeof(record));
+        data += sizeof(record);
         
-        if (*check_directive == '\0') break;
-        
-        // Checking directives starting now
-        if (strncmp(check_directive, "private", 7) == 0) {
-            char next_char = check_directive[7];
-            if (next_char == '\0' || next_char == ' ' || next_char == '\t' || 
-                next_char == ',' || next_char == '=') {
-                return 0; // private directive
-            }
+        cache_entry_t fields = {
+            .key_len = record.key_len,
+            .cached_at = record.cached_at,
+            .max_age = record.max_age,
+            .stale_while_revalidate = record.stale_while_revalidate,
+            .stale_if_error = record.stale_if_error,
+            .delimited = record.delimited,
+        };
+        if ((size_t)(end - data) < record.key_len) {
+            break;
         }
-        
-        if (strncmp(check_directive, "no-store", 8) == 0) {
-            char next_char = check_directive[8];
-            if (next_char == '\0' || next_char == ' ' || next_char == '\t' || 
-                next_char == ',' || next_char == '=') {
-                return 0; // no-store directive
-            }
+        fields.key = (char *)data;
+        data += record.key_len;
+        if (!(fields.vary = snapshot_string(&data, end, record.vary_len)) ||
+            !(fields.variant = snapshot_string(&data, end, record.variant_len)) ||
+            !(fields.etag = snapshot_string(&data, end, record.etag_len)) ||
+            !(fields.last_modified = snapshot_string(&data, end, record.last_modified_len)) ||
+            !(fields.host = snapshot_string(&data, end, record.host_len)) ||
+            !(fields.uri = snapshot_string(&data, end, record.uri_len)) ||
+            (size_t)(end - data) < record.response_len) {
+            break;
         }
+        const char *response = data;
+        data += record.response_len;
         
-        if (strncmp(check_directive, "no-cache", 8) == 0) {
-            char next_char = check_directive[8];
-            if (next_char == '\0' || next_char == ' ' || next_char == '\t' || 
-                next_char == ',' || next_char == '=') {
-                return 0; // no-cache directive
-            }
+        // Expired while the proxy was down, or no longer fits the limits
+        if (record.max_age && now - record.cached_at > (uint64_t)record.max_age * 1000) {
+            continue;
         }
-        
-        if (strncmp(check_directive, "max-age=0", 9) == 0) {
-            char next_char = check_directive[9];
-            if (next_char == '\0' || next_char == ' ' || next_char == '\t' || next_char == ',') {
-                return 0; // max-age=0 directive
-            }
+        if (record.key_len > MAX_REQUEST_SIZE_TO_CACHE ||
+            record.response_len > cache->max_object_size) {
+            continue;
         }
-        
-        if (strncmp(check_directive, "must-revalidate", 15) == 0) {
-            char next_char = check_directive[15];
-            if (next_char == '\0' || next_char == ' ' || next_char == '\t' || 
-                next_char == ',' || next_char == '=') {
-                return 0; // must-revalidate directive
-            }
+        cache_body_t body = {.expected = record.response_len};
+        if (cache_body_append(cache, &body, response, record.response_len) < 0) {
+            continue;
+        }
+        cache_lock(cache);
+        loaded += cache_insert(cache, &fields, &body);
+        cache_unlock(cache);
+    }
+    
+    munmap((void *)map, st.st_size);
+    return loaded;
+}
+
+int cache_prepare_eviction_if_needed(cache_t *cache, int request_len) {
+    // Check if request is too large to cache
+    if (request_len > MAX_REQUEST_SIZE_TO_CACHE) {
+        return 0;
+    }
+    
+    // If cache is full, we need to evict regardless
+    if (cache->max_entries && cache->size >= cache->max_entries) {
+        cache_evict_next(cache, 0);
+        return 1;
+    }
+    
+    return 0;
+}
+
+/*
+ * Seconds of a delta-seconds value (a directive argument or Age), or -1 if
+ * it is not one. Values too large are capped at 2^31 as RFC 9111 allows.
+ */
+static long delta_seconds(const char *value, int len) {
+    // A quoted argument is tolerated
+    if (len >= 2 && value[0] == '"' && value[len - 1] == '"') {
+        value++;
+        len -= 2;
+    }
+    if (len == 0) {
+        return -1;
+    }
+    
+    long seconds = 0;
+    for (int i = 0; i < len; i++) {
+        if (value[i] < '0' || value[i] > '9') {
+            return -1;
+        }
+        if (seconds < DELTA_SECONDS_MAX) {
+            seconds = seconds * 10 + (value[i] - '0');
+        }
+    }
+    return seconds < DELTA_SECONDS_MAX ? seconds : DELTA_SECONDS_MAX;
+}
+
+static int two_digits(const char *p) {
+    if (p[0] < '0' || p[0] > '9' || p[1] < '0' || p[1] > '9') {
+        return -1;
+    }
+    return (p[0] - '0') * 10 + (p[1] - '0');
+}
+
+/*
+ * The IMF-fixdate form every current server sends, e.g.
+ * "Sun, 06 Nov 1994 08:49:37 GMT", read directly. Returns -1 if the value
+ * is not in that form.
+ */
+static long imf_fixdate(const char *value, int len) {
+    static const char months[] = "JanFebMarAprMayJunJulAugSepOctNovDec";
+    if (len != 29 || value[3] != ',' || value[4] != ' ' || value[7] != ' ' ||
+        value[11] != ' ' || value[16] != ' ' || value[19] != ':' || value[22] != ':' ||
+        memcmp(value + 25, " GMT", 4) != 0) {
+        return -1;
+    }
+    
+    int month = -1;
+    for (int i = 0; i < 12; i++) {
+        if (memcmp(value + 8, months + i * 3, 3) == 0) {
+            month = i + 1;
+            break;
         }
+    }
+    int day = two_digits(value + 5);
+    int century = two_digits(value + 12);
+    int year = two_digits(value + 14);
+    int hour = two_digits(value + 17);
+    int minute = two_digits(value + 20);
+    int second = two_digits(value + 23);
+    if (month < 0 || day < 1 || century < 0 || year < 0 || hour < 0 || minute < 0 ||
+        second < 0) {
+        return -1;
+    }
+    year += century * 100;
+    
+    // Days since 1970-01-01 of a proleptic Gregorian date, with March as
+    // the first month so the leap day falls at the end of the year
+    int shifted_year = month <= 2 ? year - 1 : year;
+    long era = (shifted_year >= 0 ? shifted_year : shifted_year - 399) / 400;
+    long year_of_era = shifted_year - era * 400;
+    long day_of_year = (153 * (month > 2 ? month - 3 : month + 9) + 2) / 5 + day - 1;
+    long day_of_era = year_of_era * 365 + year_of_era / 4 - year_of_era / 100 + day_of_year;
+    long days = era * 146097 + day_of_era - 719468;
+    
+    return days * 86400 + hour * 3600 + minute * 60 + second;
+}
+
+/*
+ * Seconds since the epoch of an HTTP-date in any of its three forms, or -1
+ * if the value is not a date
+ */
+static long http_date(const char *value, int len) {
+    long seconds = imf_fixdate(value, len);
+    if (seconds >= 0) {
+        return seconds;
+    }
+    
+    // The obsolete forms are rare, leave them to strptime()
+    static const char *formats[] = {
+        "%A, %d-%b-%y %H:%M:%S GMT",    // RFC 850
+        "%a %b %e %H:%M:%S %Y",         // asctime()
+    };
+    char date[64];
+    if (len >= (int)sizeof(date)) {
+        return -1;
+    }
+    memcpy(date, value, len);
+    date[len] = '\0';
+    
+    for (size_t i = 0; i < sizeof(formats) / sizeof(formats[0]); i++) {
+        struct tm tm;
+        memset(&tm, 0, sizeof(tm));
+        const char *rest = strptime(date, formats[i], &tm);
+        if (rest && *rest == '\0') {
+            return timegm(&tm);
+        }
+    }
+    return -1;
+}
+
+/*
+ * Apply the directives of one Cache-Control line. Where a directive is
+ * repeated the first occurrence wins.
+ */
+static void parse_cache_control(const char *value, int value_len, freshness_t *freshness,
+                                long *max_age, long *s_maxage) {
+    const char *end = value + value_len;
+    directive_t directive;
+    while ((value = next_directive(value, end, &directive))) {
+        // A malformed lifetime counts as already stale
+        long seconds = directive.arg ? delta_seconds(directive.arg, directive.arg_len) : -1;
         
-        if (strncmp(check_directive, "proxy-revalidate", 16) == 0) {
-            char next_char = check_directive[16];
-            if (next_char == '\0' || next_char == ' ' || next_char == '\t' || 
-                next_char == ',' || next_char == '=') {
-                return 0; // proxy-revalidate directive
+        if (directive_is(&directive, "private") ||
+            directive_is(&directive, "no-store") ||
+            directive_is(&directive, "no-cache") ||
+            directive_is(&directive, "must-revalidate") ||
+            directive_is(&directive, "proxy-revalidate")) {
+            freshness->cacheable = 0;
+        } else if (directive_is(&directive, "public")) {
+            freshness->shared_with_auth = 1;
+        } else if (directive_is(&directive, "s-maxage")) {
+            freshness->shared_with_auth = 1;
+            if (*s_maxage < 0) {
+                *s_maxage = seconds >= 0 ? seconds : 0;
+            }
+        } else if (directive_is(&directive, "max-age")) {
+            if (*max_age < 0) {
+                *max_age = seconds >= 0 ? seconds : 0;
+            }
+        } else if (directive_is(&directive, "stale-while-revalidate")) {
+            if (freshness->stale_while_revalidate < 0) {
+                freshness->stale_while_revalidate = seconds;
+            }
+        } else if (directive_is(&directive, "stale-if-error")) {
+            if (freshness->stale_if_error < 0) {
+                freshness->stale_if_error = seconds;
             }
         }
+    }
+}
+
+/*
+ * Read everything a response header says about caching the response in
+ * one pass over its lines: every Cache-Control line, Expires, Date, Age and
+ * Vary. The lifetime is chosen as a shared cache does (RFC 9111 4.2.1):
+ * s-maxage, then max-age, then Expires less Date. The age on arrival is
+ * the larger of Age and how far the clock has moved past Date (4.2.3).
+ * A response whose lifetime is used up on arrival, max-age=0 included, is
+ * not cacheable. Without any lifetime it never expires.
+ */
+void parse_freshness(const char *header, int header_len, freshness_t *freshness) {
+    const char *end = header + header_len;
+    long max_age = -1;
+    long s_maxage = -1;
+    long age = -1;
+    long date = -1;
+    long expires = -1;
+    int has_expires = 0;
+    
+    freshness->cacheable = 1;
+    freshness->vary = 0;
+    freshness->shared_with_auth = 0;
+    freshness->stale_while_revalidate = -1;
+    freshness->stale_if_error = -1;
+    
+    // The first line is the status line
+    const char *line = scan_crlf(header, header_len);
+    while (line && line + 2 < end && line[2] != '\r') {
+        line += 2;
+        const char *line_end = scan_crlf(line, end - line);
+        if (!line_end) {
+            break;
+        }
+        const char *colon = scan_char2(line, line_end - line, ':', ':');
+        if (!colon) {
+            line = line_end;
+            continue;
+        }
+        
+        int name_len = colon - line;
+        const char *value = colon + 1;
+        while (value < line_end && (*value == ' ' || *value == '\t')) value++;
+        const char *value_end = line_end;
+        while (value_end > value && (value_end[-1] == ' ' || value_end[-1] == '\t')) value_end--;
+        int value_len = value_end - value;
         
-        // Move to next directive
-        while (*check_directive && *check_directive != ',' && 
-               *check_directive != ' ' && *check_directive != '\t') {
-            check_directive++;
+        if (name_len == 13 && scan_casecmp_eq(line, "Cache-Control", 13)) {
+            parse_cache_control(value, value_len, freshness, &max_age, &s_maxage);
+        } else if (name_len == 7 && scan_casecmp_eq(line, "Expires", 7)) {
+            if (!has_expires) {
+                has_expires = 1;
+                expires = http_date(value, value_len);
+            }
+        } else if (name_len == 4 && scan_casecmp_eq(line, "Date", 4)) {
+            if (date < 0) {
+                date = http_date(value, value_len);
+            }
+        } else if (name_len == 3 && scan_casecmp_eq(line, "Age", 3)) {
+            if (age < 0) {
+                age = delta_seconds(value, value_len);
+            }
+        } else if (name_len == 4 && scan_casecmp_eq(line, "Vary", 4)) {
+            freshness->vary = 1;
         }
+        line = line_end;
+    }
+    
+    // Without a usable Date the time it arrived stands in for it
+    long now = get_monotonic_time_ms() / 1000;
+    if (date < 0) {
+        date = now;
+    }
+    
+    if (s_maxage >= 0) {
+        freshness->lifetime = s_maxage;
+    } else if (max_age >= 0) {
+        freshness->lifetime = max_age;
+    } else if (has_expires) {
+        // An invalid Expires means already expired
+        freshness->lifetime = expires > date ? expires - date : 0;
+    } else {
+        freshness->lifetime = -1;
+    }
+    if (freshness->lifetime > UINT32_MAX) {
+        freshness->lifetime = UINT32_MAX;
     }
     
-    return 1; // No problematic directives found, meaning its cacheable
-}
\ No newline at end of file
+    long apparent_age = now > date ? now - date : 0;
+    freshness->age = age > apparent_age ? age : apparent_age;
+    
+    if (freshness->lifetime >= 0 && freshness->lifetime <= freshness->age) {
+        freshness->cacheable = 0;
+    }
+}
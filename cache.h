@@ -9,45 +9,237 @@
 #include <stdio.h>
 #include <stdint.h>
 #include <ctype.h>
+#include <time.h>
 #include <sys/time.h>
+#include <sys/stat.h>
+#include <pthread.h>
 
-#define MAX_CACHE_ENTRIES 10
-#define MAX_CACHE_ENTRY_SIZE (100 * 1024)  // 100 KiB
+#include "slab.h"
+#include "disk.h"
+#include "sketch.h"
+
+struct request_parser;
+
+#define MAX_CACHE_ENTRIES 10               // default entry limit when -m is not given
+#define MAX_CACHE_ENTRY_SIZE (100 * 1024)  // 100 KiB, default for -M without -m
+#define CACHE_MAX_OBJECT_SHARE 8           // with -m and no -M, objects up to this fraction of it
+#define CACHE_CHUNK_SIZE (64 * 1024)       // most response bytes one chunk holds
+#define CACHE_CHUNK_MIN (4 * 1024)         // first chunk of a response of unknown length
+#define CACHE_SENDFILE_MIN (16 * 1024)     // shorter runs of whole pages are cheaper to copy
 #define MAX_REQUEST_SIZE_TO_CACHE 2000     // 2000 bytes
+#define CACHE_DEFAULT_MEM_LIMIT (16 * 1024 * 1024) // default for -m
+#define MAX_VARY_SIZE 512                  // longest Vary field list or variant we store
+#define MAX_VALIDATOR_SIZE 256             // longest ETag or Last-Modified we keep for revalidation
+#define CACHE_INITIAL_BUCKETS 1024         // power of two, doubles as the cache grows
+#define CACHE_REFRESH_TIMEOUT_MS 30000     // a background refresh not done by then may be retried
+#define DELTA_SECONDS_MAX 2147483648L      // ages and lifetimes past 2^31 s are capped there
+#define CACHE_WINDOW_PERCENT 1            // W-TinyLFU: share of the cache that admits without a contest
+#define CACHE_PROTECTED_PERCENT 80        // W-TinyLFU: share of the main cache for entries hit again
+#define CACHE_SKETCH_OBJECT_SIZE (8 * 1024) // mean entry size the sketch is sized by, under -m
+#define CACHE_EVICT_SEARCH 1024            // coldest entries looked at when a size class runs out
+#define CACHE_EVICT_PAGES 2                // most slab pages of entries evicted to empty one page
+#define CACHE_SNAPSHOT_MAGIC 0x68747073    // "htps"
+#define CACHE_SNAPSHOT_VERSION 1
+
+// How entries are chosen for eviction (-e)
+typedef enum {
+    CACHE_POLICY_LRU,           // least recently used goes first
+    CACHE_POLICY_TINYLFU,       // W-TinyLFU: window LRU, then admission by frequency
+} cache_policy_t;
 
+// LRU lists an entry can be on. The LRU policy keeps every entry on the
+// window list.
+typedef enum {
+    SEGMENT_WINDOW,             // newly added entries
+    SEGMENT_PROBATION,          // admitted past the window, not hit since
+    SEGMENT_PROTECTED,          // hit while on probation
+    CACHE_NUM_SEGMENTS,
+} cache_segment_t;
+
+// Part of a cached response. Chunks are slab items, so a response of any
+// size is stored without contiguous memory; the origin is read straight
+// into them and they are sent from where they lie. Whoever holds a chunk,
+// the body or entry it belongs to, a shared fetch or a connection sending
+// it, has a reference on it and on every chunk after it.
+typedef struct cache_chunk {
+    struct cache_chunk *next;
+    int len;                    // bytes of data in use, the whole capacity unless last
+    int capacity;
+    int refs;
+    int sent_from_file;         // pages were given to a socket by sendfile()
+    char data[];
+} cache_chunk_t;
+
+// A position in a chain of chunks
 typedef struct {
-    char *request;              // key
-    int request_len;            
-    char *response;             // value
+    cache_chunk_t *chunk;
+    int offset;
+} cache_cursor_t;
+
+// A response being kept for the cache. Its chunks count towards the
+// cache's memory from the moment they are allocated.
+typedef struct {
+    cache_chunk_t *head;
+    cache_chunk_t *tail;
+    long len;                   // bytes kept
+    long expected;              // length of the whole response, 0 if not known yet
+    size_t mem_size;            // slab bytes of the chunks
+    int unbounded;              // may pass the object size limit, others stream it
+    int failed;                 // not kept: too large or out of memory
+} cache_body_t;
+
+// An entry and its key, host, uri, variant and validators share one slab
+// item, the response is a chain of chunks
+typedef struct cache_entry {
+    char *key;                  // method, host and path of the request
+    int key_len;            
+    uint64_t hash;              // hash of the key
+    char *vary;                 // response's Vary field names, "" if none
+    char *variant;              // request's values for those fields
+    char *etag;                 // validators sent when revalidating, "" if none
+    char *last_modified;
+    cache_chunk_t *chunks;      // the response
     int response_len;           
-    uint64_t last_accessed;     // Time for LRU
     char *host;                 
     char *uri;                  
-    int valid;                  // if the entry is valid
-    uint64_t cached_at;         // When this entry was cached
-    uint32_t max_age;           // max-age (0 = no expiration) 
+    uint64_t cached_at;         // When the response was generated: stored time less its age
+    uint32_t max_age;           // freshness lifetime (0 = no expiration)
+    uint32_t stale_while_revalidate; // seconds past max-age served while refreshing
+    uint32_t stale_if_error;    // seconds past max-age served when the origin fails
+    uint64_t refreshing_since;  // start of the background refresh, 0 if none
+    int delimited;              // response carries its own length, no close needed
+    size_t mem_size;            // slab bytes held by this entry and its chunks
+    cache_segment_t segment;    // LRU list the entry is on
+    struct cache_entry *hash_next;  // next entry in the same bucket
+    struct cache_entry *lru_prev;   // more recently used
+    struct cache_entry *lru_next;   // less recently used
 } cache_entry_t;
 
+// One LRU list and what it holds
+typedef struct {
+    cache_entry_t *head;        // most recently used
+    cache_entry_t *tail;        // least recently used
+    int size;
+    size_t mem_used;
+} cache_list_t;
+
+// Items on one slab page held by the entries cache_alloc() looked at
 typedef struct {
-    cache_entry_t entries[MAX_CACHE_ENTRIES];
+    int items;                  // items evicting those entries would free
+    int last_owner;             // index of the latest entry counted, -1 if none
+    size_t owners_size;         // slab bytes of those entries
+} cache_page_tally_t;
+
+// Snapshot file header, followed by num_entries records from least to most
+// worth keeping
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t num_entries;
+} cache_snapshot_header_t;
+
+// Fixed part of a snapshot record, followed by key, vary, variant, etag,
+// last_modified, host, uri (each NUL-terminated except the key) and the response
+typedef struct {
+    uint64_t cached_at;         // wall clock, so remaining lifetimes carry over
+    uint32_t max_age;
+    uint32_t stale_while_revalidate;
+    uint32_t stale_if_error;
+    uint32_t delimited;
+    uint32_t key_len;
+    uint32_t vary_len;
+    uint32_t variant_len;
+    uint32_t etag_len;
+    uint32_t last_modified_len;
+    uint32_t host_len;
+    uint32_t uri_len;
+    uint32_t response_len;
+} cache_snapshot_record_t;
+
+// What a response header says about storing and reusing the response,
+// read in one pass over its lines
+typedef struct {
+    int cacheable;              // storable and not already stale on arrival
+    int vary;                   // has a Vary header
+    int shared_with_auth;       // public or s-maxage: storable for requests with Authorization
+    long lifetime;              // freshness lifetime in seconds, -1 if none is given
+    long age;                   // age on arrival in seconds, from Age and Date
+    long stale_while_revalidate;    // seconds, -1 if not given
+    long stale_if_error;
+} freshness_t;
+
+typedef struct {
+    size_t mem_limit;           // bytes of entry memory (-m)
+    size_t max_object_size;     // largest response that is cached (-M)
+    int max_entries;            // entry limit, 0 = bounded by memory only
+    int huge_pages;             // back the slabs with huge pages (-H)
+    uint32_t grace;             // stale windows for responses that name none (-g)
+    const char *disk_path;      // file of the disk tier (-d), NULL = memory only
+    size_t disk_size;           // bytes of the disk tier (-D)
+    cache_policy_t policy;      // eviction policy (-e)
+} cache_config_t;
+
+typedef struct {
+    cache_entry_t **buckets;    // hash table, chained through hash_next
+    size_t num_buckets;         // always a power of two
     int size;
-    uint64_t access_sequence;
+    int max_entries;
+    size_t mem_used;            // slab bytes held by entries
+    size_t mem_limit;
+    size_t max_object_size;
+    uint32_t grace;
+    slab_t slab;
+    cache_page_tally_t *page_tally; // one per slab page, for cache_alloc()
+    disk_t disk;                // entries evicted from memory, if enabled
+    cache_policy_t policy;
+    cache_list_t lru[CACHE_NUM_SEGMENTS];
+    sketch_t sketch;            // how often keys were looked up, W-TinyLFU only
     uint64_t start_time;        // Reference time when cache was initialized                   
+    pthread_mutex_t lock;       // Held by a worker while it uses the entries
 } cache_t;
 
 // Function declarations
-void cache_init(cache_t *cache);
+void cache_init(cache_t *cache, const cache_config_t *config);
 void cache_cleanup(cache_t *cache);
-int cache_find(cache_t *cache, const char *request, int request_len);
-int cache_add(cache_t *cache, const char *request, int request_len, 
-             const char *response, int response_len,
-             const char *host, const char *uri, uint32_t max_age);
-void cache_update_lru(cache_t *cache, int index);
-int cache_find_lru(cache_t *cache);
+int cache_save(cache_t *cache, const char *path);
+int cache_load(cache_t *cache, const char *path);
+void cache_lock(cache_t *cache);
+void cache_unlock(cache_t *cache);
+cache_entry_t *cache_find(cache_t *cache, const char *key, int key_len,
+                          const char *request, const struct request_parser *parsed);
+cache_entry_t *cache_lookup(cache_t *cache, const char *key, int key_len,
+                            const char *request, const struct request_parser *parsed);
+cache_entry_t *cache_find_plain(cache_t *cache, const char *key, int key_len);
+int cache_variant_matches(const char *vary, const char *variant, const char *request,
+                          const struct request_parser *parsed);
+int cache_add(cache_t *cache, const char *key, int key_len,
+             const char *request, const struct request_parser *parsed,
+             const char *header, int header_len, cache_body_t *body,
+             const char *host, const char *uri, const freshness_t *freshness);
+char *cache_body_reserve(cache_t *cache, cache_body_t *body, int hint, int *space);
+void cache_body_commit(cache_body_t *body, int len);
+int cache_body_append(cache_t *cache, cache_body_t *body, const char *data, int len);
+void cache_body_release(cache_t *cache, cache_body_t *body);
+cache_chunk_t *cache_hold_response(cache_entry_t *entry);
+size_t cache_chunks_put(cache_t *cache, cache_chunk_t *first, cache_chunk_t *last);
+size_t cache_file_span(cache_t *cache, const char *data, size_t len, size_t *skip,
+                       off_t *file_offset);
+
+// Take another reference on a chunk someone already holds
+static inline void cache_chunk_get(cache_chunk_t *chunk) {
+    __atomic_add_fetch(&chunk->refs, 1, __ATOMIC_RELAXED);
+}
+void cache_remove(cache_t *cache, cache_entry_t *entry);
+void cache_evict(cache_t *cache, cache_entry_t *entry);
+void cache_update_lru(cache_t *cache, cache_entry_t *entry);
+void cache_refresh(cache_t *cache, cache_entry_t *entry, const freshness_t *freshness);
 int cache_prepare_eviction_if_needed(cache_t *cache, int request_len);
-int is_cacheable_response(const char *response_header);
-uint32_t extract_max_age(const char *response_header);
+void parse_freshness(const char *header, int header_len, freshness_t *freshness);
+const char *find_header(const char *headers, int headers_len,
+                        const char *name, int name_len, int *value_len);
 uint64_t get_monotonic_time_ms(void);
-int is_cache_entry_stale(cache_t *cache, int index);
+int is_cache_entry_stale(cache_entry_t *entry);
+int is_cache_entry_usable_stale(cache_entry_t *entry, uint32_t window);
+int cache_start_refresh(cache_entry_t *entry);
 
-#endif
\ No newline at end of file
+#endif
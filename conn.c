@@ -0,0 +1,2009 @@
+/**
+ * Event-driven connection engine. A single epoll loop moves every client
+ * through read request -> cache lookup -> connect -> forward -> cache store
+ * without ever blocking on one peer.
+ */
+
+#include "conn.h"
+
+static void conn_close(conn_t *conn);
+static void flush_to_client(conn_t *conn);
+static void splice_forward(conn_t *conn);
+static void next_request(conn_t *conn);
+static void reset_response(conn_t *conn);
+static int server_reusable(conn_t *conn);
+static void release_followers(conn_t *conn);
+static void origin_failed(conn_t *conn);
+static void finish_response(conn_t *conn);
+static void start_send_request(conn_t *conn);
+
+/*
+ * Register interest for a descriptor. Descriptors with no interest are taken
+ * out of epoll entirely so that a hung-up peer cannot keep waking the loop
+ * while we are waiting on the other side of the connection.
+ */
+static void watch(event_loop_t *loop, ev_source_t *src, uint32_t events) {
+    if (src->fd < 0 || src->events == events) {
+        return;
+    }
+
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof ev);
+    ev.events = events;
+    ev.data.ptr = src;
+
+    int op = EPOLL_CTL_MOD;
+    if (events == 0) {
+        op = EPOLL_CTL_DEL;
+    } else if (src->events == 0) {
+        op = EPOLL_CTL_ADD;
+    }
+
+    if (epoll_ctl(loop->epfd, op, src->fd, &ev) < 0) {
+        perror("epoll_ctl");
+    }
+    src->events = events;
+}
+
+static void set_nonblocking(int fd) {
+    int flags = fcntl(fd, F_GETFL, 0);
+    if (flags >= 0) {
+        fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+    }
+}
+
+static void close_server(conn_t *conn) {
+    if (conn->server.fd >= 0) {
+        close(conn->server.fd);
+        conn->server.fd = -1;
+    }
+    conn->server.events = 0;
+}
+
+static void wait_list_add(conn_t **list, conn_t *conn) {
+    conn->wait_prev = NULL;
+    conn->wait_next = *list;
+    if (*list) {
+        (*list)->wait_prev = conn;
+    }
+    *list = conn;
+}
+
+static void wait_list_remove(conn_t **list, conn_t *conn) {
+    if (conn->wait_prev) {
+        conn->wait_prev->wait_next = conn->wait_next;
+    } else {
+        *list = conn->wait_next;
+    }
+    if (conn->wait_next) {
+        conn->wait_next->wait_prev = conn->wait_prev;
+    }
+    conn->wait_prev = conn->wait_next = NULL;
+}
+
+/*
+ * Stop leading or following a shared fetch. A leader that goes away before
+ * the response is complete releases its followers.
+ */
+static void leave_inflight(conn_t *conn) {
+    if (!conn->inflight) {
+        return;
+    }
+    if (conn->state == CONN_FOLLOW) {
+        wait_list_remove(&conn->loop->following, conn);
+    }
+    if (conn->inflight_leader) {
+        inflight_release(conn->inflight);
+    }
+    inflight_put(conn->inflight);
+    conn->inflight = NULL;
+    conn->inflight_leader = 0;
+}
+
+/*
+ * Let the disk tier reuse the segment a hit was sent from
+ */
+static void release_disk_segment(conn_t *conn) {
+    if (conn->disk_segment >= 0) {
+        cache_lock(&cache);
+        disk_release(&cache.disk, conn->disk_segment);
+        cache_unlock(&cache);
+        conn->disk_segment = -1;
+    }
+}
+
+/*
+ * Close both sides of a connection. The memory is released after the current
+ * batch of events, since the other side may still have an event pending.
+ */
+static void conn_close(conn_t *conn) {
+    if (conn->closed) {
+        return;
+    }
+    conn->closed = 1;
+
+    if (conn->parsed_us) {
+        stats_record(PHASE_TOTAL, conn->request_start_us);
+    }
+    if (conn->state == CONN_RESOLVING) {
+        wait_list_remove(&conn->loop->resolving, conn);
+    }
+    leave_inflight(conn);
+    release_disk_segment(conn);
+
+    // close() also removes the descriptor from epoll
+    if (conn->client.fd >= 0) {
+        close(conn->client.fd);
+        conn->client.fd = -1;
+    }
+    close_server(conn);
+
+    conn->next_closing = conn->loop->closing;
+    conn->loop->closing = conn;
+}
+
+/*
+ * Give the chunks of a kept response back to the cache
+ */
+static void drop_kept_response(conn_t *conn) {
+    if (conn->kept.head) {
+        cache_lock(&cache);
+        cache_body_release(&cache, &conn->kept);
+        cache_unlock(&cache);
+    }
+    memset(&conn->kept, 0, sizeof(cache_body_t));
+}
+
+/*
+ * Let go of the chunks of a hit
+ */
+static void release_held_response(conn_t *conn) {
+    if (conn->held) {
+        cache_lock(&cache);
+        cache_chunks_put(&cache, conn->held, NULL);
+        cache_unlock(&cache);
+        conn->held = NULL;
+    }
+    conn->held_next.chunk = NULL;
+}
+
+static void conn_free(conn_t *conn) {
+    if (conn->pipe_fds[0] >= 0) {
+        close(conn->pipe_fds[0]);
+        close(conn->pipe_fds[1]);
+    }
+    free(conn->request);
+    free(conn->origin_request);
+    free(conn->request_strings);
+    free(conn->cache_key);
+    free(conn->response_buffer);
+    free(conn->header_accumulator);
+    drop_kept_response(conn);
+    free(conn->cached_copy);
+    release_held_response(conn);
+    free(conn);
+}
+
+static conn_t *conn_new(event_loop_t *loop, int client_fd) {
+    conn_t *conn = calloc(1, sizeof(conn_t));
+    if (!conn) {
+        perror("calloc");
+        return NULL;
+    }
+
+    conn->state = CONN_READ_REQUEST;
+    conn->loop = loop;
+    conn->client.kind = EV_CLIENT;
+    conn->client.fd = client_fd;
+    conn->client.conn = conn;
+    conn->server.kind = EV_SERVER;
+    conn->server.fd = -1;
+    conn->server.conn = conn;
+    conn->content_length = -1;
+    conn->pipe_fds[0] = conn->pipe_fds[1] = -1;
+    conn->disk_segment = -1;
+    return conn;
+}
+
+static void accept_connections(event_loop_t *loop) {
+    while (1) {
+        struct sockaddr_storage client_addr;
+        socklen_t client_addr_size = sizeof(client_addr);
+
+        // Accept a connection
+        int client_fd = accept4(loop->listener.fd, (struct sockaddr *)&client_addr,
+                                &client_addr_size, SOCK_NONBLOCK);
+        if (client_fd < 0) {
+            if (errno == EINTR || errno == ECONNABORTED) {
+                continue;
+            }
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                perror("accept");
+            }
+            return;
+        }
+
+        log_event(LOG_ACCEPTED, NULL, NULL);
+
+        // Responses go out in pieces as they are read into chunks, the last
+        // piece must not wait for the client to acknowledge the others
+        int one = 1;
+        setsockopt(client_fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+        conn_t *conn = conn_new(loop, client_fd);
+        if (!conn) {
+            close(client_fd);
+            continue;
+        }
+
+        watch(loop, &conn->client, EPOLLIN);
+    }
+}
+
+/*
+ * The first byte of the response reached the client
+ */
+static void first_byte_sent(conn_t *conn) {
+    if (!conn->first_byte_sent && conn->parsed_us) {
+        conn->first_byte_sent = 1;
+        stats_record(PHASE_FIRST_BYTE, conn->parsed_us);
+    }
+}
+
+/*
+ * Serve a hit, called with the cache locked. The response's chunks are
+ * held rather than copied, so they outlive the entry if another connection
+ * evicts it before this one has finished sending.
+ */
+static void serve_from_cache(conn_t *conn, cache_entry_t *entry) {
+    log_event(LOG_SERVING, conn->host, conn->request_uri);
+
+    conn->held = cache_hold_response(entry);
+    conn->held_next.chunk = conn->held;
+    conn->held_next.offset = 0;
+    conn->cached_delimited = entry->delimited;
+    cache_unlock(&cache);
+    leave_inflight(conn);
+
+    conn->state = CONN_SEND_CACHED;
+    conn->out_len = 0;
+    conn->out_sent = 0;
+    flush_to_client(conn);
+}
+
+/*
+ * Write out what is left of a held hit. Runs of whole pages in the cache
+ * file go with sendfile(), the bytes between them a batch of chunks per
+ * writev(). Returns 0 once everything is sent, -1 if the client is full
+ * (EPOLLOUT is then watched) or the connection had to be closed.
+ */
+static int send_held_to_client(conn_t *conn) {
+    while (conn->held_next.chunk) {
+        cache_chunk_t *chunk = conn->held_next.chunk;
+        int offset = conn->held_next.offset;
+        size_t skip;
+        off_t file_offset;
+        size_t run = cache_file_span(&cache, chunk->data + offset, chunk->len - offset, &skip,
+                                     &file_offset);
+
+        ssize_t sent;
+        if (run > 0 && skip == 0) {
+            // Freed chunks get fresh pages, so these stay intact in the socket
+            __atomic_store_n(&chunk->sent_from_file, 1, __ATOMIC_RELAXED);
+            sent = sendfile(conn->client.fd, cache.slab.fd, &file_offset, run);
+        } else {
+            struct iovec iov[CONN_IOV_MAX];
+            int count = 0;
+            for (; chunk && count < CONN_IOV_MAX; chunk = chunk->next) {
+                iov[count].iov_base = chunk->data + offset;
+                iov[count].iov_len = chunk->len - offset;
+                if (count > 0) {
+                    run = cache_file_span(&cache, iov[count].iov_base, iov[count].iov_len,
+                                          &skip, &file_offset);
+                }
+                offset = 0;
+                if (run > 0) {
+                    // Stop where the next run starts
+                    iov[count++].iov_len = skip;
+                    break;
+                }
+                count++;
+            }
+            sent = writev(conn->client.fd, iov, count);
+        }
+        if (sent < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                watch(conn->loop, &conn->client, EPOLLOUT);
+                return -1;
+            }
+            perror("send to client from cache");
+            conn_close(conn);
+            return -1;
+        }
+        stats_count(STAT_BYTES_TO_CLIENTS, sent);
+        first_byte_sent(conn);
+
+        // Step over what went out
+        while (conn->held_next.chunk) {
+            int left = conn->held_next.chunk->len - conn->held_next.offset;
+            if (sent < left) {
+                conn->held_next.offset += sent;
+                break;
+            }
+            sent -= left;
+            conn->held_next.chunk = conn->held_next.chunk->next;
+            conn->held_next.offset = 0;
+        }
+    }
+
+    watch(conn->loop, &conn->client, 0);
+    return 0;
+}
+
+/*
+ * Send a hit from the disk tier straight from the file, as far as the client
+ * takes it
+ */
+static void send_from_disk(conn_t *conn) {
+    while (conn->disk_remaining > 0) {
+        ssize_t sent = sendfile(conn->client.fd, cache.disk.fd, &conn->disk_offset,
+                                conn->disk_remaining);
+        if (sent < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                watch(conn->loop, &conn->client, EPOLLOUT);
+                return;
+            }
+            perror("sendfile to client");
+            conn_close(conn);
+            return;
+        }
+        if (sent == 0) {
+            fprintf(stderr, "Disk cache file truncated\n");
+            conn_close(conn);
+            return;
+        }
+        conn->disk_remaining -= sent;
+        stats_count(STAT_BYTES_TO_CLIENTS, sent);
+        first_byte_sent(conn);
+    }
+
+    watch(conn->loop, &conn->client, 0);
+    release_disk_segment(conn);
+
+    // Without a length the client needs the close to find the end
+    if (conn->client_keep_alive && conn->cached_delimited) {
+        next_request(conn);
+    } else {
+        conn_close(conn);
+    }
+}
+
+/*
+ * Serve a hit from the disk tier, called with the cache locked. The record's
+ * segment is held so it is not reused before the response is sent.
+ */
+static void serve_from_disk(conn_t *conn, disk_entry_t *entry) {
+    log_event(LOG_SERVING, conn->host, conn->request_uri);
+
+    conn->disk_segment = disk_acquire(&cache.disk, entry);
+    conn->disk_offset = entry->response_offset;
+    conn->disk_remaining = entry->response_len;
+    conn->cached_delimited = entry->delimited;
+    cache_unlock(&cache);
+
+    conn->state = CONN_SEND_DISK;
+    send_from_disk(conn);
+}
+
+/*
+ * Start connecting to the next resolved address of the origin
+ */
+static void connect_next_address(conn_t *conn) {
+    int server_fd = connect_to_origin_server(&conn->origin_addrs, &conn->next_addr);
+    if (server_fd < 0) {
+        fprintf(stderr, "Failed to connect to origin server: %s\n", conn->host);
+        origin_failed(conn);
+        return;
+    }
+
+    conn->server.fd = server_fd;
+    conn->state = CONN_CONNECTING;
+    conn->phase_start_us = stats_now_us();
+    watch(conn->loop, &conn->server, EPOLLOUT);
+}
+
+/*
+ * Get a connection to the origin and send it the request, reusing an idle
+ * pooled connection when allowed and one is available.
+ */
+static void connect_origin(conn_t *conn, int use_pool) {
+    int server_fd = use_pool ? pool_get(&conn->loop->pool, conn->host) : -1;
+
+    if (server_fd >= 0) {
+        conn->server_reused = 1;
+        conn->server.fd = server_fd;
+        start_send_request(conn);
+        return;
+    }
+
+    conn->server_reused = 0;
+    conn->phase_start_us = stats_now_us();
+    switch (dns_resolve(conn->host, conn->loop->wake.fd, &conn->origin_addrs)) {
+        case DNS_FOUND:
+            stats_record(PHASE_DNS, conn->phase_start_us);
+            conn->next_addr = 0;
+            connect_next_address(conn);
+            break;
+        case DNS_FAILED:
+            fprintf(stderr, "Failed to connect to origin server: %s\n", conn->host);
+            origin_failed(conn);
+            break;
+        case DNS_PENDING:
+            // Picked up again in resume_resolving() once the lookup is done
+            conn->state = CONN_RESOLVING;
+            wait_list_add(&conn->loop->resolving, conn);
+            break;
+    }
+}
+
+/*
+ * A pooled connection turned out to be dead before any of the response
+ * arrived. The origin may have closed it just as we checked it out, so the
+ * request goes out again on a fresh connection.
+ */
+static void retry_on_fresh_connection(conn_t *conn) {
+    close_server(conn);
+    connect_origin(conn, 0);
+}
+
+/*
+ * The origin could not answer and nothing has reached the client yet.
+ * Serve the stale entry instead if its stale-if-error window allows.
+ */
+static int serve_stale_on_error(conn_t *conn) {
+    if (!conn->cache_key || conn->client_gone || conn->total_bytes_forwarded > 0) {
+        return 0;
+    }
+
+    cache_lock(&cache);
+    cache_entry_t *entry = cache_lookup(&cache, conn->cache_key, conn->cache_key_len,
+                                        conn->request, &conn->parser);
+    if (!entry || !is_cache_entry_usable_stale(entry, entry->stale_if_error)) {
+        cache_unlock(&cache);
+        return 0;
+    }
+
+    // Released under the lock, the fetch is let go by serve_from_cache()
+    if (conn->inflight_leader) {
+        inflight_release(conn->inflight);
+    }
+    close_server(conn);
+    stats_count(STAT_STALE_SERVED, 1);
+    serve_from_cache(conn, entry);
+    return 1;
+}
+
+static void origin_failed(conn_t *conn) {
+    if (!serve_stale_on_error(conn)) {
+        conn_close(conn);
+    }
+}
+
+/*
+ * Serve the request from the cache if it can be, otherwise fetch it
+ */
+static void lookup_or_fetch(conn_t *conn) {
+    if (conn->cache_key) {
+        cache_lock(&cache);
+        cache_entry_t *entry = cache_find(&cache, conn->cache_key, conn->cache_key_len,
+                                          conn->request, &conn->parser);
+        if (entry) {
+            serve_from_cache(conn, entry);
+            return;
+        }
+
+        // Entries evicted from memory may still be on disk
+        if (cache.disk.enabled) {
+            disk_entry_t *disk_entry = disk_find(&cache.disk, conn->cache_key,
+                                                 conn->cache_key_len, conn->request, &conn->parser);
+            if (disk_entry) {
+                serve_from_disk(conn, disk_entry);
+                return;
+            }
+        }
+        cache_unlock(&cache);
+    }
+
+    log_event(LOG_GETTING, conn->host, conn->request_uri);
+    connect_origin(conn, 1);
+}
+
+/*
+ * Write out what is left of conn->out. Returns 0 once everything is sent,
+ * -1 if the client is full (EPOLLOUT is then watched) or the connection
+ * had to be closed.
+ */
+static int send_to_client(conn_t *conn) {
+    if (conn->client_gone) {
+        conn->out_sent = conn->out_len;
+        return 0;
+    }
+
+    while (conn->out_sent < conn->out_len) {
+        int sent = send(conn->client.fd, conn->out + conn->out_sent,
+                        conn->out_len - conn->out_sent, MSG_NOSIGNAL);
+        if (sent < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                watch(conn->loop, &conn->client, EPOLLOUT);
+                return -1;
+            }
+            perror(conn->state == CONN_SEND_CACHED ? "send to client from cache"
+                                                   : "send to client");
+            if (conn->inflight_leader) {
+                // Followers still need the response, fetch it without this client
+                close(conn->client.fd);
+                conn->client.fd = -1;
+                conn->client.events = 0;
+                conn->client_gone = 1;
+                conn->out_sent = conn->out_len;
+                return 0;
+            }
+            conn_close(conn);
+            return -1;
+        }
+        conn->out_sent += sent;
+        stats_count(STAT_BYTES_TO_CLIENTS, sent);
+        first_byte_sent(conn);
+    }
+
+    watch(conn->loop, &conn->client, 0);
+    return 0;
+}
+
+/*
+ * Stream the response of the fetch this connection follows, as far as the
+ * leader has got. Called again whenever the leader adds bytes or the client
+ * can take more.
+ */
+static void follow_response(conn_t *conn) {
+    while (send_to_client(conn) == 0) {
+        inflight_state_t state;
+        int delimited;
+        const char *data;
+        long available = inflight_read(conn->inflight, conn->follow_offset,
+                                       &conn->follow_cursor, &data, &state, &delimited);
+        if (available > 0) {
+            conn->follow_offset += available;
+            conn->out = data;
+            conn->out_len = available;
+            conn->out_sent = 0;
+            continue;
+        }
+
+        if (state == INFLIGHT_DONE) {
+            leave_inflight(conn);
+            // Without a length the client needs the close to find the end
+            if (conn->client_keep_alive && delimited) {
+                next_request(conn);
+            } else {
+                conn_close(conn);
+            }
+        } else if (state == INFLIGHT_RELEASED) {
+            if (conn->follow_offset > 0) {
+                // Part of the response is out already, nothing to fall back to
+                conn_close(conn);
+                return;
+            }
+            leave_inflight(conn);
+
+            // The leader may have refreshed the entry rather than fetched it
+            lookup_or_fetch(conn);
+        }
+        return;
+    }
+}
+
+/*
+ * Attach to the fetch another connection leads for the same object
+ */
+static void follow_fetch(conn_t *conn) {
+    log_event(LOG_JOINING, conn->host, conn->request_uri);
+
+    conn->state = CONN_FOLLOW;
+    conn->follow_offset = 0;
+    memset(&conn->follow_cursor, 0, sizeof(cache_cursor_t));
+    conn->out_len = 0;
+    conn->out_sent = 0;
+    wait_list_add(&conn->loop->following, conn);
+    follow_response(conn);
+}
+
+/*
+ * Keep the request's host and uri as C strings for logging and the origin
+ * connection, in a buffer the connection reuses for every request
+ */
+static int set_request_strings(conn_t *conn, const char *host, int host_len,
+                               const char *uri, int uri_len) {
+    int needed = host_len + 1 + uri_len + 1;
+    if (needed > conn->request_strings_capacity) {
+        char *strings = realloc(conn->request_strings, needed);
+        if (!strings) {
+            perror("realloc for request strings");
+            return -1;
+        }
+        conn->request_strings = strings;
+        conn->request_strings_capacity = needed;
+    }
+
+    conn->host = conn->request_strings;
+    memcpy(conn->host, host, host_len);
+    conn->host[host_len] = '\0';
+    conn->request_uri = conn->host + host_len + 1;
+    memcpy(conn->request_uri, uri, uri_len);
+    conn->request_uri[uri_len] = '\0';
+    return 0;
+}
+
+/*
+ * Ask the origin whether a stale entry is still current by adding its
+ * validators to the request. Requests that are already conditional are
+ * left to the client.
+ */
+static void build_conditional_request(conn_t *conn, cache_entry_t *entry) {
+    char *request = conn->request;
+    int etag_len = strlen(entry->etag);
+    int last_modified_len = strlen(entry->last_modified);
+    int value_len;
+
+    if ((etag_len == 0 && last_modified_len == 0) ||
+        request_header(&conn->parser, request, "If-None-Match", 13, &value_len) ||
+        request_header(&conn->parser, request, "If-Modified-Since", 17, &value_len)) {
+        return;
+    }
+
+    // Request without its final \r\n, the validators, then the \r\n again
+    int head_len = conn->total_request_len - 2;
+    int size = head_len + etag_len + last_modified_len + 64;
+    conn->origin_request = malloc(size);
+    if (!conn->origin_request) {
+        perror("malloc for conditional request");
+        return;
+    }
+
+    memcpy(conn->origin_request, request, head_len);
+    int len = head_len;
+    if (etag_len) {
+        len += snprintf(conn->origin_request + len, size - len, "If-None-Match: %s\r\n",
+                        entry->etag);
+    }
+    if (last_modified_len) {
+        len += snprintf(conn->origin_request + len, size - len, "If-Modified-Since: %s\r\n",
+                        entry->last_modified);
+    }
+    len += snprintf(conn->origin_request + len, size - len, "\r\n");
+
+    conn->origin_request_len = len;
+    conn->revalidating = 1;
+}
+
+/*
+ * A connection without a client that fetches the request again to refresh
+ * a stale entry. Called with the cache locked.
+ */
+static conn_t *background_refresh(conn_t *conn, cache_entry_t *entry) {
+    conn_t *refresh = conn_new(conn->loop, -1);
+    if (!refresh) {
+        return NULL;
+    }
+    refresh->client_gone = 1;
+
+    refresh->request_capacity = conn->total_request_len + 1;
+    refresh->request = malloc(refresh->request_capacity);
+    refresh->cache_key = malloc(conn->cache_key_len);
+    if (!refresh->request || !refresh->cache_key ||
+        set_request_strings(refresh, conn->host, strlen(conn->host), conn->request_uri,
+                            strlen(conn->request_uri)) < 0) {
+        perror("malloc for background refresh");
+        conn_free(refresh);
+        return NULL;
+    }
+
+    memcpy(refresh->request, conn->request, conn->total_request_len + 1);
+    refresh->request_len = conn->total_request_len;
+    refresh->total_request_len = conn->total_request_len;
+    refresh->parser = conn->parser;
+    memcpy(refresh->cache_key, conn->cache_key, conn->cache_key_len);
+    refresh->cache_key_len = conn->cache_key_len;
+
+    build_conditional_request(refresh, entry);
+    return refresh;
+}
+
+/*
+ * HTTP/1.1 clients keep the connection unless they say close, HTTP/1.0 ones
+ * only when they ask for keep-alive. Requests with a body are not forwarded
+ * with it, so the connection cannot be reused after them.
+ */
+static int client_wants_keep_alive(conn_t *conn) {
+    const char *request = conn->request;
+    const request_parser_t *parser = &conn->parser;
+
+    if (request_has_token(parser, request, "Transfer-Encoding", "chunked")) {
+        return 0;
+    }
+    int value_len;
+    const char *content_length = request_header(parser, request, "Content-Length", 14,
+                                                &value_len);
+    if (content_length && strtol(content_length, NULL, 10) > 0) {
+        return 0;
+    }
+
+    if (parser->version.len == 8 && strncmp(request + parser->version.offset, "HTTP/1.1", 8) == 0) {
+        return !request_has_token(parser, request, "Connection", "close") &&
+               !request_has_token(parser, request, "Proxy-Connection", "close");
+    }
+    return request_has_token(parser, request, "Connection", "keep-alive") ||
+           request_has_token(parser, request, "Proxy-Connection", "keep-alive");
+}
+
+/*
+ * Answer a request for STATS_PATH with every thread's counters combined,
+ * sent like a cached response
+ */
+static void serve_stats(conn_t *conn) {
+    stats_gauges_t gauges = {.cache_entries = -1};
+    if (caching_enabled) {
+        cache_lock(&cache);
+        gauges.cache_entries = cache.size;
+        gauges.cache_bytes = cache.mem_used;
+        cache_unlock(&cache);
+    }
+    dns_stats_t dns;
+    dns_get_stats(&dns);
+    gauges.dns_hits = dns.hits;
+    gauges.dns_misses = dns.misses;
+
+    size_t body_len;
+    char *body = stats_report(&gauges, &body_len);
+    char header[256];
+    int header_len = snprintf(header, sizeof(header),
+                              "HTTP/1.1 200 OK\r\n"
+                              "Content-Type: application/json\r\n"
+                              "Content-Length: %zu\r\n"
+                              "Cache-Control: no-store\r\n\r\n", body_len);
+    conn->cached_copy = body ? malloc(header_len + body_len) : NULL;
+    if (!conn->cached_copy) {
+        perror("malloc for stats");
+        free(body);
+        conn_close(conn);
+        return;
+    }
+    memcpy(conn->cached_copy, header, header_len);
+    memcpy(conn->cached_copy + header_len, body, body_len);
+    free(body);
+
+    conn->cached_delimited = 1;
+    conn->state = CONN_SEND_CACHED;
+    conn->out = conn->cached_copy;
+    conn->out_len = header_len + body_len;
+    conn->out_sent = 0;
+    flush_to_client(conn);
+}
+
+/*
+ * Serve the request at the front of the buffer if it is a plain hit, before
+ * it is parsed: the key comes from the request line and Host alone and a
+ * fresh entry without Vary goes straight back. Returns 0 for anything else,
+ * with nothing done, so the request takes the full parse.
+ */
+static int serve_hit_unparsed(conn_t *conn) {
+    char *request = conn->request;
+    if (!caching_enabled) {
+        return 0;
+    }
+    // Pipelined requests may follow in the buffer; only this header counts
+    const char *end = scan_header_end(request, conn->request_len);
+    request_probe_t probe;
+    if (!end || end + 4 - request > MAX_REQUEST_SIZE_TO_CACHE ||
+        !request_probe(&probe, request, end + 4 - request)) {
+        return 0;
+    }
+    const char *uri = request + probe.uri.offset;
+    const char *host = request + probe.host.offset;
+    if (probe.uri.len == (int)strlen(STATS_PATH) && memcmp(uri, STATS_PATH, probe.uri.len) == 0) {
+        return 0;
+    }
+    char key[MAX_REQUEST_SIZE_TO_CACHE + 2];
+    int key_len = format_cache_key(request, probe.method.len, host, probe.host.len, uri,
+                                   probe.uri.len, key, sizeof(key));
+    if (key_len < 0) {
+        return 0;
+    }
+
+    uint64_t lookup_start_us = stats_now_us();
+    cache_lock(&cache);
+    cache_entry_t *entry = cache_find_plain(&cache, key, key_len);
+    if (!entry) {
+        cache_unlock(&cache);
+        return 0;
+    }
+
+    // From here as process_request() would for a hit
+    watch(conn->loop, &conn->client, 0);
+    conn->total_request_len = end + 4 - request;
+    conn->next_request_byte = request[conn->total_request_len];
+    request[conn->total_request_len] = '\0';
+    if (probe.version.len == 8 && strncmp(request + probe.version.offset, "HTTP/1.1", 8) == 0) {
+        conn->client_keep_alive = !probe.says_close;
+    } else {
+        conn->client_keep_alive = probe.says_keep_alive;
+    }
+    log_event_text(LOG_REQUEST_TAIL, request + probe.last_line,
+                   conn->total_request_len - 4 - probe.last_line);
+    conn->parsed_us = stats_record(PHASE_PARSE, conn->request_start_us);
+    stats_count(STAT_REQUESTS, 1);
+    stats_record(PHASE_LOOKUP, lookup_start_us);
+
+    if (set_request_strings(conn, host, probe.host.len, uri, probe.uri.len) < 0) {
+        cache_unlock(&cache);
+        conn_close(conn);
+        return 1;
+    }
+    stats_count(STAT_HITS, 1);
+    serve_from_cache(conn, entry);
+    return 1;
+}
+
+/*
+ * Called once the whole request header has arrived: log it, consult the cache
+ * and either serve the hit or start connecting to the origin.
+ */
+static void process_request(conn_t *conn) {
+    char *request = conn->request;
+    request_parser_t *parser = &conn->parser;
+
+    watch(conn->loop, &conn->client, 0);
+
+    // Hide any pipelined requests behind this one until it is done
+    conn->total_request_len = parser->header_len;
+    conn->next_request_byte = request[conn->total_request_len];
+    request[conn->total_request_len] = '\0';
+    conn->client_keep_alive = client_wants_keep_alive(conn);
+
+    // Log the last line of the header before the blank line
+    int last_line_len = parser->header_len - 4 - parser->last_line;
+    log_event_text(LOG_REQUEST_TAIL, request + parser->last_line, last_line_len);
+
+    // The proxy answers its own stats path
+    if (parser->uri.len == (int)strlen(STATS_PATH) &&
+        memcmp(request + parser->uri.offset, STATS_PATH, parser->uri.len) == 0) {
+        serve_stats(conn);
+        return;
+    }
+    conn->parsed_us = stats_record(PHASE_PARSE, conn->request_start_us);
+    stats_count(STAT_REQUESTS, 1);
+
+    // Extract host from Host header
+    int host_len;
+    const char *host = request_header(parser, request, "Host", 4, &host_len);
+    if (!host) {
+        fprintf(stderr, "No Host header found in request\n");
+        conn_close(conn);
+        return;
+    }
+    if (set_request_strings(conn, host, host_len, request + parser->uri.offset,
+                            parser->uri.len) < 0) {
+        conn_close(conn);
+        return;
+    }
+
+    int total_request_len = conn->total_request_len;
+
+    // Check cache for this request (if caching is enabled)
+    if (caching_enabled && total_request_len <= MAX_REQUEST_SIZE_TO_CACHE) {
+        int key_size = total_request_len + 2;
+        conn->cache_key = malloc(key_size);
+        if (conn->cache_key) {
+            conn->cache_key_len = build_cache_key(parser, request, conn->cache_key, key_size);
+        }
+        if (!conn->cache_key || conn->cache_key_len < 0) {
+            fprintf(stderr, "Invalid request format\n");
+            conn_close(conn);
+            return;
+        }
+    }
+
+    if (conn->cache_key) {
+        conn->phase_start_us = stats_now_us();
+        cache_lock(&cache);
+        cache_entry_t *entry = cache_find(&cache, conn->cache_key, conn->cache_key_len, request, &conn->parser);
+
+        // Entries evicted from memory may still be on disk
+        disk_entry_t *disk_entry = NULL;
+        if (!entry && cache.disk.enabled) {
+            disk_entry = disk_find(&cache.disk, conn->cache_key, conn->cache_key_len, request,
+                                   &conn->parser);
+        }
+        stats_record(PHASE_LOOKUP, conn->phase_start_us);
+
+        if (entry) {
+            // Found in cache and it's not stale
+            stats_count(STAT_HITS, 1);
+            serve_from_cache(conn, entry);
+            return;
+        }
+        if (disk_entry) {
+            stats_count(STAT_DISK_HITS, 1);
+            serve_from_disk(conn, disk_entry);
+            return;
+        }
+
+        // Within stale-while-revalidate the stale copy goes out at once and
+        // a single background refresh brings the entry up to date
+        cache_entry_t *stale_entry = cache_lookup(&cache, conn->cache_key, conn->cache_key_len,
+                                                  request, &conn->parser);
+        if (stale_entry &&
+            is_cache_entry_usable_stale(stale_entry, stale_entry->stale_while_revalidate)) {
+            conn_t *refresh = NULL;
+            if (cache_start_refresh(stale_entry)) {
+                refresh = background_refresh(conn, stale_entry);
+            }
+            stats_count(STAT_STALE_SERVED, 1);
+            serve_from_cache(conn, stale_entry);
+
+            if (refresh) {
+                log_event(LOG_REFRESHING, refresh->host, refresh->request_uri);
+                connect_origin(refresh, 1);
+            }
+            return;
+        }
+
+        // Another request may already be fetching this object
+        stats_count(STAT_MISSES, 1);
+        conn->inflight = inflight_join(&cache, conn->cache_key, conn->cache_key_len,
+                                       conn->loop->wake.fd, &conn->inflight_leader);
+        if (conn->inflight && !conn->inflight_leader) {
+            cache_unlock(&cache);
+            follow_fetch(conn);
+            return;
+        }
+
+        // Only prepare eviction if we don't have a stale entry to replace;
+        // a stale entry with validators is revalidated instead of refetched
+        if (stale_entry) {
+            build_conditional_request(conn, stale_entry);
+        } else {
+            cache_prepare_eviction_if_needed(&cache, total_request_len);
+        }
+        cache_unlock(&cache);
+    }
+
+    // Either caching is disabled or we had a cache miss
+    log_event(LOG_GETTING, conn->host, conn->request_uri);
+
+    connect_origin(conn, 1);
+}
+
+/*
+ * Parse the bytes of the request received since the last call. Returns 1
+ * once the header is complete; a malformed request closes the connection.
+ */
+static int request_complete(conn_t *conn) {
+    if (!conn->request) {
+        return 0;
+    }
+    int status = request_parse(&conn->parser, conn->request, conn->request_len);
+    if (status < 0) {
+        fprintf(stderr, "Invalid request format\n");
+        conn_close(conn);
+        return 0;
+    }
+    return status;
+}
+
+static void read_request(conn_t *conn) {
+    while (1) {
+        if (conn->request_len >= MAX_REQUEST_SIZE - 1) {
+            fprintf(stderr, "Incomplete request header\n");
+            conn_close(conn);
+            return;
+        }
+
+        // Grow the buffer towards MAX_REQUEST_SIZE as the request arrives
+        if (conn->request_len + 1 >= conn->request_capacity) {
+            int new_capacity = conn->request_capacity ? conn->request_capacity * 2
+                                                      : REQUEST_BUFFER_INIT;
+            if (new_capacity > MAX_REQUEST_SIZE) {
+                new_capacity = MAX_REQUEST_SIZE;
+            }
+            char *new_buffer = realloc(conn->request, new_capacity);
+            if (!new_buffer) {
+                perror("realloc for request");
+                conn_close(conn);
+                return;
+            }
+            conn->request = new_buffer;
+            conn->request_capacity = new_capacity;
+        }
+
+        int bytes_read = recv(conn->client.fd, conn->request + conn->request_len,
+                              conn->request_capacity - 1 - conn->request_len, 0);
+
+        if (bytes_read < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                perror("recv");
+                conn_close(conn);
+            }
+            return;
+        }
+        if (bytes_read == 0) {
+            conn_close(conn);
+            return;
+        }
+
+        if (!conn->request_start_us) {
+            conn->request_start_us = stats_now_us();
+        }
+        stats_count(STAT_BYTES_FROM_CLIENTS, bytes_read);
+        conn->request_len += bytes_read;
+        conn->request[conn->request_len] = '\0';
+
+        // A complete header is left to serve_requests(), which tries it as a
+        // hit before parsing it. One still arriving is parsed as it comes.
+        int scanned = conn->request_len - bytes_read - 3;
+        if (scanned < 0) {
+            scanned = 0;
+        }
+        if (scan_header_end(conn->request + scanned, conn->request_len - scanned) ||
+            request_complete(conn) || conn->closed) {
+            return;
+        }
+    }
+}
+
+/*
+ * Serve every complete request waiting in the buffer, in order. Hits finish
+ * straight away, plain ones before they are parsed, so pipelined hits go
+ * out back-to-back; a miss leaves the connection in another state until its
+ * response is done.
+ */
+static void serve_requests(conn_t *conn) {
+    while (!conn->closed && conn->state == CONN_READ_REQUEST) {
+        if (serve_hit_unparsed(conn)) {
+            continue;
+        }
+        if (!request_complete(conn)) {
+            if (!conn->closed) {
+                watch(conn->loop, &conn->client, EPOLLIN);
+            }
+            return;
+        }
+        process_request(conn);
+    }
+}
+
+/*
+ * Get ready for the next request on a kept-alive client connection: drop the
+ * per-request state and move any pipelined bytes to the front of the buffer.
+ */
+static void next_request(conn_t *conn) {
+    close_server(conn);
+
+    if (conn->parsed_us) {
+        stats_record(PHASE_TOTAL, conn->request_start_us);
+    }
+
+    free(conn->cache_key);
+    free(conn->cached_copy);
+    release_held_response(conn);
+    free(conn->origin_request);
+    conn->host = NULL;
+    conn->request_uri = NULL;
+    conn->cache_key = NULL;
+    conn->cache_key_len = 0;
+    conn->cached_copy = NULL;
+    conn->origin_request = NULL;
+    conn->follow_offset = 0;
+    reset_response(conn);
+
+    conn->request[conn->total_request_len] = conn->next_request_byte;
+    conn->request_len -= conn->total_request_len;
+    memmove(conn->request, conn->request + conn->total_request_len, conn->request_len);
+    conn->request[conn->request_len] = '\0';
+    conn->total_request_len = 0;
+    memset(&conn->parser, 0, sizeof(request_parser_t));
+
+    // Pipelined bytes already here start the next request's clock
+    conn->request_start_us = conn->request_len > 0 ? stats_now_us() : 0;
+    conn->parsed_us = 0;
+    conn->first_byte_sent = 0;
+
+    conn->state = CONN_READ_REQUEST;
+}
+
+/*
+ * Forget everything about the origin's response to the current request
+ */
+static void reset_response(conn_t *conn) {
+    conn->out = NULL;
+    conn->out_len = 0;
+    conn->out_sent = 0;
+    conn->header_bytes_accumulated = 0;
+    conn->response_header_complete = 0;
+    conn->header_bytes_forwarded = 0;
+    conn->content_length = -1;
+    conn->total_bytes_forwarded = 0;
+    conn->body_mode = BODY_UNKNOWN;
+    memset(&conn->freshness, 0, sizeof(freshness_t));
+    memset(&conn->chunked, 0, sizeof(chunked_t));
+    conn->response_overrun = 0;
+    conn->origin_closed = 0;
+    conn->server_reused = 0;
+    conn->keeping_response = 0;
+    drop_kept_response(conn);
+    conn->revalidating = 0;
+}
+
+static void send_request(conn_t *conn) {
+    while (conn->out_sent < conn->out_len) {
+        int sent = send(conn->server.fd, conn->out + conn->out_sent,
+                        conn->out_len - conn->out_sent, MSG_NOSIGNAL);
+        if (sent < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                watch(conn->loop, &conn->server, EPOLLOUT);
+                return;
+            }
+            if (conn->server_reused) {
+                retry_on_fresh_connection(conn);
+                return;
+            }
+            perror("write to server");
+            origin_failed(conn);
+            return;
+        }
+        conn->out_sent += sent;
+        stats_count(STAT_BYTES_TO_ORIGINS, sent);
+    }
+
+    // Request is out, now relay the response. After a retry the buffers
+    // are already there.
+    if (!conn->response_buffer) {
+        conn->response_buffer = malloc(BUFFER_SIZE);
+    }
+    if (!conn->header_accumulator) {
+        conn->header_accumulator = malloc(MAX_REQUEST_SIZE);
+    }
+    if (!conn->response_buffer || !conn->header_accumulator) {
+        perror("malloc for response");
+        conn_close(conn);
+        return;
+    }
+    conn->header_accumulator[0] = '\0';
+
+    // Keep the response for the cache while it streams, if it may be cached
+    conn->keeping_response = caching_enabled && conn->cache_key &&
+                             conn->total_request_len <= MAX_REQUEST_SIZE_TO_CACHE;
+
+    conn->state = CONN_FORWARD;
+    conn->out_len = 0;
+    conn->out_sent = 0;
+    watch(conn->loop, &conn->server, EPOLLIN);
+}
+
+static void start_send_request(conn_t *conn) {
+    // Send the request to the origin server
+    conn->state = CONN_SEND_REQUEST;
+    if (conn->origin_request) {
+        conn->out = conn->origin_request;
+        conn->out_len = conn->origin_request_len;
+    } else {
+        conn->out = conn->request;
+        conn->out_len = conn->total_request_len;
+    }
+    conn->out_sent = 0;
+    send_request(conn);
+}
+
+
+static void connect_complete(conn_t *conn) {
+    int err = 0;
+    socklen_t err_len = sizeof(err);
+
+    if (getsockopt(conn->server.fd, SOL_SOCKET, SO_ERROR, &err, &err_len) < 0 || err != 0) {
+        // Go on with the origin's other addresses, if any
+        close_server(conn);
+        connect_next_address(conn);
+        return;
+    }
+
+    stats_record(PHASE_CONNECT, conn->phase_start_us);
+    start_send_request(conn);
+}
+
+static body_mode_t response_body_mode(conn_t *conn) {
+    char *header = conn->header_accumulator;
+    int status = extract_response_status(header);
+
+    if (strncmp(conn->request, "HEAD ", 5) == 0 || status == 204 || status == 304) {
+        return BODY_NONE;
+    }
+    if (header_has_token(header, "Transfer-Encoding", "chunked")) {
+        return BODY_CHUNKED;
+    }
+    if (conn->content_length >= 0) {
+        return BODY_LENGTH;
+    }
+    return BODY_UNTIL_CLOSE;
+}
+
+static int response_complete(conn_t *conn) {
+    switch (conn->body_mode) {
+        case BODY_NONE:
+            return 1;
+        case BODY_LENGTH:
+            return conn->total_bytes_forwarded >=
+                   conn->header_bytes_forwarded + conn->content_length;
+        case BODY_CHUNKED:
+            return conn->chunked.done;
+        default:
+            return 0;
+    }
+}
+
+/*
+ * Whether the whole response arrived: its framing says it ended, or it runs
+ * until the origin closes and the origin did so cleanly
+ */
+static int response_received(conn_t *conn) {
+    if (conn->body_mode == BODY_UNTIL_CLOSE) {
+        return conn->origin_closed && !conn->chunked.error;
+    }
+    return response_complete(conn);
+}
+
+/*
+ * The response will not be cached after all, give its chunks back now
+ */
+static void stop_keeping_response(conn_t *conn) {
+    drop_kept_response(conn);
+    conn->kept.failed = 1;
+}
+
+/*
+ * Whether the response may be stored for anyone asking with this key
+ * (RFC 9111 3). A part of the object, answering a Range, is never stored,
+ * and the answer to a request with credentials only when the response
+ * allows it (3.5; must-revalidate, which also does, is never stored here).
+ * Statuses other than those cacheable by default need an explicit lifetime.
+ */
+static int response_storable(conn_t *conn) {
+    int value_len;
+    if (request_header(&conn->parser, conn->request, "Range", 5, &value_len) ||
+        (request_header(&conn->parser, conn->request, "Authorization", 13, &value_len) &&
+         !conn->freshness.shared_with_auth)) {
+        return 0;
+    }
+
+    int status = extract_response_status(conn->header_accumulator);
+    switch (status) {
+        case 200: case 203: case 204: case 300: case 301: case 308:
+        case 404: case 405: case 410: case 414: case 501:
+            return 1;
+        default:
+            return status >= 200 && status != 206 && status != 304 &&
+                   conn->freshness.lifetime >= 0;
+    }
+}
+
+/*
+ * Followers may only be given a response that would be cached for anyone
+ * asking with this key: cacheable, storable, small enough and without
+ * variants, and not the answer to a condition only the leader's client set.
+ */
+static int response_shareable(conn_t *conn) {
+    int value_len;
+    if (!conn->freshness.cacheable || conn->freshness.vary || !response_storable(conn) ||
+        request_header(&conn->parser, conn->request, "If-None-Match", 13, &value_len) ||
+        request_header(&conn->parser, conn->request, "If-Modified-Since", 17, &value_len) ||
+        request_header(&conn->parser, conn->request, "If-Match", 8, &value_len) ||
+        request_header(&conn->parser, conn->request, "If-Unmodified-Since", 19, &value_len) ||
+        request_header(&conn->parser, conn->request, "If-Range", 8, &value_len)) {
+        return 0;
+    }
+    if (conn->body_mode == BODY_LENGTH &&
+        (size_t)(conn->header_bytes_forwarded + conn->content_length) > cache.max_object_size) {
+        return 0;
+    }
+    return 1;
+}
+
+/*
+ * Stop leading: followers fetch for themselves
+ */
+static void release_followers(conn_t *conn) {
+    inflight_t *flight = conn->inflight;
+
+    inflight_release(flight);
+    inflight_put(flight);
+    conn->inflight = NULL;
+    conn->inflight_leader = 0;
+}
+
+/*
+ * The origin says our stale copy is still good: refresh it and serve it in
+ * place of the 304, which the client never sees
+ */
+static void revalidated(conn_t *conn) {
+    // Every byte read so far was the 304, none of it was forwarded
+    conn->total_bytes_forwarded = conn->header_bytes_accumulated;
+    if (server_reusable(conn)) {
+        watch(conn->loop, &conn->server, 0);
+        pool_put(&conn->loop->pool, conn->host, conn->server.fd);
+        conn->server.fd = -1;
+    } else {
+        close_server(conn);
+    }
+
+    cache_lock(&cache);
+    cache_entry_t *entry = cache_lookup(&cache, conn->cache_key, conn->cache_key_len,
+                                        conn->request, &conn->parser);
+
+    // Followers look the entry up again once released. The fetch itself is
+    // let go with the lock dropped, its last reference frees chunks.
+    if (conn->inflight_leader) {
+        inflight_release(conn->inflight);
+    }
+
+    if (entry) {
+        stats_count(STAT_REVALIDATED, 1);
+        cache_refresh(&cache, entry, &conn->freshness);
+
+        log_event(LOG_UNMODIFIED, conn->host, conn->request_uri);
+
+        if (conn->client_gone) {
+            // A background refresh has nobody to serve
+            cache_unlock(&cache);
+            conn_close(conn);
+            return;
+        }
+        serve_from_cache(conn, entry);
+        return;
+    }
+    cache_unlock(&cache);
+    leave_inflight(conn);
+
+    // Evicted while we asked, so fetch it in full after all
+    free(conn->origin_request);
+    conn->origin_request = NULL;
+    reset_response(conn);
+    connect_origin(conn, 1);
+}
+
+static void read_response(conn_t *conn) {
+    // While revalidating, nothing is forwarded until we know whether the
+    // answer is a 304, so the header accumulator must hold every byte read
+    int read_size = BUFFER_SIZE;
+    if (conn->revalidating && !conn->response_header_complete) {
+        read_size = MAX_REQUEST_SIZE - 1 - conn->header_bytes_accumulated;
+        if (read_size <= 0) {
+            fprintf(stderr, "Response header too large\n");
+            conn_close(conn);
+            return;
+        }
+        if (read_size > BUFFER_SIZE) {
+            read_size = BUFFER_SIZE;
+        }
+    }
+
+    // While the response is kept for the cache the origin is read straight
+    // into its chunks, and the client is sent the bytes from there
+    char *buf = conn->response_buffer;
+    if (conn->keeping_response && !conn->kept.failed) {
+        // Before the header gives a length, what has arrived sizes the
+        // chunk, so a small response still fits in one
+        int pending = 0;
+        if (!conn->response_header_complete &&
+            ioctl(conn->server.fd, FIONREAD, &pending) < 0) {
+            pending = 0;
+        }
+        int space;
+        char *reserved = cache_body_reserve(&cache, &conn->kept, pending, &space);
+        if (reserved) {
+            buf = reserved;
+            if (read_size > space) {
+                read_size = space;
+            }
+        }
+    }
+
+    int bytes_read = recv(conn->server.fd, buf, read_size, 0);
+
+    if (bytes_read < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) {
+        return;
+    }
+    if (bytes_read <= 0) {
+        // A pooled connection that dies before answering gets one retry
+        if (conn->server_reused && conn->total_bytes_forwarded == 0 &&
+            conn->header_bytes_accumulated == 0) {
+            retry_on_fresh_connection(conn);
+            return;
+        }
+
+        // Connection closed or some error
+        conn->origin_closed = bytes_read == 0;
+        close_server(conn);
+        if (!conn->response_header_complete && serve_stale_on_error(conn)) {
+            return;
+        }
+        finish_response(conn);
+        return;
+    }
+
+    stats_count(STAT_BYTES_FROM_ORIGINS, bytes_read);
+
+    // A leader's followers read the same chunks. Once the response is no
+    // longer kept, too large or out of memory, they cannot have the rest.
+    if (buf != conn->response_buffer) {
+        cache_body_commit(&conn->kept, bytes_read);
+        if (conn->inflight_leader) {
+            inflight_append(conn->inflight, conn->kept.tail, bytes_read);
+        }
+    } else if (conn->inflight_leader) {
+        release_followers(conn);
+    }
+
+    // If we haven't found the complete header yet, accumulate it
+    if (!conn->response_header_complete) {
+        // Copy data to header accumulator
+        int scanned = conn->header_bytes_accumulated > 3 ? conn->header_bytes_accumulated - 3 : 0;
+        int bytes_to_copy = bytes_read;
+        if (conn->header_bytes_accumulated + bytes_to_copy >= MAX_REQUEST_SIZE) {
+            bytes_to_copy = MAX_REQUEST_SIZE - conn->header_bytes_accumulated - 1;
+        }
+
+        if (bytes_to_copy > 0) {
+            memcpy(conn->header_accumulator + conn->header_bytes_accumulated,
+                   buf, bytes_to_copy);
+            conn->header_bytes_accumulated += bytes_to_copy;
+            conn->header_accumulator[conn->header_bytes_accumulated] = '\0';
+        }
+
+        // Check for end of header, in the new bytes and the three before them
+        const char *header_end_pos = scan_header_end(conn->header_accumulator + scanned,
+                                                     conn->header_bytes_accumulated - scanned);
+        if (header_end_pos) {
+            conn->response_header_complete = 1;
+            conn->header_bytes_forwarded = (header_end_pos - conn->header_accumulator) + 4;
+
+            // Extract Content-Length from the header lines only
+            int value_len;
+            const char *content_len_start = find_header(conn->header_accumulator,
+                                                        conn->header_bytes_forwarded,
+                                                        "Content-Length", 14, &value_len);
+            if (content_len_start) {
+                conn->content_length = strtol(content_len_start, NULL, 10);
+
+                log_event_number(LOG_RESPONSE_LENGTH, conn->content_length);
+            }
+
+            conn->body_mode = response_body_mode(conn);
+            if (caching_enabled) {
+                parse_freshness(conn->header_accumulator, conn->header_bytes_forwarded,
+                                &conn->freshness);
+            }
+            if (conn->keeping_response &&
+                (!conn->freshness.cacheable ||
+                 (conn->body_mode == BODY_LENGTH &&
+                  (size_t)(conn->header_bytes_forwarded + conn->content_length) >
+                  cache.max_object_size))) {
+                // The chunk these bytes were read into is about to go
+                if (buf != conn->response_buffer) {
+                    memcpy(conn->response_buffer, buf, bytes_read);
+                    buf = conn->response_buffer;
+                }
+                stop_keeping_response(conn);
+            } else if (conn->body_mode == BODY_LENGTH) {
+                conn->kept.expected = conn->header_bytes_forwarded + conn->content_length;
+            }
+
+            int status = extract_response_status(conn->header_accumulator);
+            if (conn->revalidating && status == 304) {
+                revalidated(conn);
+                return;
+            }
+            if (status >= 500 && serve_stale_on_error(conn)) {
+                return;
+            }
+            if (status >= 500 && conn->client_gone && !conn->inflight_leader) {
+                // A failed background refresh leaves the stale entry alone
+                conn_close(conn);
+                return;
+            }
+
+            if (conn->inflight_leader) {
+                if (response_shareable(conn)) {
+                    // Followers need all of it even if it proves too large to cache
+                    conn->kept.unbounded = 1;
+                    inflight_share(conn->inflight);
+                } else {
+                    release_followers(conn);
+                }
+            }
+        }
+    }
+
+    // Forward all received bytes to client, or everything held back while
+    // the header of a revalidation was arriving
+    char *data = buf;
+    int data_len = bytes_read;
+    if (conn->revalidating) {
+        if (!conn->response_header_complete) {
+            return;
+        }
+        conn->revalidating = 0;
+        data = conn->header_accumulator;
+        data_len = conn->header_bytes_accumulated;
+    }
+
+    // Follow chunked framing so we know where the response ends
+    if (conn->body_mode == BODY_CHUNKED) {
+        long body_start = conn->header_bytes_forwarded - conn->total_bytes_forwarded;
+        if (body_start < 0) {
+            body_start = 0;
+        }
+        if (body_start < data_len) {
+            int body_bytes = data_len - body_start;
+            int consumed = chunked_consume(&conn->chunked, data + body_start, body_bytes);
+            if (consumed < body_bytes || conn->chunked.error) {
+                conn->response_overrun = 1;
+            }
+            if (conn->chunked.error) {
+                conn->body_mode = BODY_UNTIL_CLOSE;
+            }
+        }
+    }
+
+    conn->out = data;
+    conn->out_len = data_len;
+    conn->out_sent = 0;
+    watch(conn->loop, &conn->server, 0);
+    flush_to_client(conn);
+}
+
+/*
+ * Whether the rest of the body can go origin -> client with splice(). Only
+ * bodies whose end is found by counting or by the close qualify, chunked
+ * ones have to be parsed, and only if nothing of them is needed for the
+ * cache.
+ */
+static int splice_eligible(conn_t *conn) {
+    if (!conn->response_header_complete || conn->response_overrun || conn->inflight_leader ||
+        conn->client_gone ||
+        (conn->body_mode != BODY_LENGTH && conn->body_mode != BODY_UNTIL_CLOSE)) {
+        return 0;
+    }
+
+    // Responses that will not be cached have stopped being kept
+    if (conn->keeping_response && !conn->kept.failed) {
+        return 0;
+    }
+
+    if (conn->pipe_fds[0] < 0 && pipe2(conn->pipe_fds, O_NONBLOCK | O_CLOEXEC) < 0) {
+        perror("pipe2");
+        conn->pipe_fds[0] = conn->pipe_fds[1] = -1;
+        return 0;
+    }
+    return 1;
+}
+
+/*
+ * Move the body from the origin to the client through the pipe without
+ * copying it into user space
+ */
+static void splice_forward(conn_t *conn) {
+    while (1) {
+        // Drain what the pipe holds before reading more
+        while (conn->pipe_bytes > 0) {
+            ssize_t moved = splice(conn->pipe_fds[0], NULL, conn->client.fd, NULL,
+                                   conn->pipe_bytes, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+            if (moved < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                if (errno == EAGAIN) {
+                    watch(conn->loop, &conn->server, 0);
+                    watch(conn->loop, &conn->client, EPOLLOUT);
+                    return;
+                }
+                perror("splice to client");
+                conn_close(conn);
+                return;
+            }
+            conn->pipe_bytes -= moved;
+            conn->total_bytes_forwarded += moved;
+            stats_count(STAT_BYTES_TO_CLIENTS, moved);
+        }
+
+        if (response_complete(conn)) {
+            watch(conn->loop, &conn->client, 0);
+            finish_response(conn);
+            return;
+        }
+
+        // Never take bytes past the body, they are not ours to forward
+        size_t want = BUFFER_SIZE;
+        if (conn->body_mode == BODY_LENGTH) {
+            long remaining = conn->header_bytes_forwarded + conn->content_length -
+                             conn->total_bytes_forwarded;
+            if (remaining < (long)want) {
+                want = remaining;
+            }
+        }
+
+        ssize_t moved = splice(conn->server.fd, NULL, conn->pipe_fds[1], NULL, want,
+                               SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+        if (moved < 0 && errno == EINTR) {
+            continue;
+        }
+        if (moved < 0 && errno == EAGAIN) {
+            watch(conn->loop, &conn->client, 0);
+            watch(conn->loop, &conn->server, EPOLLIN);
+            return;
+        }
+        if (moved <= 0) {
+            // Connection closed or some error
+            watch(conn->loop, &conn->client, 0);
+            close_server(conn);
+            finish_response(conn);
+            return;
+        }
+        conn->pipe_bytes += moved;
+        stats_count(STAT_BYTES_FROM_ORIGINS, moved);
+    }
+}
+
+static void flush_to_client(conn_t *conn) {
+    if (send_to_client(conn) < 0) {
+        return;
+    }
+
+    if (conn->state == CONN_SEND_CACHED) {
+        if (send_held_to_client(conn) < 0) {
+            return;
+        }
+        // Without a length the client needs the close to find the end
+        if (conn->client_keep_alive && conn->cached_delimited) {
+            next_request(conn);
+        } else {
+            conn_close(conn);
+        }
+        return;
+    }
+
+    conn->total_bytes_forwarded += conn->out_len;
+    conn->out_len = 0;
+    conn->out_sent = 0;
+
+    // If the framing says header + body have been forwarded, we're done
+    if (response_complete(conn)) {
+        finish_response(conn);
+        return;
+    }
+
+    // A body that will not be cached need not pass through user space
+    if (splice_eligible(conn)) {
+        conn->state = CONN_SPLICE;
+        splice_forward(conn);
+        return;
+    }
+
+    watch(conn->loop, &conn->server, EPOLLIN);
+}
+
+/*
+ * Handle caching after we have the complete response. Other connections may
+ * have changed the cache while this response was in flight, so the entry for
+ * this request is looked up again rather than remembered from before the fetch.
+ */
+static void store_response(conn_t *conn) {
+    cache_entry_t *stale_entry = cache_lookup(&cache, conn->cache_key, conn->cache_key_len,
+                                              conn->request, &conn->parser);
+
+    // A 304 answers the client's own conditional request, it has no body to keep
+    if (extract_response_status(conn->header_accumulator) == 304) {
+        cache_body_release(&cache, &conn->kept);
+        return;
+    }
+
+    // A response cut short is not kept, and the copy it was to replace is
+    // out of date
+    if (!response_received(conn)) {
+        if (stale_entry) {
+            cache_evict(&cache, stale_entry);
+        }
+        cache_body_release(&cache, &conn->kept);
+        return;
+    }
+
+    // Spliced bodies were never kept, so count what was forwarded
+    if ((size_t)conn->total_bytes_forwarded <= cache.max_object_size) {
+        // Check if response is cacheable, task3
+        if (conn->freshness.cacheable && response_storable(conn)) {
+            // If we had a stale entry, the new response replaces it
+            if (stale_entry) {
+                cache_remove(&cache, stale_entry);
+            }
+            cache_add(&cache, conn->cache_key, conn->cache_key_len, conn->request,
+                    &conn->parser, conn->header_accumulator, conn->header_bytes_forwarded,
+                    &conn->kept, conn->host, conn->request_uri, &conn->freshness);
+            return;
+        } else {
+            // Not cacheable - if we had a stale entry, evict it now
+            if (stale_entry) {
+                cache_evict(&cache, stale_entry);
+            }
+
+            log_event(LOG_NOT_CACHING, conn->host, conn->request_uri);
+        }
+    } else {
+        // Response too large, if we had a stale entry, evict it
+        if (stale_entry) {
+            cache_evict(&cache, stale_entry);
+        }
+    }
+    cache_body_release(&cache, &conn->kept);
+}
+
+/*
+ * The origin connection can serve another request if the response ended
+ * exactly where its framing said and the origin did not ask to close
+ */
+static int server_reusable(conn_t *conn) {
+    if (conn->server.fd < 0 || conn->response_overrun || !response_complete(conn)) {
+        return 0;
+    }
+    if (conn->body_mode == BODY_NONE &&
+        conn->total_bytes_forwarded != conn->header_bytes_forwarded) {
+        return 0;
+    }
+    if (conn->body_mode == BODY_LENGTH &&
+        conn->total_bytes_forwarded != conn->header_bytes_forwarded + conn->content_length) {
+        return 0;
+    }
+
+    char *header = conn->header_accumulator;
+    if (strncmp(header, "HTTP/1.1", 8) == 0) {
+        return !header_has_token(header, "Connection", "close");
+    }
+    return header_has_token(header, "Connection", "keep-alive");
+}
+
+static void finish_response(conn_t *conn) {
+    if (conn->inflight_leader) {
+        // Store once for everyone, then let the followers finish; both under
+        // the cache lock so a new miss finds either the entry or the fetch
+        inflight_t *flight = conn->inflight;
+        cache_lock(&cache);
+        store_response(conn);
+        if (response_received(conn)) {
+            inflight_finish(flight, response_complete(conn));
+        } else {
+            // Followers that have sent part of it close, the rest fetch anew
+            inflight_release(flight);
+        }
+        cache_unlock(&cache);
+
+        inflight_put(flight);
+        conn->inflight = NULL;
+        conn->inflight_leader = 0;
+    } else if (conn->keeping_response) {
+        cache_lock(&cache);
+        store_response(conn);
+        cache_unlock(&cache);
+    }
+
+    // The client can only find the end of a response that is framed
+    int client_reusable = conn->client_keep_alive && !conn->client_gone &&
+                          response_complete(conn) &&
+                          !conn->response_overrun &&
+                          !header_has_token(conn->header_accumulator, "Connection", "close");
+
+    if (server_reusable(conn)) {
+        watch(conn->loop, &conn->server, 0);
+        pool_put(&conn->loop->pool, conn->host, conn->server.fd);
+        conn->server.fd = -1;
+    }
+
+    if (client_reusable) {
+        next_request(conn);
+    } else {
+        conn_close(conn);
+    }
+}
+
+static void handle_client_event(conn_t *conn, uint32_t events) {
+    switch (conn->state) {
+        case CONN_READ_REQUEST:
+            read_request(conn);
+            break;
+        case CONN_FORWARD:
+        case CONN_SEND_CACHED:
+            flush_to_client(conn);
+            break;
+        case CONN_SEND_DISK:
+            send_from_disk(conn);
+            break;
+        case CONN_SPLICE:
+            splice_forward(conn);
+            break;
+        case CONN_FOLLOW:
+            follow_response(conn);
+            break;
+        default:
+            // Client is not watched in the other states
+            if (events & (EPOLLERR | EPOLLHUP)) {
+                conn_close(conn);
+            }
+            break;
+    }
+}
+
+static void handle_server_event(conn_t *conn, uint32_t events) {
+    switch (conn->state) {
+        case CONN_CONNECTING:
+            connect_complete(conn);
+            break;
+        case CONN_SEND_REQUEST:
+            send_request(conn);
+            break;
+        case CONN_FORWARD:
+            read_response(conn);
+            break;
+        case CONN_SPLICE:
+            splice_forward(conn);
+            break;
+        default:
+            break;
+    }
+}
+
+/*
+ * A resolver thread finished a lookup; move every connection whose origin
+ * is now known on to connecting
+ */
+static void resume_resolving(event_loop_t *loop) {
+    conn_t *conn = loop->resolving;
+    while (conn) {
+        conn_t *next = conn->wait_next;
+
+        switch (dns_recheck(conn->host, loop->wake.fd, &conn->origin_addrs)) {
+            case DNS_FOUND:
+                stats_record(PHASE_DNS, conn->phase_start_us);
+                wait_list_remove(&loop->resolving, conn);
+                conn->state = CONN_CONNECTING;
+                conn->next_addr = 0;
+                connect_next_address(conn);
+                break;
+            case DNS_FAILED:
+                wait_list_remove(&loop->resolving, conn);
+                conn->state = CONN_CONNECTING;
+                fprintf(stderr, "Failed to connect to origin server: %s\n", conn->host);
+                origin_failed(conn);
+                break;
+            case DNS_PENDING:
+                break;
+        }
+        conn = next;
+    }
+}
+
+/*
+ * A leader added to a shared fetch; let every follower that is not waiting
+ * on its client take the new bytes
+ */
+static void resume_following(event_loop_t *loop) {
+    conn_t *conn = loop->following;
+    while (conn) {
+        conn_t *next = conn->wait_next;
+        if (conn->out_sent == conn->out_len) {
+            follow_response(conn);
+            serve_requests(conn);
+        }
+        conn = next;
+    }
+}
+
+static void handle_wake(event_loop_t *loop) {
+    uint64_t count;
+    if (read(loop->wake.fd, &count, sizeof(count)) < 0 && errno != EAGAIN) {
+        perror("read from eventfd");
+    }
+
+    resume_resolving(loop);
+    resume_following(loop);
+}
+
+/*
+ * Run the event loop on an already listening socket. Never returns.
+ */
+void event_loop_run(int listen_fd) {
+    event_loop_t loop;
+    memset(&loop, 0, sizeof loop);
+
+    loop.epfd = epoll_create1(0);
+    if (loop.epfd < 0) {
+        perror("epoll_create1");
+        exit(EXIT_FAILURE);
+    }
+
+    pool_init(&loop.pool);
+
+    set_nonblocking(listen_fd);
+    loop.listener.kind = EV_LISTENER;
+    loop.listener.fd = listen_fd;
+    watch(&loop, &loop.listener, EPOLLIN);
+
+    loop.wake.kind = EV_WAKE;
+    loop.wake.fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (loop.wake.fd < 0) {
+        perror("eventfd");
+        exit(EXIT_FAILURE);
+    }
+    watch(&loop, &loop.wake, EPOLLIN);
+
+    struct epoll_event events[MAX_EVENTS];
+
+    while (1) {
+        // Wake up periodically while there are idle connections to expire
+        int timeout = loop.pool.total_idle > 0 ? POOL_SWEEP_INTERVAL_MS : -1;
+        int n = epoll_wait(loop.epfd, events, MAX_EVENTS, timeout);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("epoll_wait");
+            exit(EXIT_FAILURE);
+        }
+
+        for (int i = 0; i < n; i++) {
+            ev_source_t *src = events[i].data.ptr;
+
+            if (src->kind == EV_LISTENER) {
+                accept_connections(&loop);
+            } else if (src->kind == EV_WAKE) {
+                handle_wake(&loop);
+            } else if (!src->conn->closed) {
+                if (src->kind == EV_CLIENT) {
+                    handle_client_event(src->conn, events[i].events);
+                } else {
+                    handle_server_event(src->conn, events[i].events);
+                }
+                serve_requests(src->conn);
+            }
+        }
+
+        pool_expire(&loop.pool);
+
+        // Now nothing in this batch can refer to the closed connections
+        while (loop.closing) {
+            conn_t *conn = loop.closing;
+            loop.closing = conn->next_closing;
+            conn_free(conn);
+        }
+    }
+}
@@ -0,0 +1,159 @@
+#ifndef CONN_H
+#define CONN_H
+
+#include "htproxy.h"
+#include "cache.h"
+#include "pool.h"
+#include "dns.h"
+#include "inflight.h"
+#include "log.h"
+#include "scan.h"
+#include "stats.h"
+
+#include <fcntl.h>
+#include <netinet/tcp.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/ioctl.h>
+#include <sys/sendfile.h>
+#include <sys/uio.h>
+
+#define MAX_EVENTS 256          // epoll events handled per wakeup
+#define REQUEST_BUFFER_INIT 4096 // initial request buffer, grows to MAX_REQUEST_SIZE
+#define CONN_IOV_MAX 64         // chunks of a hit written per writev()
+
+// Connection states, in the order a request moves through them
+typedef enum {
+    CONN_READ_REQUEST,  // reading the client's request header
+    CONN_RESOLVING,     // waiting for a resolver thread to look up the origin
+    CONN_CONNECTING,    // non-blocking connect to the origin in progress
+    CONN_SEND_REQUEST,  // writing the request to the origin
+    CONN_FORWARD,       // relaying the origin's response to the client
+    CONN_SPLICE,        // relaying an uncached body through a pipe with splice()
+    CONN_SEND_CACHED,   // writing a cached response to the client
+    CONN_SEND_DISK,     // sending a response from the disk tier with sendfile()
+    CONN_FOLLOW,        // streaming a response another connection is fetching
+} conn_state_t;
+
+typedef enum {
+    EV_LISTENER,
+    EV_CLIENT,
+    EV_SERVER,
+    EV_WAKE,                    // eventfd written by other threads
+} ev_kind_t;
+
+struct conn;
+
+// One file descriptor registered with epoll (epoll_event.data.ptr)
+typedef struct {
+    ev_kind_t kind;
+    int fd;
+    uint32_t events;            // interest currently registered, 0 = not registered
+    struct conn *conn;
+} ev_source_t;
+
+// How the end of a response body is found
+typedef enum {
+    BODY_UNKNOWN,               // header not complete yet
+    BODY_NONE,                  // HEAD, 1xx, 204 and 304 responses
+    BODY_LENGTH,                // Content-Length bytes
+    BODY_CHUNKED,               // chunked transfer coding
+    BODY_UNTIL_CLOSE,           // origin closes the connection
+} body_mode_t;
+
+typedef struct event_loop {
+    int epfd;
+    ev_source_t listener;
+    struct conn *closing;       // connections to free after the current batch
+    conn_pool_t pool;           // idle keep-alive connections to origins
+    ev_source_t wake;           // eventfd other threads write to wake this loop
+    struct conn *resolving;     // connections waiting on a lookup
+    struct conn *following;     // connections streaming another's fetch
+} event_loop_t;
+
+typedef struct conn {
+    conn_state_t state;
+    event_loop_t *loop;
+    ev_source_t client;
+    ev_source_t server;
+    int closed;
+    struct conn *next_closing;
+
+    // Request from the client
+    char *request;
+    int request_len;
+    int request_capacity;
+    int total_request_len;      // header block including the final \r\n\r\n
+    request_parser_t parser;    // views of the current request, kept up to date by read_request()
+    char next_request_byte;     // first byte of a pipelined request, replaced by NUL
+    int client_keep_alive;      // client allows another request on this connection
+    int client_gone;            // client failed while this connection led a shared fetch
+    char *host;                 // point into request_strings
+    char *request_uri;
+    char *request_strings;      // host and uri as C strings, reused across requests
+    int request_strings_capacity;
+    char *cache_key;            // normalized method, host and path
+    int cache_key_len;
+    char *origin_request;       // conditional request sent instead, NULL if none
+    int origin_request_len;
+    int revalidating;           // origin_request asks whether a stale entry changed
+
+    // Bytes waiting to be written to the current peer
+    const char *out;
+    int out_len;
+    int out_sent;
+
+    // Response from the origin
+    char *response_buffer;
+    char *header_accumulator;
+    int header_bytes_accumulated;
+    int response_header_complete;
+    int header_bytes_forwarded;
+    long content_length;
+    long total_bytes_forwarded;
+    body_mode_t body_mode;
+    freshness_t freshness;      // parsed once the header is complete, with caching on
+    chunked_t chunked;
+    int response_overrun;       // origin sent more than the framed response
+    int origin_closed;          // origin closed the connection cleanly
+    int server_reused;          // server connection came from the pool
+    int pipe_fds[2];            // splice() pipe, created on first use, -1 before
+    long pipe_bytes;            // body bytes sitting in the pipe
+    addr_list_t origin_addrs;   // resolved addresses of the origin
+    int next_addr;              // next address to try if a connect fails
+    struct conn *wait_prev;     // neighbours on the loop's resolving or following list
+    struct conn *wait_next;
+
+    // Timing of the current request for the stats, stats_now_us() values
+    uint64_t request_start_us;  // first byte of the request arrived, 0 before
+    uint64_t parsed_us;         // header complete, 0 before
+    uint64_t phase_start_us;    // start of the lookup or connect being timed
+    int first_byte_sent;        // PHASE_FIRST_BYTE recorded
+
+    // Collapsed forwarding
+    inflight_t *inflight;       // fetch this request leads or follows
+    int inflight_leader;        // this connection fetches for the followers
+    long follow_offset;         // bytes of the shared response already taken
+    cache_cursor_t follow_cursor; // where they end in the leader's chunks
+
+    // The response, read straight into cache chunks while caching is possible
+    int keeping_response;
+    cache_body_t kept;
+
+    // Cached response being served on a hit
+    char *cached_copy;          // response made up by the proxy itself
+    cache_chunk_t *held;        // chunks of a memory hit, held until sent
+    cache_cursor_t held_next;   // next byte of them to send
+    int cached_delimited;       // cached response carries its own length
+    int disk_segment;           // disk segment held while sending from it, -1 if none
+    off_t disk_offset;          // next byte of the response in the disk file
+    long disk_remaining;
+} conn_t;
+
+extern cache_t cache;
+extern int caching_enabled;
+
+// Function declarations
+void event_loop_run(int listen_fd);
+
+#endif
@@ -0,0 +1,479 @@
+/**
+ * Second cache tier on local disk. Entries evicted from memory are appended
+ * to a log of fixed-size segments in one memory-mapped file, and an index in
+ * memory finds them again. Hits are sent straight from the file with
+ * sendfile(). A compactor thread copies the live records out of mostly dead
+ * segments so they can be reused; when the file is full the oldest segment
+ * is dropped as a whole.
+ *
+ * Responses are copied into a record with the cache lock dropped: the record
+ * is indexed as pending and its segment pinned until disk_commit().
+ */
+
+#include "disk.h"
+#include "cache.h"
+
+static uint64_t disk_hash(const char *key, int key_len) {
+    uint64_t hash = 14695981039346656037ULL;
+    for (int i = 0; i < key_len; i++) {
+        hash ^= (unsigned char)key[i];
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
+static size_t round_up(size_t value, size_t multiple) {
+    return (value + multiple - 1) / multiple * multiple;
+}
+
+static void segment_unlink(disk_segment_t *segment, disk_entry_t *entry) {
+    if (entry->seg_prev) {
+        entry->seg_prev->seg_next = entry->seg_next;
+    } else {
+        segment->entries = entry->seg_next;
+    }
+    if (entry->seg_next) {
+        entry->seg_next->seg_prev = entry->seg_prev;
+    }
+    segment->live -= entry->record_len;
+}
+
+static void segment_link(disk_segment_t *segment, disk_entry_t *entry) {
+    entry->seg_prev = NULL;
+    entry->seg_next = segment->entries;
+    if (segment->entries) {
+        segment->entries->seg_prev = entry;
+    }
+    segment->entries = entry;
+    segment->live += entry->record_len;
+}
+
+/*
+ * A sealed segment nothing points into and nobody reads from or writes to
+ * can be reused. Pages a socket may still hold from sendfile() are punched
+ * out of the file first, so the socket keeps what was sent and new records
+ * are written to fresh pages.
+ */
+static void maybe_free_segment(disk_t *disk, int index) {
+    disk_segment_t *segment = &disk->segments[index];
+    if (segment->state == SEGMENT_SEALED && !segment->entries && segment->readers == 0 &&
+        segment->writers == 0 && index != disk->compacting) {
+        if (segment->sent &&
+            fallocate(disk->fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+                      (off_t)index * DISK_SEGMENT_SIZE, DISK_SEGMENT_SIZE) < 0) {
+            perror("fallocate cache file");
+        }
+        segment->state = SEGMENT_FREE;
+        segment->used = 0;
+        segment->live = 0;
+        segment->sent = 0;
+    }
+}
+
+static void drop_entry(disk_t *disk, disk_entry_t *entry) {
+    disk_entry_t **link = &disk->buckets[entry->hash % DISK_INDEX_BUCKETS];
+    while (*link != entry) {
+        link = &(*link)->hash_next;
+    }
+    *link = entry->hash_next;
+
+    segment_unlink(&disk->segments[entry->segment], entry);
+    maybe_free_segment(disk, entry->segment);
+
+    // A pending record's writer still has it
+    if (entry->pending) {
+        entry->dropped = 1;
+        return;
+    }
+    free(entry->key);
+    free(entry->vary);
+    free(entry);
+}
+
+/*
+ * Forget every record of the oldest sealed segment nobody is reading from.
+ * Returns the segment, now free, or -1.
+ */
+static int drop_oldest_segment(disk_t *disk) {
+    int oldest = -1;
+    for (int i = 0; i < disk->num_segments; i++) {
+        disk_segment_t *segment = &disk->segments[i];
+        if (segment->state == SEGMENT_SEALED && segment->readers == 0 &&
+            segment->writers == 0 && i != disk->compacting &&
+            (oldest < 0 || segment->sealed_seq < disk->segments[oldest].sealed_seq)) {
+            oldest = i;
+        }
+    }
+    if (oldest < 0) {
+        return -1;
+    }
+
+    while (disk->segments[oldest].entries) {
+        drop_entry(disk, disk->segments[oldest].entries);
+    }
+    maybe_free_segment(disk, oldest);
+    return disk->segments[oldest].state == SEGMENT_FREE ? oldest : -1;
+}
+
+/*
+ * Find room for len bytes at the end of the log, moving on to a new
+ * segment when the active one is full. Only new records may push the
+ * oldest segment out; the compactor must not drop what it is saving, and
+ * keeps a free segment to move records into.
+ */
+static char *reserve(disk_t *disk, size_t len, int may_drop, int *segment, size_t *offset) {
+    if (len > DISK_SEGMENT_SIZE) {
+        return NULL;
+    }
+
+    if (disk->active < 0 || disk->segments[disk->active].used + len > DISK_SEGMENT_SIZE) {
+        int next = -1, num_free = 0;
+        for (int i = 0; i < disk->num_segments; i++) {
+            if (disk->segments[i].state == SEGMENT_FREE) {
+                if (next < 0) {
+                    next = i;
+                }
+                num_free++;
+            }
+        }
+
+        // New records leave the last free segment to the compactor
+        if (may_drop && num_free <= 1) {
+            int dropped = drop_oldest_segment(disk);
+            if (dropped >= 0) {
+                next = dropped;
+            }
+        }
+        if (next < 0) {
+            return NULL;
+        }
+
+        if (disk->active >= 0) {
+            int sealed = disk->active;
+            disk->segments[sealed].state = SEGMENT_SEALED;
+            disk->segments[sealed].sealed_seq = disk->next_seq++;
+            disk->active = -1;
+            maybe_free_segment(disk, sealed);
+        }
+        disk->segments[next].state = SEGMENT_ACTIVE;
+        disk->segments[next].used = 0;
+        disk->segments[next].live = 0;
+        disk->active = next;
+    }
+
+    disk_segment_t *active = &disk->segments[disk->active];
+    *segment = disk->active;
+    *offset = (size_t)disk->active * DISK_SEGMENT_SIZE + active->used;
+    active->used += len;
+    return disk->map + *offset;
+}
+
+/*
+ * Copy a record to the end of the log and point its index entry there.
+ * Called by the compactor with the lock held.
+ */
+static int move_record(disk_t *disk, disk_entry_t *entry) {
+    int segment;
+    size_t offset;
+    char *dest = reserve(disk, entry->record_len, 0, &segment, &offset);
+    if (!dest) {
+        return -1;
+    }
+    memcpy(dest, disk->map + entry->offset, entry->record_len);
+
+    segment_unlink(&disk->segments[entry->segment], entry);
+    entry->host = disk->map + offset + (entry->host - (disk->map + entry->offset));
+    entry->uri = disk->map + offset + (entry->uri - (disk->map + entry->offset));
+    entry->response_offset = offset + (entry->response_offset - entry->offset);
+    entry->offset = offset;
+    entry->segment = segment;
+    segment_link(&disk->segments[segment], entry);
+    return 0;
+}
+
+static void *compactor_main(void *arg) {
+    disk_t *disk = arg;
+
+    while (1) {
+        usleep(DISK_COMPACT_INTERVAL_MS * 1000);
+        pthread_mutex_lock(disk->lock);
+
+        // The sealed segment with the least live data, if it is mostly
+        // dead, complete, and there is a free segment to move its records into
+        int victim = -1, have_free = 0;
+        for (int i = 0; i < disk->num_segments; i++) {
+            disk_segment_t *segment = &disk->segments[i];
+            if (segment->state == SEGMENT_FREE) {
+                have_free = 1;
+            }
+            if (segment->state == SEGMENT_SEALED && segment->entries && segment->writers == 0 &&
+                segment->live < segment->used * DISK_COMPACT_LIVE_RATIO &&
+                (victim < 0 || segment->live < disk->segments[victim].live)) {
+                victim = i;
+            }
+        }
+        if (victim < 0 || !have_free) {
+            pthread_mutex_unlock(disk->lock);
+            continue;
+        }
+
+        // One record at a time, so workers are never held up for long
+        disk->compacting = victim;
+        while (disk->segments[victim].entries &&
+               move_record(disk, disk->segments[victim].entries) == 0) {
+            pthread_mutex_unlock(disk->lock);
+            pthread_mutex_lock(disk->lock);
+        }
+        disk->compacting = -1;
+        maybe_free_segment(disk, victim);
+
+        pthread_mutex_unlock(disk->lock);
+    }
+    return NULL;
+}
+
+int disk_init(disk_t *disk, const char *path, size_t size, pthread_mutex_t *lock) {
+    memset(disk, 0, sizeof(disk_t));
+    disk->fd = -1;
+    disk->active = -1;
+    disk->compacting = -1;
+    disk->lock = lock;
+
+    disk->num_segments = size / DISK_SEGMENT_SIZE;
+    if (disk->num_segments < DISK_MIN_SEGMENTS) {
+        disk->num_segments = DISK_MIN_SEGMENTS;
+    }
+    disk->size = (size_t)disk->num_segments * DISK_SEGMENT_SIZE;
+
+    disk->fd = open(path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+    if (disk->fd < 0) {
+        perror("open cache file");
+        return -1;
+    }
+    if (ftruncate(disk->fd, disk->size) < 0) {
+        perror("ftruncate cache file");
+        close(disk->fd);
+        return -1;
+    }
+
+    disk->map = mmap(NULL, disk->size, PROT_READ | PROT_WRITE, MAP_SHARED, disk->fd, 0);
+    if (disk->map == MAP_FAILED) {
+        perror("mmap cache file");
+        close(disk->fd);
+        return -1;
+    }
+
+    disk->segments = calloc(disk->num_segments, sizeof(disk_segment_t));
+    disk->buckets = calloc(DISK_INDEX_BUCKETS, sizeof(disk_entry_t *));
+    if (!disk->segments || !disk->buckets) {
+        perror("calloc");
+        return -1;
+    }
+
+    if (pthread_create(&disk->compactor, NULL, compactor_main, disk) != 0) {
+        fprintf(stderr, "Failed to start compactor thread\n");
+        return -1;
+    }
+    pthread_detach(disk->compactor);
+
+    disk->enabled = 1;
+    return 0;
+}
+
+void disk_destroy(disk_t *disk) {
+    if (!disk->enabled) {
+        return;
+    }
+    disk->enabled = 0;
+
+    for (int i = 0; i < DISK_INDEX_BUCKETS; i++) {
+        disk_entry_t *entry = disk->buckets[i];
+        while (entry) {
+            disk_entry_t *next = entry->hash_next;
+            free(entry->key);
+            free(entry->vary);
+            free(entry);
+            entry = next;
+        }
+    }
+    free(disk->buckets);
+    free(disk->segments);
+    munmap(disk->map, disk->size);
+    close(disk->fd);
+}
+
+static disk_entry_t *lookup(disk_t *disk, const char *key, int key_len,
+                            const char *request, const struct request_parser *parsed,
+                            int with_pending) {
+    uint64_t hash = disk_hash(key, key_len);
+
+    for (disk_entry_t *entry = disk->buckets[hash % DISK_INDEX_BUCKETS]; entry;
+         entry = entry->hash_next) {
+        if (entry->hash == hash && entry->key_len == key_len &&
+            (with_pending || !entry->pending) &&
+            memcmp(entry->key, key, key_len) == 0 &&
+            cache_variant_matches(entry->vary, entry->variant, request, parsed)) {
+            return entry;
+        }
+    }
+    return NULL;
+}
+
+/*
+ * Append an entry leaving the memory tier. Any older record for the same
+ * key and variant is forgotten. The record is written but for its
+ * response, which the caller copies to *response with the lock dropped
+ * before handing the record to disk_commit(). Returns NULL if there is no
+ * room.
+ */
+disk_entry_t *disk_store(disk_t *disk, const cache_entry_t *entry, char **response) {
+    uint64_t hash = disk_hash(entry->key, entry->key_len);
+
+    for (disk_entry_t *old = disk->buckets[hash % DISK_INDEX_BUCKETS]; old;
+         old = old->hash_next) {
+        if (old->hash == hash && old->key_len == entry->key_len &&
+            memcmp(old->key, entry->key, entry->key_len) == 0 &&
+            strcmp(old->vary, entry->vary) == 0 && strcmp(old->variant, entry->variant) == 0) {
+            drop_entry(disk, old);
+            break;
+        }
+    }
+
+    disk_record_t record = {
+        .magic = DISK_RECORD_MAGIC,
+        .key_len = entry->key_len,
+        .vary_len = strlen(entry->vary),
+        .variant_len = strlen(entry->variant),
+        .host_len = strlen(entry->host),
+        .uri_len = strlen(entry->uri),
+        .response_len = entry->response_len,
+    };
+    size_t record_len = round_up(sizeof(record) + record.key_len + record.vary_len + 1 +
+                                 record.variant_len + 1 + record.host_len + 1 +
+                                 record.uri_len + 1 + record.response_len, 8);
+
+    disk_entry_t *indexed = calloc(1, sizeof(disk_entry_t));
+    if (!indexed) {
+        return NULL;
+    }
+    indexed->key = malloc(record.key_len);
+    indexed->vary = malloc(record.vary_len + 1 + record.variant_len + 1);
+    if (!indexed->key || !indexed->vary) {
+        free(indexed->key);
+        free(indexed->vary);
+        free(indexed);
+        return NULL;
+    }
+
+    int segment;
+    size_t offset;
+    char *dest = reserve(disk, record_len, 1, &segment, &offset);
+    if (!dest) {
+        free(indexed->key);
+        free(indexed->vary);
+        free(indexed);
+        return NULL;
+    }
+
+    // Write the record
+    char *data = dest;
+    memcpy(data, &record, sizeof(record));
+    data += sizeof(record);
+    memcpy(data, entry->key, record.key_len);
+    data += record.key_len;
+    memcpy(data, entry->vary, record.vary_len + 1);
+    data += record.vary_len + 1;
+    memcpy(data, entry->variant, record.variant_len + 1);
+    data += record.variant_len + 1;
+    indexed->host = data;
+    memcpy(data, entry->host, record.host_len + 1);
+    data += record.host_len + 1;
+    indexed->uri = data;
+    memcpy(data, entry->uri, record.uri_len + 1);
+    data += record.uri_len + 1;
+    *response = data;
+
+    // And index it, hidden until the response is in
+    memcpy(indexed->key, entry->key, record.key_len);
+    indexed->key_len = record.key_len;
+    indexed->hash = hash;
+    memcpy(indexed->vary, entry->vary, record.vary_len + 1);
+    indexed->variant = indexed->vary + record.vary_len + 1;
+    memcpy(indexed->variant, entry->variant, record.variant_len + 1);
+    indexed->segment = segment;
+    indexed->offset = offset;
+    indexed->record_len = record_len;
+    indexed->response_offset = offset + (data - dest);
+    indexed->response_len = record.response_len;
+    indexed->cached_at = entry->cached_at;
+    indexed->max_age = entry->max_age;
+    indexed->delimited = entry->delimited;
+    indexed->pending = 1;
+
+    indexed->hash_next = disk->buckets[hash % DISK_INDEX_BUCKETS];
+    disk->buckets[hash % DISK_INDEX_BUCKETS] = indexed;
+    segment_link(&disk->segments[segment], indexed);
+    disk->segments[segment].writers++;
+    return indexed;
+}
+
+/*
+ * A record's response has been copied in, let hits find it. Records
+ * forgotten meanwhile are freed instead.
+ */
+void disk_commit(disk_t *disk, disk_entry_t *entry) {
+    int segment = entry->segment;
+    entry->pending = 0;
+    if (entry->dropped) {
+        free(entry->key);
+        free(entry->vary);
+        free(entry);
+    }
+    disk->segments[segment].writers--;
+    maybe_free_segment(disk, segment);
+}
+
+/*
+ * Find a fresh record for a request. Stale records are forgotten, the
+ * request then goes to the origin like any other miss.
+ */
+disk_entry_t *disk_find(disk_t *disk, const char *key, int key_len,
+                        const char *request, const struct request_parser *parsed) {
+    disk_entry_t *entry = lookup(disk, key, key_len, request, parsed, 0);
+    if (!entry) {
+        return NULL;
+    }
+
+    if (entry->max_age &&
+        get_monotonic_time_ms() - entry->cached_at > (uint64_t)entry->max_age * 1000) {
+        drop_entry(disk, entry);
+        return NULL;
+    }
+    return entry;
+}
+
+/*
+ * Forget the record for a request, a newer response replaced it
+ */
+void disk_remove(disk_t *disk, const char *key, int key_len,
+                 const char *request, const struct request_parser *parsed) {
+    disk_entry_t *entry = lookup(disk, key, key_len, request, parsed, 1);
+    if (entry) {
+        drop_entry(disk, entry);
+    }
+}
+
+/*
+ * Keep a record's segment from being reused while its response is sent.
+ * Returns the segment to hand back to disk_release().
+ */
+int disk_acquire(disk_t *disk, disk_entry_t *entry) {
+    disk->segments[entry->segment].readers++;
+    disk->segments[entry->segment].sent = 1;
+    return entry->segment;
+}
+
+void disk_release(disk_t *disk, int segment) {
+    disk->segments[segment].readers--;
+    maybe_free_segment(disk, segment);
+}
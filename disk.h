@@ -0,0 +1,107 @@
+#ifndef DISK_H
+#define DISK_H
+
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/mman.h>
+
+#define DISK_DEFAULT_SIZE (1024L * 1024 * 1024)    // default for -D
+#define DISK_SEGMENT_SIZE (16 * 1024 * 1024)       // unit of the log, written front to back
+#define DISK_MIN_SEGMENTS 4
+#define DISK_INDEX_BUCKETS 65536
+#define DISK_RECORD_MAGIC 0x68747031               // "htp1"
+#define DISK_COMPACT_INTERVAL_MS 1000
+#define DISK_COMPACT_LIVE_RATIO 0.5                // sealed segments below this are compacted
+
+struct cache_entry;
+struct request_parser;
+
+// Fixed part of a record in the segment file, followed by key, vary,
+// variant, host, uri (each NUL-terminated except the key) and the response
+typedef struct {
+    uint32_t magic;
+    uint32_t key_len;
+    uint32_t vary_len;
+    uint32_t variant_len;
+    uint32_t host_len;
+    uint32_t uri_len;
+    uint32_t response_len;
+} disk_record_t;
+
+// In-memory index entry for one record
+typedef struct disk_entry {
+    char *key;
+    int key_len;
+    uint64_t hash;
+    char *vary;                 // copies kept in memory for matching requests
+    char *variant;
+    const char *host;           // point into the mapped record
+    const char *uri;
+    int segment;
+    size_t offset;              // record start within the file
+    size_t record_len;
+    size_t response_offset;     // response start within the file
+    int response_len;
+    uint64_t cached_at;
+    uint32_t max_age;
+    int delimited;
+    int pending;                // response still being copied in, not found yet
+    int dropped;                // forgotten while pending, freed by disk_commit()
+    struct disk_entry *hash_next;
+    struct disk_entry *seg_prev;    // records in the same segment
+    struct disk_entry *seg_next;
+} disk_entry_t;
+
+typedef enum {
+    SEGMENT_FREE,
+    SEGMENT_ACTIVE,             // receiving new records
+    SEGMENT_SEALED,             // full, only read, compacted or dropped
+} segment_state_t;
+
+typedef struct {
+    segment_state_t state;
+    size_t used;                // bytes written
+    size_t live;                // bytes of records still indexed
+    int readers;                // hits being sent from this segment
+    int writers;                // pending records being copied in
+    int sent;                   // pages were given to a socket by sendfile()
+    uint64_t sealed_seq;        // order in which segments filled up
+    disk_entry_t *entries;
+} disk_segment_t;
+
+typedef struct {
+    int enabled;
+    int fd;
+    char *map;
+    size_t size;
+    int num_segments;
+    disk_segment_t *segments;
+    int active;                 // segment taking writes, -1 if none
+    int compacting;             // segment the compactor is emptying, -1 if none
+    uint64_t next_seq;
+    disk_entry_t **buckets;
+    pthread_mutex_t *lock;      // the cache lock, held around every call below
+    pthread_t compactor;
+} disk_t;
+
+// Function declarations
+int disk_init(disk_t *disk, const char *path, size_t size, pthread_mutex_t *lock);
+void disk_destroy(disk_t *disk);
+disk_entry_t *disk_store(disk_t *disk, const struct cache_entry *entry, char **response);
+void disk_commit(disk_t *disk, disk_entry_t *entry);
+disk_entry_t *disk_find(disk_t *disk, const char *key, int key_len,
+                        const char *request, const struct request_parser *parsed);
+void disk_remove(disk_t *disk, const char *key, int key_len,
+                 const char *request, const struct request_parser *parsed);
+int disk_acquire(disk_t *disk, disk_entry_t *entry);
+void disk_release(disk_t *disk, int segment);
+
+#endif
@@ -0,0 +1,284 @@
+/**
+ * Resolution cache with positive and negative TTLs. Misses are handed to a
+ * few resolver threads so getaddrinfo() never blocks an event loop; a loop
+ * that asked is told through its eventfd once the answer is in the cache.
+ */
+
+#include "dns.h"
+#include "cache.h"
+
+static pthread_mutex_t dns_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t dns_queued = PTHREAD_COND_INITIALIZER;
+static dns_entry_t *dns_buckets[DNS_BUCKETS];
+static int dns_num_entries = 0;
+static dns_pending_t *dns_queue = NULL;    // oldest first
+static dns_stats_t dns_stats;
+
+static unsigned int dns_hash(const char *host) {
+    unsigned int hash = 5381;
+    while (*host) {
+        hash = hash * 33 + (unsigned char)tolower((unsigned char)*host++);
+    }
+    return hash % DNS_BUCKETS;
+}
+
+static dns_entry_t *find_entry(const char *host) {
+    for (dns_entry_t *entry = dns_buckets[dns_hash(host)]; entry; entry = entry->next) {
+        if (strcasecmp(entry->host, host) == 0) {
+            return entry;
+        }
+    }
+    return NULL;
+}
+
+static dns_pending_t *find_pending(const char *host) {
+    for (dns_pending_t *pending = dns_queue; pending; pending = pending->next) {
+        if (strcasecmp(pending->host, host) == 0) {
+            return pending;
+        }
+    }
+    return NULL;
+}
+
+static void remove_entry(dns_entry_t *entry) {
+    dns_entry_t **link = &dns_buckets[dns_hash(entry->host)];
+    while (*link != entry) {
+        link = &(*link)->next;
+    }
+    *link = entry->next;
+    free(entry->host);
+    free(entry);
+    dns_num_entries--;
+}
+
+/*
+ * Make room for one more entry: drop everything expired, and if the cache
+ * is still full, the entry closest to expiry
+ */
+static void make_room(uint64_t now) {
+    dns_entry_t *soonest = NULL;
+
+    for (int i = 0; i < DNS_BUCKETS; i++) {
+        dns_entry_t *entry = dns_buckets[i];
+        while (entry) {
+            dns_entry_t *next = entry->next;
+            if (entry->expires_at <= now) {
+                remove_entry(entry);
+            } else if (!soonest || entry->expires_at < soonest->expires_at) {
+                soonest = entry;
+            }
+            entry = next;
+        }
+    }
+
+    if (dns_num_entries >= DNS_MAX_ENTRIES && soonest) {
+        remove_entry(soonest);
+    }
+}
+
+static void store_result(const char *host, int failed, const addr_list_t *addrs) {
+    uint64_t now = get_monotonic_time_ms();
+    dns_entry_t *entry = find_entry(host);
+
+    if (!entry) {
+        if (dns_num_entries >= DNS_MAX_ENTRIES) {
+            make_room(now);
+        }
+        entry = calloc(1, sizeof(dns_entry_t));
+        if (!entry) {
+            return;
+        }
+        entry->host = strdup(host);
+        if (!entry->host) {
+            free(entry);
+            return;
+        }
+        unsigned int bucket = dns_hash(host);
+        entry->next = dns_buckets[bucket];
+        dns_buckets[bucket] = entry;
+        dns_num_entries++;
+    }
+
+    entry->failed = failed;
+    entry->addrs = *addrs;
+    entry->expires_at = now + (failed ? DNS_NEGATIVE_TTL_MS : DNS_POSITIVE_TTL_MS);
+}
+
+/*
+ * Run getaddrinfo() for a host, without the brackets of an IPv6 literal
+ */
+static int lookup_host(const char *host, addr_list_t *addrs) {
+    struct addrinfo hints, *servinfo, *p;
+    char stripped_host[NI_MAXHOST];
+
+    // strip the brackets for getaddrinfo
+    size_t host_len = strlen(host);
+    if (host_len > 2 && host[0] == '[' && host[host_len - 1] == ']') {
+        if (host_len - 2 >= sizeof(stripped_host)) {
+            return -1;
+        }
+        memcpy(stripped_host, host + 1, host_len - 2);
+        stripped_host[host_len - 2] = '\0';
+        host = stripped_host;
+    }
+
+    // Create address
+    memset(&hints, 0, sizeof hints);
+    hints.ai_family = AF_UNSPEC;     // Allow IPv4 or IPv6
+    hints.ai_socktype = SOCK_STREAM; // TCP
+
+    // Get server address info
+    int s = getaddrinfo(host, "80", &hints, &servinfo);
+    if (s != 0) {
+        fprintf(stderr, "getaddrinfo: %s\n", gai_strerror(s));
+        return -1;
+    }
+
+    addrs->count = 0;
+    for (p = servinfo; p != NULL && addrs->count < MAX_ORIGIN_ADDRS; p = p->ai_next) {
+        memcpy(&addrs->addrs[addrs->count], p->ai_addr, p->ai_addrlen);
+        addrs->addr_lens[addrs->count] = p->ai_addrlen;
+        addrs->count++;
+    }
+    freeaddrinfo(servinfo);
+
+    return addrs->count > 0 ? 0 : -1;
+}
+
+static void *resolver_main(void *arg) {
+    (void)arg;
+
+    pthread_mutex_lock(&dns_lock);
+    while (1) {
+        // Take the oldest host no other resolver is working on
+        dns_pending_t *pending = dns_queue;
+        while (pending && pending->in_progress) {
+            pending = pending->next;
+        }
+        if (!pending) {
+            pthread_cond_wait(&dns_queued, &dns_lock);
+            continue;
+        }
+        pending->in_progress = 1;
+        pthread_mutex_unlock(&dns_lock);
+
+        addr_list_t addrs;
+        memset(&addrs, 0, sizeof(addrs));
+        int failed = lookup_host(pending->host, &addrs) < 0;
+
+        pthread_mutex_lock(&dns_lock);
+        store_result(pending->host, failed, &addrs);
+
+        dns_pending_t **link = &dns_queue;
+        while (*link != pending) {
+            link = &(*link)->next;
+        }
+        *link = pending->next;
+
+        // Wake every loop with a connection waiting on this host
+        uint64_t one = 1;
+        for (int i = 0; i < pending->num_notify_fds; i++) {
+            if (write(pending->notify_fds[i], &one, sizeof(one)) < 0 && errno != EAGAIN) {
+                perror("write to eventfd");
+            }
+        }
+        free(pending->notify_fds);
+        free(pending->host);
+        free(pending);
+    }
+    return NULL;
+}
+
+void dns_init(void) {
+    for (int i = 0; i < DNS_RESOLVER_THREADS; i++) {
+        pthread_t thread;
+        if (pthread_create(&thread, NULL, resolver_main, NULL) != 0) {
+            fprintf(stderr, "Failed to start resolver thread\n");
+            exit(EXIT_FAILURE);
+        }
+        pthread_detach(thread);
+    }
+}
+
+/*
+ * Ask for a lookup of host, or join the one already queued, so that
+ * notify_fd is written when it completes. Called with dns_lock held.
+ */
+static dns_status_t queue_lookup(const char *host, int notify_fd) {
+    dns_pending_t *pending = find_pending(host);
+
+    if (!pending) {
+        pending = calloc(1, sizeof(dns_pending_t));
+        if (!pending || !(pending->host = strdup(host))) {
+            free(pending);
+            return DNS_FAILED;
+        }
+        dns_pending_t **link = &dns_queue;
+        while (*link) {
+            link = &(*link)->next;
+        }
+        *link = pending;
+        pthread_cond_signal(&dns_queued);
+    }
+
+    for (int i = 0; i < pending->num_notify_fds; i++) {
+        if (pending->notify_fds[i] == notify_fd) {
+            return DNS_PENDING;
+        }
+    }
+    int *notify_fds = realloc(pending->notify_fds,
+                              (pending->num_notify_fds + 1) * sizeof(int));
+    if (!notify_fds) {
+        return DNS_FAILED;
+    }
+    notify_fds[pending->num_notify_fds++] = notify_fd;
+    pending->notify_fds = notify_fds;
+    return DNS_PENDING;
+}
+
+static dns_status_t resolve(const char *host, int notify_fd, addr_list_t *addrs,
+                            int count_stats) {
+    pthread_mutex_lock(&dns_lock);
+
+    dns_entry_t *entry = find_entry(host);
+    if (entry && entry->expires_at > get_monotonic_time_ms()) {
+        if (count_stats) {
+            dns_stats.hits++;
+        }
+        dns_status_t status = entry->failed ? DNS_FAILED : DNS_FOUND;
+        if (!entry->failed) {
+            *addrs = entry->addrs;
+        }
+        pthread_mutex_unlock(&dns_lock);
+        return status;
+    }
+
+    if (count_stats) {
+        dns_stats.misses++;
+    }
+    dns_status_t status = queue_lookup(host, notify_fd);
+    pthread_mutex_unlock(&dns_lock);
+    return status;
+}
+
+/*
+ * Resolve host from the cache, or start an asynchronous lookup and return
+ * DNS_PENDING; notify_fd is an eventfd written once the answer is cached
+ */
+dns_status_t dns_resolve(const char *host, int notify_fd, addr_list_t *addrs) {
+    return resolve(host, notify_fd, addrs, 1);
+}
+
+/*
+ * Same as dns_resolve() for a connection that was already counted, used
+ * when a lookup it was waiting on has finished
+ */
+dns_status_t dns_recheck(const char *host, int notify_fd, addr_list_t *addrs) {
+    return resolve(host, notify_fd, addrs, 0);
+}
+
+void dns_get_stats(dns_stats_t *stats) {
+    pthread_mutex_lock(&dns_lock);
+    *stats = dns_stats;
+    pthread_mutex_unlock(&dns_lock);
+}
@@ -0,0 +1,47 @@
+#ifndef DNS_H
+#define DNS_H
+
+#include "htproxy.h"
+
+#define DNS_BUCKETS 1024
+#define DNS_MAX_ENTRIES 4096            // cached hosts, expired ones are dropped first
+#define DNS_POSITIVE_TTL_MS 60000       // how long a resolved address is reused
+#define DNS_NEGATIVE_TTL_MS 5000        // how long a failed lookup is remembered
+#define DNS_RESOLVER_THREADS 4
+
+// Outcome of a lookup
+typedef enum {
+    DNS_FOUND,                  // addresses filled in
+    DNS_FAILED,                 // host does not resolve
+    DNS_PENDING,                // resolver thread will write to notify_fd when done
+} dns_status_t;
+
+typedef struct dns_entry {
+    char *host;
+    int failed;                 // negative entry
+    addr_list_t addrs;
+    uint64_t expires_at;
+    struct dns_entry *next;     // next entry in the same bucket
+} dns_entry_t;
+
+// A host waiting for a resolver thread, with every event loop to notify
+typedef struct dns_pending {
+    char *host;
+    int *notify_fds;
+    int num_notify_fds;
+    int in_progress;            // taken by a resolver thread
+    struct dns_pending *next;
+} dns_pending_t;
+
+typedef struct {
+    uint64_t hits;              // answered from the cache
+    uint64_t misses;            // needed a resolver lookup
+} dns_stats_t;
+
+// Function declarations
+void dns_init(void);
+dns_status_t dns_resolve(const char *host, int notify_fd, addr_list_t *addrs);
+dns_status_t dns_recheck(const char *host, int notify_fd, addr_list_t *addrs);
+void dns_get_stats(dns_stats_t *stats);
+
+#endif
@@ -6,85 +6,444 @@
 #define _POSIX_C_SOURCE 200112L
 
 #include "htproxy.h"
+#include "scan.h"
 
 /* 
-* Function to extract the Host header from the request
+* Function to parse a request header block as it arrives. Scanning resumes
+* where the previous call stopped, so each byte is looked at once however
+* the header is split across reads. Returns 1 once the blank line ending the
+* header has been seen, 0 if more bytes are needed and -1 if the request is
+* malformed.
 */
-char *extract_host_header(char *request, int request_len) {
-    // Find Host header
-    char *host_header = strcasestr(request, "\nHost:");
-    if (!host_header) {
-        // Try finding it at the beginning of the request
-        host_header = strcasestr(request, "Host:");
-        if (!host_header) {
-            return NULL;
+int request_parse(request_parser_t *parser, const char *buffer, int len) {
+    while (parser->pos < len && !parser->header_len) {
+        char c = buffer[parser->pos];
+        
+        switch (parser->state) {
+            case PARSE_METHOD:
+            case PARSE_URI: {
+                span_t *span = parser->state == PARSE_METHOD ? &parser->method : &parser->uri;
+                if (c == ' ') {
+                    if (parser->pos == parser->mark) {
+                        return -1;
+                    }
+                    span->offset = parser->mark;
+                    span->len = parser->pos - parser->mark;
+                    parser->mark = parser->pos + 1;
+                    parser->state++;
+                } else if (c == '\r' || c == '\n') {
+                    return -1;
+                }
+                break;
+            }
+            case PARSE_VERSION:
+                if (c == '\r') {
+                    parser->version.offset = parser->mark;
+                    parser->version.len = parser->pos - parser->mark;
+                    parser->state = PARSE_LINE_LF;
+                } else if (c == '\n') {
+                    return -1;
+                }
+                break;
+            case PARSE_LINE_LF:
+                if (c != '\n') {
+                    return -1;
+                }
+                parser->state = PARSE_HEADER_START;
+                break;
+            case PARSE_HEADER_START:
+                if (c == '\r') {
+                    parser->state = PARSE_END_LF;
+                    break;
+                }
+                // No folded lines, no empty names, and only so many fields
+                if (c == ' ' || c == '\t' || c == ':' || c == '\n' ||
+                    parser->num_headers == MAX_REQUEST_HEADERS) {
+                    return -1;
+                }
+                parser->mark = parser->pos;
+                parser->last_line = parser->pos;
+                parser->state = PARSE_HEADER_NAME;
+                break;
+            case PARSE_HEADER_NAME:
+                if (c == ':') {
+                    header_view_t *header = &parser->headers[parser->num_headers];
+                    header->name.offset = parser->mark;
+                    header->name.len = parser->pos - parser->mark;
+                    parser->state = PARSE_VALUE_START;
+                } else if (c == '\r' || c == '\n') {
+                    return -1;
+                }
+                break;
+            case PARSE_VALUE_START:
+                if (c == ' ' || c == '\t') {
+                    break;
+                }
+                parser->mark = parser->pos;
+                parser->value_end = parser->pos;
+                parser->state = PARSE_VALUE;
+                continue; // Look at this byte as part of the value
+            case PARSE_VALUE: {
+                // Skip to the end of the line, then trim the value back from there
+                const char *line_end = scan_char2(buffer + parser->pos, len - parser->pos,
+                                                  '\r', '\n');
+                int stop = line_end ? line_end - buffer : len;
+                int value_end = stop;
+                while (value_end > parser->value_end &&
+                       (buffer[value_end - 1] == ' ' || buffer[value_end - 1] == '\t')) {
+                    value_end--;
+                }
+                parser->value_end = value_end;
+                parser->pos = stop;
+                if (!line_end) {
+                    continue; // Rest of the line has not arrived yet
+                }
+                if (*line_end == '\n') {
+                    return -1;
+                }
+                header_view_t *header = &parser->headers[parser->num_headers++];
+                header->value.offset = parser->mark;
+                header->value.len = parser->value_end - parser->mark;
+                parser->state = PARSE_LINE_LF;
+                break;
+            }
+            case PARSE_END_LF:
+                if (c != '\n') {
+                    return -1;
+                }
+                parser->header_len = parser->pos + 1;
+                break;
         }
-    } else {
-        host_header++; // Skip the \n
+        parser->pos++;
     }
+    return parser->header_len ? 1 : 0;
+}
+
+
+
+/* 
+* Function to find the value of a request header by name, case-insensitively.
+* Returns a pointer into buffer and sets value_len, or NULL if absent.
+*/
+const char *request_header(const request_parser_t *parser, const char *buffer,
+                           const char *name, int name_len, int *value_len) {
+    for (int i = 0; i < parser->num_headers; i++) {
+        const header_view_t *header = &parser->headers[i];
+        if (header->name.len == name_len &&
+            strncasecmp(buffer + header->name.offset, name, name_len) == 0) {
+            *value_len = header->value.len;
+            return buffer + header->value.offset;
+        }
+    }
+    return NULL;
+}
+
+
+
+// Whether a comma-separated header value lists token
+static int value_has_token(const char *value, const char *value_end, const char *token) {
+    int token_len = strlen(token);
     
-    host_header += 5; // Skip "Host:"
-    while (*host_header == ' ') host_header++; // Skip spaces
-    
-    // Find end of the line
-    char *end = strstr(host_header, "\r\n");
-    if (!end) {
-        return NULL;
+    while (value < value_end) {
+        while (value < value_end && (*value == ' ' || *value == '\t' || *value == ',')) value++;
+        const char *token_start = value;
+        while (value < value_end && *value != ',') value++;
+        const char *token_end = value;
+        while (token_end > token_start && (token_end[-1] == ' ' || token_end[-1] == '\t')) token_end--;
+        
+        if (token_end - token_start == token_len &&
+            strncasecmp(token_start, token, token_len) == 0) {
+            return 1;
+        }
     }
+    return 0;
+}
+
+
+
+/* 
+* Function to read a complete request header just far enough to serve a hit:
+* the request line, Host and the Connection tokens, a vector scan per line
+* rather than the parser's byte at a time. Returns 1, or 0 if the request
+* needs the full parse: it is malformed, has a body or no Host.
+*/
+int request_probe(request_probe_t *probe, const char *buffer, int header_len) {
+    memset(probe, 0, sizeof(request_probe_t));
+    const char *end = buffer + header_len - 2;      // the blank line
     
-    // Allocate memory for the host value
-    int host_len = end - host_header;
-    char *host = malloc(host_len + 1);
-    if (!host) {
-        perror("malloc");
-        return NULL;
+    // Request line: method SP uri SP version
+    const char *line_end = scan_char2(buffer, end - buffer, '\r', '\n');
+    if (!line_end || *line_end != '\r' || line_end[1] != '\n') {
+        return 0;
+    }
+    const char *uri = memchr(buffer, ' ', line_end - buffer);
+    if (!uri || uri == buffer) {
+        return 0;
+    }
+    uri++;
+    const char *version = memchr(uri, ' ', line_end - uri);
+    if (!version || version == uri) {
+        return 0;
     }
+    version++;
+    probe->method.len = uri - 1 - buffer;
+    probe->uri.offset = uri - buffer;
+    probe->uri.len = version - 1 - uri;
+    probe->version.offset = version - buffer;
+    probe->version.len = line_end - version;
     
-    // Copy the host value
-    strncpy(host, host_header, host_len);
-    host[host_len] = '\0';
+    // Header lines, with the parser's limits
+    int num_headers = 0;
+    int found_host = 0;
+    for (const char *line = line_end + 2; line < end; line = line_end + 2) {
+        line_end = scan_char2(line, end - line, '\r', '\n');
+        if (!line_end || *line_end != '\r' || line_end[1] != '\n' ||
+            *line == ' ' || *line == '\t' || *line == ':' ||
+            ++num_headers > MAX_REQUEST_HEADERS) {
+            return 0;
+        }
+        const char *colon = memchr(line, ':', line_end - line);
+        if (!colon) {
+            return 0;
+        }
+        const char *value = colon + 1;
+        const char *value_end = line_end;
+        while (value < value_end && (*value == ' ' || *value == '\t')) value++;
+        while (value_end > value && (value_end[-1] == ' ' || value_end[-1] == '\t')) value_end--;
+        int name_len = colon - line;
+        
+        if (name_len == 4 && strncasecmp(line, "Host", 4) == 0) {
+            if (!found_host) {
+                found_host = 1;
+                probe->host.offset = value - buffer;
+                probe->host.len = value_end - value;
+            }
+        } else if ((name_len == 10 && strncasecmp(line, "Connection", 10) == 0) ||
+                   (name_len == 16 && strncasecmp(line, "Proxy-Connection", 16) == 0)) {
+            probe->says_close |= value_has_token(value, value_end, "close");
+            probe->says_keep_alive |= value_has_token(value, value_end, "keep-alive");
+        } else if ((name_len == 14 && strncasecmp(line, "Content-Length", 14) == 0) ||
+                   (name_len == 17 && strncasecmp(line, "Transfer-Encoding", 17) == 0)) {
+            return 0;
+        }
+        probe->last_line = line - buffer;
+    }
+    // The full parse reports a missing Host, and keys an empty one
+    return probe->host.len > 0;
+}
+
+
+
+/* 
+* Function to find a token in any instance of a request header, such as
+* "close" in Connection
+*/
+int request_has_token(const request_parser_t *parser, const char *buffer,
+                      const char *name, const char *token) {
+    int name_len = strlen(name);
     
-    return host;
+    for (int i = 0; i < parser->num_headers; i++) {
+        const header_view_t *header = &parser->headers[i];
+        if (header->name.len == name_len &&
+            strncasecmp(buffer + header->name.offset, name, name_len) == 0) {
+            const char *value = buffer + header->value.offset;
+            if (value_has_token(value, value + header->value.len, token)) {
+                return 1;
+            }
+        }
+    }
+    return 0;
 }
 
 
 
 /* 
-* Function to extract the URI from the request
+* Function to build the cache key of a request: method, host and path.
+* Host is lowercased without a default :80, and an absolute-form URI is
+* reduced to its path, so equivalent requests share one key. Returns the
+* key length, or -1 if there is no Host or the key does not fit key_size.
 */
-char *extract_request_uri(char *request) {
-    // Find the first line (request line)
-    char *line_end = strstr(request, "\r\n");
-    if (!line_end) {
-        return NULL;
+int build_cache_key(const request_parser_t *parser, const char *buffer, char *key, int key_size) {
+    int host_len;
+    const char *host = request_header(parser, buffer, "Host", 4, &host_len);
+    if (!host) {
+        return -1;
+    }
+    return format_cache_key(buffer + parser->method.offset, parser->method.len, host, host_len,
+                            buffer + parser->uri.offset, parser->uri.len, key, key_size);
+}
+
+
+
+/* 
+* Function to write the cache key of a method, Host value and request URI,
+* as build_cache_key() describes. Returns the key length, or -1 if it does
+* not fit key_size.
+*/
+int format_cache_key(const char *method, int method_len, const char *host, int host_len,
+                     const char *uri, int uri_len, char *key, int key_size) {
+    // Drop a default port from the host
+    if (host_len > 3 && strncmp(host + host_len - 3, ":80", 3) == 0) {
+        host_len -= 3;
     }
     
-    // Find first space (after GET)
-    char *first_space = strchr(request, ' ');
-    if (!first_space || first_space >= line_end) {
-        return NULL;
+    // Skip scheme and authority of an absolute-form URI
+    const char *path = uri;
+    const char *uri_end = uri + uri_len;
+    if (uri_len >= 7 && strncasecmp(path, "http://", 7) == 0) {
+        path += 7;
+        while (path < uri_end && *path != '/' && *path != '?') path++;
     }
+    int path_len = uri_end - path;
+    int needs_slash = (path_len == 0 || *path != '/');
     
-    // Skip the space
-    char *uri_start = first_space + 1;
+    int key_len = method_len + 1 + host_len + 1 + needs_slash + path_len;
+    if (key_len + 1 > key_size) {
+        return -1;
+    }
     
-    // Find second space (before "HTTP/1.1")
-    char *second_space = strchr(uri_start, ' ');
-    if (!second_space || second_space >= line_end) {
-        return NULL;
+    char *out = key;
+    memcpy(out, method, method_len);
+    out += method_len;
+    *out++ = ' ';
+    for (int i = 0; i < host_len; i++) {
+        *out++ = tolower((unsigned char)host[i]);
     }
+    *out++ = ' ';
+    if (needs_slash) {
+        *out++ = '/';
+    }
+    memcpy(out, path, path_len);
+    out += path_len;
+    *out = '\0';
     
-    // Allocate memory for the URI
-    int uri_len = second_space - uri_start;
-    char *uri = malloc(uri_len + 1);
-    if (!uri) {
-        perror("malloc");
-        return NULL;
+    return key_len;
+}
+
+
+
+/* 
+* Function to get the status code from a response header, 0 if malformed
+*/
+int extract_response_status(char *response_header) {
+    char *space = strchr(response_header, ' ');
+    if (!space) {
+        return 0;
     }
+    return (int)strtol(space + 1, NULL, 10);
+}
+
+
+
+/* 
+* Function to find a comma-separated token in the value of a header, such
+* as "close" in Connection or "chunked" in Transfer-Encoding
+*/
+int header_has_token(char *header_block, char *name, char *token) {
+    int name_len = strlen(name);
+    char *line = strstr(header_block, "\r\n");
     
-    // Copy the URI
-    strncpy(uri, uri_start, uri_len);
-    uri[uri_len] = '\0';
+    while (line && line[2] != '\r' && line[2] != '\0') {
+        line += 2;
+        char *line_end = strstr(line, "\r\n");
+        if (!line_end) {
+            return 0;
+        }
+        
+        if (line_end - line > name_len && line[name_len] == ':' &&
+            strncasecmp(line, name, name_len) == 0 &&
+            value_has_token(line + name_len + 1, line_end, token)) {
+            return 1;
+        }
+        line = line_end;
+    }
+    return 0;
+}
+
+
+
+/* 
+* Function to follow chunked transfer coding over a response body. Returns
+* how many of the given bytes belong to the body; once the last chunk and
+* trailer have been seen, chunked->done is set and later bytes are not
+* consumed. Malformed framing sets chunked->error.
+*/
+int chunked_consume(chunked_t *chunked, const char *data, int len) {
+    int i = 0;
     
-    return uri;
-}
\ No newline at end of file
+    while (i < len && !chunked->done && !chunked->error) {
+        char c = data[i];
+        
+        switch (chunked->state) {
+            case CHUNK_SIZE:
+                if (isxdigit((unsigned char)c)) {
+                    int digit = isdigit((unsigned char)c) ? c - '0' : tolower((unsigned char)c) - 'a' + 10;
+                    if (chunked->remaining > (LONG_MAX >> 4)) {
+                        chunked->error = 1;
+                        break;
+                    }
+                    chunked->remaining = chunked->remaining * 16 + digit;
+                } else if (c == ';' || c == ' ' || c == '\t') {
+                    chunked->state = CHUNK_EXTENSION;
+                } else if (c == '\r') {
+                    chunked->state = CHUNK_SIZE_LF;
+                } else {
+                    chunked->error = 1;
+                }
+                i++;
+                break;
+            case CHUNK_EXTENSION:
+                if (c == '\r') {
+                    chunked->state = CHUNK_SIZE_LF;
+                }
+                i++;
+                break;
+            case CHUNK_SIZE_LF:
+                if (c != '\n') {
+                    chunked->error = 1;
+                }
+                chunked->state = chunked->remaining ? CHUNK_DATA : CHUNK_TRAILER;
+                i++;
+                break;
+            case CHUNK_DATA: {
+                long take = len - i;
+                if (take > chunked->remaining) {
+                    take = chunked->remaining;
+                }
+                chunked->remaining -= take;
+                i += take;
+                if (chunked->remaining == 0) {
+                    chunked->state = CHUNK_DATA_CR;
+                }
+                break;
+            }
+            case CHUNK_DATA_CR:
+                chunked->error = (c != '\r');
+                chunked->state = CHUNK_DATA_LF;
+                i++;
+                break;
+            case CHUNK_DATA_LF:
+                chunked->error = (c != '\n');
+                chunked->state = CHUNK_SIZE;
+                i++;
+                break;
+            case CHUNK_TRAILER:
+                // Start of a trailer line, an empty one ends the body
+                chunked->state = (c == '\r') ? CHUNK_END_LF : CHUNK_TRAILER_LINE;
+                i++;
+                break;
+            case CHUNK_TRAILER_LINE:
+                if (c == '\n') {
+                    chunked->state = CHUNK_TRAILER;
+                }
+                i++;
+                break;
+            case CHUNK_END_LF:
+                chunked->error = (c != '\n');
+                chunked->done = 1;
+                i++;
+                break;
+        }
+    }
+    return i;
+}
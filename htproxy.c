@@ -1,15 +1,122 @@
 #include "htproxy.h"
 #include "cache.h"
+#include "conn.h"
+#include "dns.h"
+#include "log.h"
+#include "scan.h"
 
 cache_t cache;
 int caching_enabled = 0;
+static const char *snapshot_path = NULL;   // -s, cache saved here on shutdown
+
+typedef struct {
+    pthread_t thread;
+    int cpu;                    // CPU this worker is pinned to
+    int listen_fd;              // worker's own SO_REUSEPORT listener
+} worker_t;
+
+static void usage(const char *prog) {
+    fprintf(stderr, "Usage: %s -p listen-port [-c] [-w workers] [-b backlog] "
+                    "[-m cache-bytes] [-M max-object-bytes] [-H] [-g grace-seconds] "
+                    "[-d disk-cache-file] [-D disk-cache-bytes] [-s snapshot-file] [-B] "
+                    "[-e lru|tinylfu]\n", prog);
+    exit(EXIT_FAILURE);
+}
+
+/*
+ * Parse a strictly positive integer option, exiting with usage otherwise
+ */
+static int parse_positive(const char *arg, const char *prog) {
+    char *end_ptr;
+    long value = strtol(arg, &end_ptr, 10);
+    if (end_ptr == arg || *end_ptr != '\0' || value <= 0 || value > INT32_MAX) {
+        usage(prog);
+    }
+    return (int)value;
+}
+
+/*
+ * Parse a byte count with an optional K, M or G suffix
+ */
+static size_t parse_size(const char *arg, const char *prog) {
+    char *end_ptr;
+    unsigned long long value = strtoull(arg, &end_ptr, 10);
+    if (end_ptr == arg || value == 0) {
+        usage(prog);
+    }
+    
+    switch (toupper((unsigned char)*end_ptr)) {
+        case 'G':
+            value *= 1024;
+            // fall through
+        case 'M':
+            value *= 1024;
+            // fall through
+        case 'K':
+            value *= 1024;
+            end_ptr++;
+            break;
+        case '\0':
+            break;
+        default:
+            usage(prog);
+    }
+    if (*end_ptr != '\0') {
+        usage(prog);
+    }
+    return (size_t)value;
+}
+
+static void *worker_main(void *arg) {
+    worker_t *worker = arg;
+    
+    cpu_set_t cpus;
+    CPU_ZERO(&cpus);
+    CPU_SET(worker->cpu, &cpus);
+    if (pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus) != 0) {
+        fprintf(stderr, "Could not pin worker to CPU %d\n", worker->cpu);
+    }
+    
+    event_loop_run(worker->listen_fd);
+    return NULL;
+}
+
+/*
+ * Wait for SIGINT or SIGTERM, which every other thread blocks
+ */
+static void *signal_main(void *arg) {
+    sigset_t signals;
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGINT);
+    sigaddset(&signals, SIGTERM);
+    
+    int signum;
+    while (sigwait(&signals, &signum) != 0) {
+    }
+    cleanup_and_exit(signum);
+    return NULL;
+}
 
 int main(int argc, char **argv) {
     int opt, listen_port_provided = 0;
     char *listen_port = NULL;
+    int num_workers = 0;        // 0 = single event loop on the main thread
+    int backlog = BACKLOG;
+    int binary_log = 0;
+    int max_object_given = 0;
+    cache_config_t cache_config = {
+        .mem_limit = CACHE_DEFAULT_MEM_LIMIT,
+        .max_object_size = MAX_CACHE_ENTRY_SIZE,
+        .max_entries = MAX_CACHE_ENTRIES,
+        .huge_pages = 0,
+        .grace = 0,
+        .disk_path = NULL,
+        .disk_size = DISK_DEFAULT_SIZE,
+        .policy = CACHE_POLICY_LRU,
+    };
     
     // Get command line arguments
-    while ((opt = getopt(argc, argv, "p:c")) != -1) {
+    while ((opt = getopt(argc, argv, "p:cw:b:m:M:Hg:d:D:s:Be:")) != -1) {
         switch (opt) {
             case 'p':
                 listen_port = optarg;
@@ -18,423 +125,169 @@ int main(int argc, char **argv) {
             case 'c':
                 caching_enabled = 1;
                 break;
+            case 'w':
+                num_workers = parse_positive(optarg, argv[0]);
+                break;
+            case 'b':
+                backlog = parse_positive(optarg, argv[0]);
+                break;
+            case 'm':
+                // An explicit budget lifts the entry limit, memory decides
+                cache_config.mem_limit = parse_size(optarg, argv[0]);
+                cache_config.max_entries = 0;
+                break;
+            case 'M':
+                cache_config.max_object_size = parse_size(optarg, argv[0]);
+                max_object_given = 1;
+                break;
+            case 'H':
+                cache_config.huge_pages = 1;
+                break;
+            case 'g':
+                cache_config.grace = parse_positive(optarg, argv[0]);
+                break;
+            case 'd':
+                cache_config.disk_path = optarg;
+                break;
+            case 'D':
+                cache_config.disk_size = parse_size(optarg, argv[0]);
+                break;
+            case 's':
+                snapshot_path = optarg;
+                break;
+            case 'B':
+                binary_log = 1;
+                break;
+            case 'e':
+                if (strcmp(optarg, "lru") == 0) {
+                    cache_config.policy = CACHE_POLICY_LRU;
+                } else if (strcmp(optarg, "tinylfu") == 0) {
+                    cache_config.policy = CACHE_POLICY_TINYLFU;
+                } else {
+                    usage(argv[0]);
+                }
+                break;
             default:
-                fprintf(stderr, "Usage: %s -p listen-port [-c]\n", argv[0]);
-                exit(EXIT_FAILURE);
+                usage(argv[0]);
         }
     }
     
     // Check if required arguments are provided
     if (!listen_port_provided) {
-        fprintf(stderr, "Usage: %s -p listen-port [-c]\n", argv[0]);
-        exit(EXIT_FAILURE);
+        usage(argv[0]);
     }
     
-    if (caching_enabled) {
-        cache_init(&cache);
-        
-        // cleanup cache on exit
-        signal(SIGINT, cleanup_and_exit);
-        signal(SIGTERM, cleanup_and_exit);
+    // Responses are stored in chunks, so with a memory budget an object may
+    // take a share of it rather than the small default
+    if (cache_config.max_entries == 0 && !max_object_given &&
+        cache_config.mem_limit / CACHE_MAX_OBJECT_SHARE > cache_config.max_object_size) {
+        cache_config.max_object_size = cache_config.mem_limit / CACHE_MAX_OBJECT_SHARE;
     }
-
     
+    // SIGINT and SIGTERM go to one thread that can wait for the cache lock
+    // and flush the log, every thread started from here on inherits the mask
+    sigset_t signals;
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGINT);
+    sigaddset(&signals, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &signals, NULL);
     
-    // Create listening socket
-    int sockfd = create_listening_socket(listen_port);
+    // Log lines are written by a background thread from here on
+    log_init(binary_log);
     
-    // Listen on the socket
-    if (listen(sockfd, BACKLOG) < 0) {
-        perror("listen");
-        exit(EXIT_FAILURE);
-    }
-    
-    // Wait for new connection
-    while (1) {
-        struct sockaddr_storage client_addr;
-        socklen_t client_addr_size = sizeof(client_addr);
-        
-        // Accept a connection
-        int client_fd = accept(sockfd, (struct sockaddr *)&client_addr, &client_addr_size);
-        if (client_fd < 0) {
-            perror("accept");
-            continue;
-        }
-        
-        printf("Accepted\n");
-        fflush(stdout);
-        
-        // Handle the request
-        handle_client_request(client_fd);
-        
-        // Close client socket after handling the request
-        close(client_fd);
-    }
-    
-    // Cleanup cache
     if (caching_enabled) {
-        cache_cleanup(&cache);
-    }
-    
-    close(sockfd);
-    return 0;
-}
-
-void handle_client_request(int client_fd) {
-    char request[MAX_REQUEST_SIZE];
-    int request_len = 0;
-    int end_of_headers = 0;
-    
-    // Read the request
-    while (!end_of_headers && request_len < MAX_REQUEST_SIZE - 1) {
-        int bytes_read = recv(client_fd, request + request_len, 
-                             MAX_REQUEST_SIZE - 1 - request_len, 0);
-        
-        if (bytes_read <= 0) {
-            if (bytes_read < 0) {
-                perror("recv");
-            }
-            return;
-        }
-        
-        request_len += bytes_read;
-        request[request_len] = '\0';
+        cache_init(&cache, &cache_config);
         
-        // Check if we're at the end and have the complete header
-        if (strstr(request, "\r\n\r\n") != NULL) {
-            end_of_headers = 1;
+        // Warm the cache from the last shutdown before taking connections
+        if (snapshot_path && cache_load(&cache, snapshot_path) < 0) {
+            fprintf(stderr, "Starting with an empty cache\n");
         }
     }
     
-    if (!end_of_headers) {
-        fprintf(stderr, "Incomplete request header\n");
-        return;
+    // cleanup cache and log on exit
+    pthread_t signal_thread;
+    if (pthread_create(&signal_thread, NULL, signal_main, NULL) != 0) {
+        fprintf(stderr, "Failed to start signal thread\n");
+        exit(EXIT_FAILURE);
     }
+    pthread_detach(signal_thread);
     
-    char *header_end = strstr(request, "\r\n\r\n");
-    if (!header_end) {
-        fprintf(stderr, "Invalid request format\n");
-        return;
-    }
+    // A peer closing early must not kill the whole proxy
+    signal(SIGPIPE, SIG_IGN);
     
-    // Log the last line of the header before the blank line
-    char *last_line_start = header_end;
-    // Now work backwards to find the (start of) the last line
-    while (last_line_start > request && 
-           !(last_line_start >= request + 2 && 
-             last_line_start[-2] == '\r' && last_line_start[-1] == '\n')) {
-        last_line_start--;
-    }
+    // Origin lookups run on resolver threads, off the event loops
+    dns_init();
     
-    // Extract the last line for logging
-    int last_line_len = header_end - last_line_start;
-    char last_line[last_line_len + 1];
-    strncpy(last_line, last_line_start, last_line_len);
-    last_line[last_line_len] = '\0';
+    // Header scanning uses the widest vector unit the CPU has
+    scan_init();
     
-    printf("Request tail %s\n", last_line);
-    fflush(stdout);
-    
-    // Extract host from Host header
-    char *host = extract_host_header(request, request_len);
-    if (!host) {
-        fprintf(stderr, "No Host header found in request\n");
-        return;
-    }
-
-    // Extract URI
-    char *request_uri = extract_request_uri(request);
-    if (!request_uri) {
-        fprintf(stderr, "Invalid request format\n");
-        free(host);
-        return;
-    }
-    
-    int total_request_len = (header_end - request) + 4; // for \r\n\r\n
-    int stale_entry_index = -1;
-
-    // Check cache for this request (if caching is enabled)
-    if (caching_enabled && request_len <= MAX_REQUEST_SIZE_TO_CACHE) {
-        int cache_index = cache_find(&cache, request, total_request_len);
+    if (num_workers > 0) {
+        worker_t *workers = calloc(num_workers, sizeof(worker_t));
+        if (!workers) {
+            perror("calloc");
+            exit(EXIT_FAILURE);
+        }
         
-        if (cache_index != -1) {
-            // Found in cache and it's not stale
-            printf("Serving %s %s from cache\n", host, request_uri);
-            fflush(stdout);
-            
-            // Send the cached response to the client
-            int cached_response_len = cache.entries[cache_index].response_len;
-            int bytes_sent = 0;
-            
-            while (bytes_sent < cached_response_len) {
-                int sent = send(client_fd, 
-                               cache.entries[cache_index].response + bytes_sent, 
-                               cached_response_len - bytes_sent, 0);
-                if (sent <= 0) {
-                    perror("send to client from cache");
-                    free(host);
-                    free(request_uri);
-                    return;
-                }
-                bytes_sent += sent;
+        long num_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        if (num_cpus < 1) {
+            num_cpus = 1;
+        }
+        
+        // Bind every listener before any worker runs, the kernel then
+        // spreads incoming connections across them
+        for (int i = 0; i < num_workers; i++) {
+            workers[i].cpu = i % num_cpus;
+            workers[i].listen_fd = create_listening_socket(listen_port, 1);
+            if (listen(workers[i].listen_fd, backlog) < 0) {
+                perror("listen");
+                exit(EXIT_FAILURE);
             }
-            
-            free(host);
-            free(request_uri);
-            return;
         }
         
-        // Check if we have a stale entry for this request
-        for (int i = 0; i < MAX_CACHE_ENTRIES; i++) {
-            if (cache.entries[i].valid && 
-                cache.entries[i].request_len == total_request_len &&
-                memcmp(cache.entries[i].request, request, total_request_len) == 0 &&
-                is_cache_entry_stale(&cache, i)) {
-                
-                // Found a stale entry, but don't evict it yet
-                stale_entry_index = i;
-                break;
+        for (int i = 0; i < num_workers; i++) {
+            if (pthread_create(&workers[i].thread, NULL, worker_main, &workers[i]) != 0) {
+                fprintf(stderr, "Failed to start worker %d\n", i);
+                exit(EXIT_FAILURE);
             }
         }
         
-        // Only prepare eviction if we don't have a stale entry to replace
-        if (stale_entry_index == -1) {
-            cache_prepare_eviction_if_needed(&cache, total_request_len);
+        for (int i = 0; i < num_workers; i++) {
+            pthread_join(workers[i].thread, NULL);
         }
-    }
-
-    // Either caching is disabled or we had a cache miss
-    printf("GETting %s %s\n", host, request_uri);
-    fflush(stdout);
-    
-    // Connect to origin server using the extracted host
-    int server_fd = connect_to_origin_server(host);
-    if (server_fd < 0) {
-        fprintf(stderr, "Failed to connect to origin server: %s\n", host); 
-        free(host);
-        free(request_uri);
-        return;
+        
+        free(workers);
+        return 0;
     }
     
-    // Send the request to the origin server
-    int bytes_sent = 0;
+    // Create listening socket
+    int sockfd = create_listening_socket(listen_port, 0);
     
-    while (bytes_sent < total_request_len) {
-        int sent = send(server_fd, request + bytes_sent, 
-                       total_request_len - bytes_sent, 0);
-        if (sent <= 0) {
-            perror("write to server");
-            close(server_fd);
-            free(host);
-            free(request_uri);
-            return;
-        }
-        bytes_sent += sent;
+    // Listen on the socket
+    if (listen(sockfd, backlog) < 0) {
+        perror("listen");
+        exit(EXIT_FAILURE);
     }
     
-    // Read the response from the origin server and forward it to client
-    char response_buffer[BUFFER_SIZE];
-    int total_bytes_forwarded = 0;
-    int response_header_complete = 0;
-    char header_accumulator[MAX_REQUEST_SIZE];
-    int header_bytes_accumulated = 0;
-    long content_length = -1;
-    int header_bytes_forwarded = 0;
-    
-    // Prepare buffer for complete response if caching is enabled
-    char *complete_response = NULL;
-    int complete_response_size = 0;
-    int complete_response_capacity = 0;
+    // Serve connections until we are signalled
+    event_loop_run(sockfd);
     
-    if (caching_enabled && total_request_len <= MAX_REQUEST_SIZE_TO_CACHE) {
-        complete_response_capacity = BUFFER_SIZE;
-        complete_response = malloc(complete_response_capacity);
-        if (!complete_response) {
-            perror("malloc for response cache");
-        }
-    }
-    
-    while (1) {
-        int bytes_read = recv(server_fd, response_buffer, BUFFER_SIZE, 0);
-        
-        if (bytes_read <= 0) {
-            // Connection closed or some error
-            break;
-        }
-        
-        // If we're caching, add this to the complete response
-        if (complete_response && bytes_read > 0) {
-            // Check if we need to grow our buffer
-            if (complete_response_size + bytes_read > complete_response_capacity) {
-                // Double the capacity
-                int new_capacity = complete_response_capacity * 2;
-                char *new_buffer = realloc(complete_response, new_capacity);
-                if (new_buffer) {
-                    complete_response = new_buffer;
-                    complete_response_capacity = new_capacity;
-                } else {
-                    // If realloc fails, don't caching for this request
-                    perror("realloc for response cache");
-                    free(complete_response);
-                    complete_response = NULL;
-                }
-            }
-            
-            // Add to complete response if we still have a buffer
-            if (complete_response) {
-                memcpy(complete_response + complete_response_size, response_buffer, bytes_read);
-                complete_response_size += bytes_read;
-            }
-        }
-        
-        // If we haven't found the complete header yet, accumulate it
-        if (!response_header_complete) {
-            // Copy data to header accumulator
-            int bytes_to_copy = bytes_read;
-            if (header_bytes_accumulated + bytes_to_copy >= MAX_REQUEST_SIZE) {
-                bytes_to_copy = MAX_REQUEST_SIZE - header_bytes_accumulated - 1;
-            }
-            
-            if (bytes_to_copy > 0) {
-                memcpy(header_accumulator + header_bytes_accumulated, response_buffer, bytes_to_copy);
-                header_bytes_accumulated += bytes_to_copy;
-                header_accumulator[header_bytes_accumulated] = '\0';
-            }
-            
-            // Check for end of header
-            char *header_end_pos = strstr(header_accumulator, "\r\n\r\n");
-            if (header_end_pos) {
-                response_header_complete = 1;
-                header_bytes_forwarded = (header_end_pos - header_accumulator) + 4;
-                
-                // Extract Content-Length from accumulated header
-                char *content_len_start = strcasestr(header_accumulator, "Content-Length:");
-                if (content_len_start) {
-                    content_len_start += 15; // Skip "Content-Length:"
-                    while (*content_len_start == ' ') content_len_start++; // Skip spaces
-                    content_length = strtol(content_len_start, NULL, 10);
-                    
-                    printf("Response body length %ld\n", content_length);
-                    fflush(stdout);
-                }
-            }
-        }
-        
-        // Forward all received bytes to client
-        int client_bytes_sent = 0;
-        while (client_bytes_sent < bytes_read) {
-            int sent = send(client_fd, response_buffer + client_bytes_sent, 
-                           bytes_read - client_bytes_sent, 0);
-            if (sent <= 0) {
-                perror("send to client");
-                close(server_fd);
-                free(host);
-                free(request_uri);
-                if (complete_response) free(complete_response);
-                return;
-            }
-            client_bytes_sent += sent;
-        }
-        
-        total_bytes_forwarded += bytes_read;
-        
-        // If we know the content length and have forwarded header + content, we're done
-        if (response_header_complete && content_length >= 0) {
-            if (total_bytes_forwarded >= header_bytes_forwarded + content_length) {
-                break;
-            }
-        }
+    // Cleanup cache
+    if (caching_enabled) {
+        cache_cleanup(&cache);
     }
     
-    // Handle caching after we have the complete response
-    if (caching_enabled && complete_response && total_request_len <= MAX_REQUEST_SIZE_TO_CACHE) {
-        if (complete_response_size <= MAX_CACHE_ENTRY_SIZE) {
-            // Check if response is cacheable, task3
-            if (is_cacheable_response(header_accumulator)) {
-                // Extract max-age for task4
-                uint32_t max_age = extract_max_age(header_accumulator);
-                
-                // If we had a stale entry, replace it directly
-                if (stale_entry_index != -1) {
-                    // Free the old stale entry
-                    free(cache.entries[stale_entry_index].request);
-                    free(cache.entries[stale_entry_index].response);
-                    free(cache.entries[stale_entry_index].host);
-                    free(cache.entries[stale_entry_index].uri);
-                    
-                    // Replace with new data
-                    cache.entries[stale_entry_index].request = malloc(total_request_len);
-                    cache.entries[stale_entry_index].response = malloc(complete_response_size);
-                    
-                    if (cache.entries[stale_entry_index].request && cache.entries[stale_entry_index].response) {
-                        memcpy(cache.entries[stale_entry_index].request, request, total_request_len);
-                        cache.entries[stale_entry_index].request_len = total_request_len;
-                        memcpy(cache.entries[stale_entry_index].response, complete_response, complete_response_size);
-                        cache.entries[stale_entry_index].response_len = complete_response_size;
-                        cache.entries[stale_entry_index].host = strdup(host);
-                        cache.entries[stale_entry_index].uri = strdup(request_uri);
-                        cache.entries[stale_entry_index].cached_at = get_monotonic_time_ms();
-                        cache.entries[stale_entry_index].max_age = max_age;
-                        cache_update_lru(&cache, stale_entry_index);
-                    } else {
-                        // If allocation failed, mark entry as invalid
-                        cache.entries[stale_entry_index].valid = 0;
-                        cache.size--;
-                    }
-                } else {
-                    // No stale entry, use normal cache_add
-                    cache_add(&cache, request, total_request_len, 
-                            complete_response, complete_response_size,
-                            host, request_uri, max_age);
-                }
-            } else {
-                // Not cacheable - if we had a stale entry, evict it now
-                if (stale_entry_index != -1) {
-                    printf("Evicting %s %s from cache\n", 
-                          cache.entries[stale_entry_index].host, 
-                          cache.entries[stale_entry_index].uri);
-                    fflush(stdout);
-                    
-                    free(cache.entries[stale_entry_index].request);
-                    free(cache.entries[stale_entry_index].response);
-                    free(cache.entries[stale_entry_index].host);
-                    free(cache.entries[stale_entry_index].uri);
-                    cache.entries[stale_entry_index].valid = 0;
-                    cache.size--;
-                }
-                
-                printf("Not caching %s %s\n", host, request_uri);
-                fflush(stdout);
-            }
-        } else {
-            // Response too large, if we had a stale entry, evict it
-            if (stale_entry_index != -1) {
-                printf("Evicting %s %s from cache\n", 
-                      cache.entries[stale_entry_index].host, 
-                      cache.entries[stale_entry_index].uri);
-                fflush(stdout);
-                
-                free(cache.entries[stale_entry_index].request);
-                free(cache.entries[stale_entry_index].response);
-                free(cache.entries[stale_entry_index].host);
-                free(cache.entries[stale_entry_index].uri);
-                cache.entries[stale_entry_index].valid = 0;
-                cache.size--;
-            }
-        }
-        
-        free(complete_response);
-    }
-   
-    close(server_fd);
-    free(host);
-    free(request_uri);
+    close(sockfd);
+    return 0;
 }
 
-// Free cache on exit
+// Save the cache on exit, the log is flushed by exit()
 void cleanup_and_exit(int signum) {
-    if (caching_enabled) {
-        cache_cleanup(&cache);
+    if (caching_enabled && snapshot_path) {
+        // Entries stay put while the lock is held. Workers still read into
+        // and send from chunks outside it, so the arena is left for the
+        // process exit to unmap rather than freed under them.
+        cache_lock(&cache);
+        cache_save(&cache, snapshot_path);
     }
     exit(0);
 }
@@ -15,17 +15,110 @@
 #include <errno.h>
 #include <sys/socket.h>
 #include <signal.h>
+#include <limits.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <sched.h>
 
 #define BUFFER_SIZE 65536      // 64KB buffer size
 #define MAX_REQUEST_SIZE 65536 // 64KB request size
-#define BACKLOG 10            // required in project spec
+#define BACKLOG 10            // required in project spec, default for -b
+#define MAX_ORIGIN_ADDRS 4     // resolved addresses tried per origin
+#define MAX_REQUEST_HEADERS 100 // header fields kept per request, more is an error
+
+// Position in a body sent with chunked transfer coding
+typedef enum {
+    CHUNK_SIZE,
+    CHUNK_EXTENSION,
+    CHUNK_SIZE_LF,
+    CHUNK_DATA,
+    CHUNK_DATA_CR,
+    CHUNK_DATA_LF,
+    CHUNK_TRAILER,
+    CHUNK_TRAILER_LINE,
+    CHUNK_END_LF,
+} chunk_state_t;
+
+typedef struct {
+    chunk_state_t state;
+    long remaining;             // size being parsed, then bytes left in the chunk
+    int done;
+    int error;
+} chunked_t;
+
+// Position in a request header block being parsed
+typedef enum {
+    PARSE_METHOD,
+    PARSE_URI,
+    PARSE_VERSION,
+    PARSE_LINE_LF,
+    PARSE_HEADER_START,
+    PARSE_HEADER_NAME,
+    PARSE_VALUE_START,
+    PARSE_VALUE,
+    PARSE_END_LF,
+} parse_state_t;
+
+// Part of the request buffer, as an offset so the buffer may move
+typedef struct {
+    int offset;
+    int len;
+} span_t;
+
+typedef struct {
+    span_t name;
+    span_t value;               // without surrounding spaces
+} header_view_t;
+
+// Request header block parsed as it arrives, all zero before the first byte
+typedef struct request_parser {
+    parse_state_t state;
+    int pos;                    // bytes of the buffer scanned so far
+    int mark;                   // start of the token being scanned
+    int value_end;              // end of the header value so far, trailing spaces excluded
+    span_t method;
+    span_t uri;
+    span_t version;
+    header_view_t headers[MAX_REQUEST_HEADERS];
+    int num_headers;
+    int last_line;              // start of the line before the blank line
+    int header_len;             // bytes including the final \r\n\r\n, 0 until complete
+} request_parser_t;
+
+// What serving a hit needs from a complete request header, read without
+// the full parse
+typedef struct {
+    span_t method;
+    span_t uri;
+    span_t version;
+    span_t host;
+    int last_line;              // start of the line before the blank line
+    int says_close;             // Connection or Proxy-Connection lists close
+    int says_keep_alive;        // or keep-alive
+} request_probe_t;
+
+// Addresses an origin host resolved to, in getaddrinfo() order
+typedef struct {
+    int count;
+    struct sockaddr_storage addrs[MAX_ORIGIN_ADDRS];
+    socklen_t addr_lens[MAX_ORIGIN_ADDRS];
+} addr_list_t;
 
 // Function declarations
-int create_listening_socket(char *port);
-char *extract_host_header(char *request, int request_len);
-char *extract_request_uri(char *request);
-int connect_to_origin_server(char *host);
-void handle_client_request(int client_fd);
+int create_listening_socket(char *port, int reuse_port);
+int request_parse(request_parser_t *parser, const char *buffer, int len);
+const char *request_header(const request_parser_t *parser, const char *buffer,
+                           const char *name, int name_len, int *value_len);
+int request_has_token(const request_parser_t *parser, const char *buffer,
+                      const char *name, const char *token);
+int request_probe(request_probe_t *probe, const char *buffer, int header_len);
+int format_cache_key(const char *method, int method_len, const char *host, int host_len,
+                     const char *uri, int uri_len, char *key, int key_size);
+int build_cache_key(const request_parser_t *parser, const char *buffer, char *key, int key_size);
+int extract_response_status(char *response_header);
+int header_has_token(char *header_block, char *name, char *token);
+int chunked_consume(chunked_t *chunked, const char *data, int len);
+int connect_to_origin_server(addr_list_t *addrs, int *next_addr);
 void cleanup_and_exit(int signum);
 
 #endif
\ No newline at end of file
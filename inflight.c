@@ -0,0 +1,225 @@
+/**
+ * Collapsed forwarding. The first miss for a cache key becomes the leader
+ * and fetches from the origin; later misses for the same key follow it and
+ * stream the response straight out of the leader's cache chunks as they
+ * fill, so the origin sees one fetch per object. Followers may live on
+ * other event loops, which are woken through their eventfds.
+ */
+
+#include "inflight.h"
+
+static pthread_mutex_t inflight_lock = PTHREAD_MUTEX_INITIALIZER;
+static inflight_t *inflight_buckets[INFLIGHT_BUCKETS];
+
+static unsigned int key_hash(const char *key, int key_len) {
+    unsigned int hash = 5381;
+    for (int i = 0; i < key_len; i++) {
+        hash = hash * 33 + (unsigned char)key[i];
+    }
+    return hash % INFLIGHT_BUCKETS;
+}
+
+/*
+ * Take a fetch out of the table so new requests no longer join it. Called
+ * with inflight_lock held.
+ */
+static void table_remove(inflight_t *flight) {
+    if (!flight->in_table) {
+        return;
+    }
+    inflight_t **link = &inflight_buckets[key_hash(flight->key, flight->key_len)];
+    while (*link != flight) {
+        link = &(*link)->next;
+    }
+    *link = flight->next;
+    flight->in_table = 0;
+}
+
+/*
+ * Wake every loop with followers. Called with inflight_lock held.
+ */
+static void notify_followers(inflight_t *flight) {
+    uint64_t one = 1;
+    for (int i = 0; i < flight->num_notify_fds; i++) {
+        if (write(flight->notify_fds[i], &one, sizeof(one)) < 0 && errno != EAGAIN) {
+            perror("write to eventfd");
+        }
+    }
+}
+
+/*
+ * Follow the fetch already running for key, or start one. *leader is set
+ * when the caller has to fetch from the origin itself. Returns NULL if the
+ * fetch cannot be tracked, the caller then fetches on its own.
+ */
+inflight_t *inflight_join(cache_t *cache, const char *key, int key_len, int notify_fd,
+                          int *leader) {
+    pthread_mutex_lock(&inflight_lock);
+
+    unsigned int bucket = key_hash(key, key_len);
+    inflight_t *flight = inflight_buckets[bucket];
+    while (flight && !(flight->key_len == key_len && memcmp(flight->key, key, key_len) == 0)) {
+        flight = flight->next;
+    }
+
+    if (flight) {
+        // Make sure the follower's loop is woken as bytes arrive
+        int known = 0;
+        for (int i = 0; i < flight->num_notify_fds; i++) {
+            if (flight->notify_fds[i] == notify_fd) {
+                known = 1;
+                break;
+            }
+        }
+        if (!known) {
+            int *notify_fds = realloc(flight->notify_fds,
+                                      (flight->num_notify_fds + 1) * sizeof(int));
+            if (!notify_fds) {
+                pthread_mutex_unlock(&inflight_lock);
+                return NULL;
+            }
+            notify_fds[flight->num_notify_fds++] = notify_fd;
+            flight->notify_fds = notify_fds;
+        }
+
+        flight->refs++;
+        *leader = 0;
+        pthread_mutex_unlock(&inflight_lock);
+        return flight;
+    }
+
+    flight = calloc(1, sizeof(inflight_t));
+    if (!flight || !(flight->key = malloc(key_len))) {
+        free(flight);
+        pthread_mutex_unlock(&inflight_lock);
+        return NULL;
+    }
+    memcpy(flight->key, key, key_len);
+    flight->key_len = key_len;
+    flight->cache = cache;
+    flight->state = INFLIGHT_FETCHING;
+    flight->refs = 1;
+    flight->in_table = 1;
+    flight->next = inflight_buckets[bucket];
+    inflight_buckets[bucket] = flight;
+
+    *leader = 1;
+    pthread_mutex_unlock(&inflight_lock);
+    return flight;
+}
+
+/*
+ * Leader read len more bytes from the origin into chunk, the last of its
+ * chain. The fetch holds each chunk it is given until it is freed.
+ */
+void inflight_append(inflight_t *flight, cache_chunk_t *chunk, int len) {
+    pthread_mutex_lock(&inflight_lock);
+
+    if (chunk != flight->tail) {
+        cache_chunk_get(chunk);
+        if (!flight->head) {
+            flight->head = chunk;
+        }
+        flight->tail = chunk;
+    }
+    flight->len += len;
+
+    if (flight->state == INFLIGHT_STREAMING) {
+        notify_followers(flight);
+    }
+    pthread_mutex_unlock(&inflight_lock);
+}
+
+/*
+ * Leader has seen a response header that every follower may be given
+ */
+void inflight_share(inflight_t *flight) {
+    pthread_mutex_lock(&inflight_lock);
+    flight->state = INFLIGHT_STREAMING;
+    notify_followers(flight);
+    pthread_mutex_unlock(&inflight_lock);
+}
+
+/*
+ * Leader has the whole response. Called with the cache locked right after
+ * storing it, so a miss either sees the entry or joins this fetch.
+ */
+void inflight_finish(inflight_t *flight, int delimited) {
+    pthread_mutex_lock(&inflight_lock);
+    table_remove(flight);
+    flight->delimited = delimited;
+    flight->state = INFLIGHT_DONE;
+    notify_followers(flight);
+    pthread_mutex_unlock(&inflight_lock);
+}
+
+/*
+ * Leader will not share the response after all; followers that have not
+ * sent anything yet fetch for themselves
+ */
+void inflight_release(inflight_t *flight) {
+    pthread_mutex_lock(&inflight_lock);
+    table_remove(flight);
+    flight->state = INFLIGHT_RELEASED;
+    notify_followers(flight);
+    pthread_mutex_unlock(&inflight_lock);
+}
+
+/*
+ * Follower takes the bytes from offset on that lie in one chunk, *data
+ * pointing at them; cursor, zeroed before the first read, remembers where
+ * offset is. The bytes stay valid until the follower puts the fetch.
+ * Returns how many there are, with the state of the fetch at that point.
+ */
+long inflight_read(inflight_t *flight, long offset, cache_cursor_t *cursor, const char **data,
+                   inflight_state_t *state, int *delimited) {
+    long available = 0;
+
+    pthread_mutex_lock(&inflight_lock);
+    *state = flight->state;
+    *delimited = flight->delimited;
+    if ((flight->state == INFLIGHT_STREAMING || flight->state == INFLIGHT_DONE) &&
+        flight->len > offset) {
+        // The leader fills each chunk before starting the next, and only
+        // the bytes it has announced are looked at
+        if (!cursor->chunk) {
+            cursor->chunk = flight->head;
+            cursor->offset = 0;
+        } else if (cursor->offset == cursor->chunk->capacity) {
+            cursor->chunk = cursor->chunk->next;
+            cursor->offset = 0;
+        }
+        available = flight->len - offset;
+        if (available > cursor->chunk->capacity - cursor->offset) {
+            available = cursor->chunk->capacity - cursor->offset;
+        }
+        *data = cursor->chunk->data + cursor->offset;
+        cursor->offset += available;
+    }
+    pthread_mutex_unlock(&inflight_lock);
+
+    return available;
+}
+
+/*
+ * Drop a reference, the last one frees the fetch
+ */
+void inflight_put(inflight_t *flight) {
+    pthread_mutex_lock(&inflight_lock);
+    int refs = --flight->refs;
+    if (refs == 0) {
+        table_remove(flight);
+    }
+    pthread_mutex_unlock(&inflight_lock);
+
+    if (refs == 0) {
+        if (flight->head) {
+            cache_lock(flight->cache);
+            cache_chunks_put(flight->cache, flight->head, flight->tail);
+            cache_unlock(flight->cache);
+        }
+        free(flight->key);
+        free(flight->notify_fds);
+        free(flight);
+    }
+}
@@ -0,0 +1,45 @@
+#ifndef INFLIGHT_H
+#define INFLIGHT_H
+
+#include "htproxy.h"
+#include "cache.h"
+
+#define INFLIGHT_BUCKETS 1024
+
+// How far the leading fetch has got, as seen by the connections following it
+typedef enum {
+    INFLIGHT_FETCHING,          // response header not judged yet, nothing to share
+    INFLIGHT_STREAMING,         // response will be shared, bytes can be read
+    INFLIGHT_DONE,              // whole response is in the chunks
+    INFLIGHT_RELEASED,          // not shareable or failed, followers fetch themselves
+} inflight_state_t;
+
+// One origin fetch that other requests for the same cache key attach to
+typedef struct inflight {
+    char *key;
+    int key_len;
+    inflight_state_t state;
+    cache_t *cache;             // owner of the chunks
+    cache_chunk_t *head;        // the leader's chunks of the response, each held
+    cache_chunk_t *tail;
+    long len;                   // bytes of them received so far
+    int delimited;              // response carries its own length
+    int refs;                   // leader plus followers
+    int *notify_fds;            // eventfds of loops with followers
+    int num_notify_fds;
+    int in_table;
+    struct inflight *next;      // next fetch in the same bucket
+} inflight_t;
+
+// Function declarations
+inflight_t *inflight_join(cache_t *cache, const char *key, int key_len, int notify_fd,
+                          int *leader);
+void inflight_append(inflight_t *flight, cache_chunk_t *chunk, int len);
+void inflight_share(inflight_t *flight);
+void inflight_finish(inflight_t *flight, int delimited);
+void inflight_release(inflight_t *flight);
+long inflight_read(inflight_t *flight, long offset, cache_cursor_t *cursor, const char **data,
+                   inflight_state_t *state, int *delimited);
+void inflight_put(inflight_t *flight);
+
+#endif
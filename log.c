@@ -0,0 +1,310 @@
+/**
+ * Asynchronous event log. Each thread that logs gets its own ring of
+ * records and never blocks: a full ring counts the record as dropped. One
+ * writer thread merges the rings in time order, formats the records as the
+ * familiar text lines (or keeps them as binary records with -B) and writes
+ * them to stdout in large batches.
+ */
+
+#include "log.h"
+
+static const char *text_formats[LOG_NUM_EVENTS] = {
+    [LOG_ACCEPTED] = "Accepted\n",
+    [LOG_REQUEST_TAIL] = "Request tail %.*s\n",
+    [LOG_GETTING] = "GETting %.*s %.*s\n",
+    [LOG_RESPONSE_LENGTH] = "Response body length %ld\n",
+    [LOG_SERVING] = "Serving %.*s %.*s from cache\n",
+    [LOG_EVICTING] = "Evicting %.*s %.*s from cache\n",
+    [LOG_NOT_CACHING] = "Not caching %.*s %.*s\n",
+    [LOG_STALE] = "Stale entry for %.*s %.*s\n",
+    [LOG_UNMODIFIED] = "Entry for %.*s %.*s unmodified\n",
+    [LOG_JOINING] = "Joining fetch of %.*s %.*s\n",
+    [LOG_REFRESHING] = "Refreshing %.*s %.*s\n",
+};
+
+static pthread_mutex_t registry_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t drain_lock = PTHREAD_MUTEX_INITIALIZER;
+static log_ring_t *rings = NULL;
+static int log_started = 0;
+static int log_binary = 0;
+static __thread log_ring_t *thread_ring = NULL;
+
+// Writer side, under drain_lock. The batch is written once it passes
+// LOG_WRITE_BUFFER, with room beyond that for the largest record.
+static char out[LOG_WRITE_BUFFER + sizeof(log_record_t) + 2 * UINT16_MAX + 64];
+static int out_len = 0;
+static char record_data[sizeof(log_record_t) + 2 * UINT16_MAX];
+
+static void write_out(void) {
+    int written = 0;
+    while (written < out_len) {
+        ssize_t n = write(STDOUT_FILENO, out + written, out_len - written);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            break;  // Nowhere to log to, drop the batch
+        }
+        written += n;
+    }
+    out_len = 0;
+}
+
+/*
+ * Append one record to the output batch, as text or as it is
+ */
+static void append_record(const log_record_t *record, const char *first, const char *second) {
+    int len = sizeof(log_record_t) + record->len[0] + record->len[1] + 64;
+    if (out_len + len > LOG_WRITE_BUFFER) {
+        write_out();
+    }
+
+    if (log_binary) {
+        memcpy(out + out_len, record, sizeof(log_record_t));
+        out_len += sizeof(log_record_t);
+        if (record->len[0]) {
+            memcpy(out + out_len, first, record->len[0]);
+            out_len += record->len[0];
+        }
+        if (record->len[1]) {
+            memcpy(out + out_len, second, record->len[1]);
+            out_len += record->len[1];
+        }
+        return;
+    }
+
+    const char *format = text_formats[record->event];
+    switch (record->event) {
+        case LOG_ACCEPTED:
+            out_len += snprintf(out + out_len, sizeof(out) - out_len, "%s", format);
+            break;
+        case LOG_REQUEST_TAIL:
+            out_len += snprintf(out + out_len, sizeof(out) - out_len, format,
+                                (int)record->len[0], first);
+            break;
+        case LOG_RESPONSE_LENGTH:
+            out_len += snprintf(out + out_len, sizeof(out) - out_len, format,
+                                (long)record->number);
+            break;
+        default:
+            out_len += snprintf(out + out_len, sizeof(out) - out_len, format,
+                                (int)record->len[0], first, (int)record->len[1], second);
+            break;
+    }
+}
+
+// Copy len bytes at a ring position, which may wrap past the end
+static void ring_read(const log_ring_t *ring, uint64_t pos, void *dest, size_t len) {
+    size_t offset = pos & (LOG_RING_SIZE - 1);
+    size_t first = len < LOG_RING_SIZE - offset ? len : LOG_RING_SIZE - offset;
+    memcpy(dest, ring->data + offset, first);
+    memcpy((char *)dest + first, ring->data, len - first);
+}
+
+static void ring_write(log_ring_t *ring, uint64_t pos, const void *src, size_t len) {
+    size_t offset = pos & (LOG_RING_SIZE - 1);
+    size_t first = len < LOG_RING_SIZE - offset ? len : LOG_RING_SIZE - offset;
+    if (len == 0) {
+        return;
+    }
+    memcpy(ring->data + offset, src, first);
+    memcpy(ring->data, (const char *)src + first, len - first);
+}
+
+/*
+ * Report records lost since the last report, in the binary log as a record
+ * and otherwise on stderr so stdout keeps only the event lines
+ */
+static void report_drops(log_ring_t *ring) {
+    uint64_t dropped = __atomic_load_n(&ring->dropped, __ATOMIC_RELAXED);
+    if (dropped == ring->reported) {
+        return;
+    }
+
+    if (log_binary) {
+        struct timespec now;
+        clock_gettime(CLOCK_REALTIME, &now);
+        log_record_t record = {
+            .time_ns = (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec,
+            .event = LOG_DROPPED,
+            .number = dropped - ring->reported,
+        };
+        append_record(&record, NULL, NULL);
+    } else {
+        fprintf(stderr, "Log ring full, dropped %lu records\n",
+                (unsigned long)(dropped - ring->reported));
+    }
+    ring->reported = dropped;
+}
+
+/*
+ * Move every record in the rings to stdout, oldest first across threads.
+ * Returns how many records were written.
+ */
+static int drain(void) {
+    int count = 0;
+
+    pthread_mutex_lock(&drain_lock);
+    pthread_mutex_lock(&registry_lock);
+    log_ring_t *first_ring = rings;
+    pthread_mutex_unlock(&registry_lock);
+
+    for (;;) {
+        log_ring_t *oldest = NULL;
+        log_record_t oldest_record;
+        for (log_ring_t *ring = first_ring; ring; ring = ring->next) {
+            uint64_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+            if (head == ring->tail) {
+                continue;
+            }
+            log_record_t record;
+            ring_read(ring, ring->tail, &record, sizeof(record));
+            if (!oldest || record.time_ns < oldest_record.time_ns) {
+                oldest = ring;
+                oldest_record = record;
+            }
+        }
+        if (!oldest) {
+            break;
+        }
+
+        size_t strings_len = oldest_record.len[0] + oldest_record.len[1];
+        ring_read(oldest, oldest->tail + sizeof(log_record_t), record_data, strings_len);
+        __atomic_store_n(&oldest->tail, oldest->tail + sizeof(log_record_t) + strings_len,
+                         __ATOMIC_RELEASE);
+        append_record(&oldest_record, record_data, record_data + oldest_record.len[0]);
+        count++;
+    }
+
+    for (log_ring_t *ring = first_ring; ring; ring = ring->next) {
+        report_drops(ring);
+    }
+    if (out_len > 0) {
+        write_out();
+    }
+    pthread_mutex_unlock(&drain_lock);
+    return count;
+}
+
+static void *writer_main(void *arg) {
+    (void)arg;
+    struct timespec idle = {0, LOG_IDLE_SLEEP_NS};
+
+    for (;;) {
+        if (drain() == 0) {
+            nanosleep(&idle, NULL);
+        }
+    }
+    return NULL;
+}
+
+/*
+ * Start the writer thread. With binary set the log is written as
+ * log_record_t records instead of text lines. Records still in the rings
+ * are written when the process exits.
+ */
+void log_init(int binary) {
+    log_binary = binary;
+    if (log_binary) {
+        uint32_t header[2] = {LOG_BINARY_MAGIC, LOG_BINARY_VERSION};
+        memcpy(out, header, sizeof(header));
+        out_len = sizeof(header);
+    }
+
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, writer_main, NULL) != 0) {
+        fprintf(stderr, "Failed to start log writer thread\n");
+        exit(EXIT_FAILURE);
+    }
+    pthread_detach(thread);
+    atexit(log_flush);
+    __atomic_store_n(&log_started, 1, __ATOMIC_RELEASE);
+}
+
+/*
+ * Write out everything logged so far
+ */
+void log_flush(void) {
+    if (__atomic_load_n(&log_started, __ATOMIC_ACQUIRE)) {
+        drain();
+    }
+}
+
+static log_ring_t *get_thread_ring(void) {
+    if (thread_ring) {
+        return thread_ring;
+    }
+
+    log_ring_t *ring = calloc(1, sizeof(log_ring_t));
+    if (!ring || !(ring->data = malloc(LOG_RING_SIZE))) {
+        free(ring);
+        return NULL;
+    }
+    pthread_mutex_lock(&registry_lock);
+    ring->next = rings;
+    rings = ring;
+    pthread_mutex_unlock(&registry_lock);
+
+    thread_ring = ring;
+    return ring;
+}
+
+/*
+ * Queue one record on the calling thread's ring. Before log_init(), as in
+ * tools that link the cache, the line is printed at once instead.
+ */
+static void log_record(log_event_t event, const char *first, size_t first_len,
+                       const char *second, size_t second_len, long number) {
+    if (first_len > UINT16_MAX) {
+        first_len = UINT16_MAX;
+    }
+    if (second_len > UINT16_MAX) {
+        second_len = UINT16_MAX;
+    }
+
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    log_record_t record = {
+        .time_ns = (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec,
+        .event = event,
+        .len = {first_len, second_len},
+        .number = number,
+    };
+
+    if (!__atomic_load_n(&log_started, __ATOMIC_ACQUIRE)) {
+        pthread_mutex_lock(&drain_lock);
+        append_record(&record, first, second);
+        write_out();
+        pthread_mutex_unlock(&drain_lock);
+        return;
+    }
+
+    log_ring_t *ring = get_thread_ring();
+    if (!ring) {
+        return;
+    }
+    size_t len = sizeof(record) + first_len + second_len;
+    uint64_t tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+    if (LOG_RING_SIZE - (ring->head - tail) < len) {
+        __atomic_fetch_add(&ring->dropped, 1, __ATOMIC_RELAXED);
+        return;
+    }
+
+    ring_write(ring, ring->head, &record, sizeof(record));
+    ring_write(ring, ring->head + sizeof(record), first, first_len);
+    ring_write(ring, ring->head + sizeof(record) + first_len, second, second_len);
+    __atomic_store_n(&ring->head, ring->head + len, __ATOMIC_RELEASE);
+}
+
+// An event about a request, host and uri are NUL-terminated or NULL
+void log_event(log_event_t event, const char *host, const char *uri) {
+    log_record(event, host, host ? strlen(host) : 0, uri, uri ? strlen(uri) : 0, 0);
+}
+
+void log_event_text(log_event_t event, const char *text, int len) {
+    log_record(event, text, len > 0 ? len : 0, NULL, 0, 0);
+}
+
+void log_event_number(log_event_t event, long number) {
+    log_record(event, NULL, 0, NULL, 0, number);
+}
@@ -0,0 +1,61 @@
+#ifndef LOG_H
+#define LOG_H
+
+#include "htproxy.h"
+
+#include <time.h>
+
+#define LOG_RING_SIZE (256 * 1024)      // bytes per logging thread, a power of two
+#define LOG_WRITE_BUFFER (64 * 1024)    // records are formatted here and written together
+#define LOG_IDLE_SLEEP_NS 1000000       // writer's nap when every ring is empty
+#define LOG_BINARY_MAGIC 0x6874706c     // "htpl"
+#define LOG_BINARY_VERSION 1
+
+// Events the proxy logs, each with a fixed text form
+typedef enum {
+    LOG_ACCEPTED,               // "Accepted"
+    LOG_REQUEST_TAIL,           // "Request tail <line>"
+    LOG_GETTING,                // "GETting <host> <uri>"
+    LOG_RESPONSE_LENGTH,        // "Response body length <n>"
+    LOG_SERVING,                // "Serving <host> <uri> from cache"
+    LOG_EVICTING,               // "Evicting <host> <uri> from cache"
+    LOG_NOT_CACHING,            // "Not caching <host> <uri>"
+    LOG_STALE,                  // "Stale entry for <host> <uri>"
+    LOG_UNMODIFIED,             // "Entry for <host> <uri> unmodified"
+    LOG_JOINING,                // "Joining fetch of <host> <uri>"
+    LOG_REFRESHING,             // "Refreshing <host> <uri>"
+    LOG_DROPPED,                // binary only: <n> records lost to a full ring
+    LOG_NUM_EVENTS,
+} log_event_t;
+
+// One record, in a ring and in the binary log. It is followed by len[0]
+// bytes of the first string (the host, or the request line) and len[1] of
+// the second (the uri). The binary log starts with the magic and version
+// as two uint32_t, then holds these records in native byte order.
+typedef struct {
+    uint64_t time_ns;           // CLOCK_REALTIME when logged
+    uint16_t event;
+    uint16_t len[2];
+    uint16_t reserved;
+    int64_t number;             // body length, or records dropped
+} log_record_t;
+
+// Records logged by one thread, read by the writer thread. Only the owner
+// moves head and only the writer moves tail, so neither takes a lock.
+typedef struct log_ring {
+    char *data;
+    uint64_t head __attribute__((aligned(64)));    // bytes ever written
+    uint64_t dropped;           // records that did not fit
+    uint64_t tail __attribute__((aligned(64)));    // bytes ever read
+    uint64_t reported;          // drops already written out
+    struct log_ring *next;      // next registered ring
+} log_ring_t;
+
+// Function declarations
+void log_init(int binary);
+void log_flush(void);
+void log_event(log_event_t event, const char *host, const char *uri);
+void log_event_text(log_event_t event, const char *text, int len);
+void log_event_number(log_event_t event, long number);
+
+#endif
@@ -0,0 +1,165 @@
+/**
+ * Per-origin pool of idle keep-alive connections. Each event loop owns its
+ * pool, so no locking is needed.
+ */
+
+#include "pool.h"
+#include "cache.h"
+
+static unsigned int host_hash(const char *host) {
+    unsigned int hash = 5381;
+    while (*host) {
+        hash = hash * 33 + (unsigned char)*host++;
+    }
+    return hash % POOL_BUCKETS;
+}
+
+static origin_t *find_origin(conn_pool_t *pool, const char *host, int create) {
+    unsigned int bucket = host_hash(host);
+    
+    for (origin_t *origin = pool->buckets[bucket]; origin; origin = origin->next) {
+        if (strcmp(origin->host, host) == 0) {
+            return origin;
+        }
+    }
+    if (!create) {
+        return NULL;
+    }
+    
+    origin_t *origin = calloc(1, sizeof(origin_t));
+    if (!origin) {
+        return NULL;
+    }
+    origin->host = strdup(host);
+    if (!origin->host) {
+        free(origin);
+        return NULL;
+    }
+    origin->next = pool->buckets[bucket];
+    pool->buckets[bucket] = origin;
+    return origin;
+}
+
+static void close_pooled(conn_pool_t *pool, origin_t *origin, pooled_conn_t *pooled) {
+    close(pooled->fd);
+    free(pooled);
+    origin->idle_count--;
+    pool->total_idle--;
+}
+
+/*
+ * A pooled connection is healthy if the origin has neither closed it nor
+ * sent anything unprompted while it sat idle
+ */
+static int is_healthy(int fd) {
+    char byte;
+    int peeked = recv(fd, &byte, 1, MSG_PEEK | MSG_DONTWAIT);
+    return peeked < 0 && (errno == EAGAIN || errno == EWOULDBLOCK);
+}
+
+void pool_init(conn_pool_t *pool) {
+    memset(pool, 0, sizeof(conn_pool_t));
+    pool->last_sweep = get_monotonic_time_ms();
+}
+
+void pool_cleanup(conn_pool_t *pool) {
+    for (int i = 0; i < POOL_BUCKETS; i++) {
+        origin_t *origin = pool->buckets[i];
+        while (origin) {
+            origin_t *next = origin->next;
+            while (origin->idle) {
+                pooled_conn_t *pooled = origin->idle;
+                origin->idle = pooled->next;
+                close_pooled(pool, origin, pooled);
+            }
+            free(origin->host);
+            free(origin);
+            origin = next;
+        }
+        pool->buckets[i] = NULL;
+    }
+}
+
+/*
+ * Check out a healthy idle connection to host, or -1 if there is none.
+ * Dead or expired connections met on the way are closed.
+ */
+int pool_get(conn_pool_t *pool, const char *host) {
+    origin_t *origin = find_origin(pool, host, 0);
+    if (!origin) {
+        return -1;
+    }
+    
+    uint64_t now = get_monotonic_time_ms();
+    while (origin->idle) {
+        pooled_conn_t *pooled = origin->idle;
+        origin->idle = pooled->next;
+        
+        if (now - pooled->idle_since <= POOL_IDLE_TIMEOUT_MS && is_healthy(pooled->fd)) {
+            int fd = pooled->fd;
+            free(pooled);
+            origin->idle_count--;
+            pool->total_idle--;
+            return fd;
+        }
+        close_pooled(pool, origin, pooled);
+    }
+    return -1;
+}
+
+/*
+ * Return a connection whose response has been fully read. When the origin
+ * already has the maximum idle connections the oldest one is closed.
+ */
+void pool_put(conn_pool_t *pool, const char *host, int fd) {
+    origin_t *origin = find_origin(pool, host, 1);
+    pooled_conn_t *pooled = malloc(sizeof(pooled_conn_t));
+    if (!origin || !pooled) {
+        free(pooled);
+        close(fd);
+        return;
+    }
+    
+    pooled->fd = fd;
+    pooled->idle_since = get_monotonic_time_ms();
+    pooled->next = origin->idle;
+    origin->idle = pooled;
+    origin->idle_count++;
+    pool->total_idle++;
+    
+    if (origin->idle_count > POOL_MAX_IDLE_PER_ORIGIN) {
+        pooled_conn_t *prev = origin->idle;
+        while (prev->next->next) {
+            prev = prev->next;
+        }
+        close_pooled(pool, origin, prev->next);
+        prev->next = NULL;
+    }
+}
+
+/*
+ * Close connections that have been idle for too long. Cheap to call on every
+ * loop iteration, the pool is only walked once per sweep interval.
+ */
+void pool_expire(conn_pool_t *pool) {
+    uint64_t now = get_monotonic_time_ms();
+    if (pool->total_idle == 0 || now - pool->last_sweep < POOL_SWEEP_INTERVAL_MS) {
+        return;
+    }
+    pool->last_sweep = now;
+    
+    for (int i = 0; i < POOL_BUCKETS; i++) {
+        for (origin_t *origin = pool->buckets[i]; origin; origin = origin->next) {
+            pooled_conn_t **link = &origin->idle;
+            while (*link) {
+                pooled_conn_t *pooled = *link;
+                if (now - pooled->idle_since > POOL_IDLE_TIMEOUT_MS) {
+                    *link = pooled->next;
+                    close_pooled(pool, origin, pooled);
+                } else {
+                    link = &pooled->next;
+                }
+            }
+        }
+    }
+}
@@ -0,0 +1,38 @@
+#ifndef POOL_H
+#define POOL_H
+
+#include "htproxy.h"
+
+#define POOL_BUCKETS 256                // origins hashed by host
+#define POOL_MAX_IDLE_PER_ORIGIN 8      // idle connections kept per origin
+#define POOL_IDLE_TIMEOUT_MS 30000      // idle connections older than this are closed
+#define POOL_SWEEP_INTERVAL_MS 1000     // how often expired connections are reaped
+
+typedef struct pooled_conn {
+    int fd;
+    uint64_t idle_since;
+    struct pooled_conn *next;   // older idle connection to the same origin
+} pooled_conn_t;
+
+typedef struct origin {
+    char *host;
+    int idle_count;
+    pooled_conn_t *idle;        // most recently used first
+    struct origin *next;        // next origin in the same bucket
+} origin_t;
+
+// Idle keep-alive connections to origin servers, owned by one event loop
+typedef struct {
+    origin_t *buckets[POOL_BUCKETS];
+    int total_idle;
+    uint64_t last_sweep;
+} conn_pool_t;
+
+// Function declarations
+void pool_init(conn_pool_t *pool);
+void pool_cleanup(conn_pool_t *pool);
+int pool_get(conn_pool_t *pool, const char *host);
+void pool_put(conn_pool_t *pool, const char *host, int fd);
+void pool_expire(conn_pool_t *pool);
+
+#endif
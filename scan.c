@@ -0,0 +1,303 @@
+/**
+ * Byte scanning kernels for HTTP headers: line ends, the blank line ending
+ * a header block, delimiters and case-insensitive name matches. Each has a
+ * scalar version. All but the line-end kernel also have, on x86, SSE2 and
+ * AVX2 versions compiled with target attributes so the build needs no
+ * special flags; line ends use the scalar memchr() version everywhere.
+ * scan_init() chooses one set at startup from what the CPU reports.
+ */
+
+#include "scan.h"
+
+#include <string.h>
+#include <stdint.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#define SCAN_X86
+#include <immintrin.h>
+#endif
+
+typedef struct {
+    const char *name;
+    const char *(*crlf)(const char *data, size_t len);
+    const char *(*header_end)(const char *data, size_t len);
+    const char *(*char2)(const char *data, size_t len, char c1, char c2);
+    int (*casecmp_eq)(const char *a, const char *b, size_t len);
+} scan_impl_t;
+
+static inline char ascii_lower(char c) {
+    return (c >= 'A' && c <= 'Z') ? c + 32 : c;
+}
+
+// Scalar versions, also used for the tails of the vector ones
+
+static const char *crlf_scalar(const char *data, size_t len) {
+    const char *end = data + len;
+    const char *pos = data;
+    while (pos + 1 < end && (pos = memchr(pos, '\r', end - pos - 1))) {
+        if (pos[1] == '\n') {
+            return pos;
+        }
+        pos++;
+    }
+    return NULL;
+}
+
+static const char *header_end_scalar(const char *data, size_t len) {
+    const char *end = data + len;
+    const char *pos = data;
+    while (pos + 3 < end && (pos = memchr(pos, '\r', end - pos - 3))) {
+        if (pos[1] == '\n' && pos[2] == '\r' && pos[3] == '\n') {
+            return pos;
+        }
+        pos++;
+    }
+    return NULL;
+}
+
+static const char *char2_scalar(const char *data, size_t len, char c1, char c2) {
+    for (size_t i = 0; i < len; i++) {
+        if (data[i] == c1 || data[i] == c2) {
+            return data + i;
+        }
+    }
+    return NULL;
+}
+
+static int casecmp_eq_scalar(const char *a, const char *b, size_t len) {
+    for (size_t i = 0; i < len; i++) {
+        if (ascii_lower(a[i]) != ascii_lower(b[i])) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+static const scan_impl_t scan_scalar = {
+    "scalar", crlf_scalar, header_end_scalar, char2_scalar, casecmp_eq_scalar,
+};
+
+#ifdef SCAN_X86
+
+// SSE2, 16-byte blocks. A match of a multi-byte pattern is the AND of the
+// masks of each byte compared at its offset. Line ends are left to the
+// scalar memchr(): lines are short and libc's memchr is already vectorized,
+// so a kernel here only added setup and a scalar tail to every call.
+
+// The "\r\n\r\n" around a "\n\r" at data[at], or NULL. Vector kernels
+// look for that pair: it rarely occurs outside the blank line, so two
+// compares replace four and the loop does not stop at every line end.
+static inline const char *header_end_around(const char *data, size_t len, size_t at) {
+    if (at >= 1 && at + 2 < len && data[at - 1] == '\r' && data[at + 2] == '\n') {
+        return data + at - 1;
+    }
+    return NULL;
+}
+
+// Finish a vector scan that covered "\n\r" pairs starting before done
+static const char *header_end_tail(const char *data, size_t len, size_t done) {
+    size_t from = done ? done - 1 : 0;
+    return header_end_scalar(data + from, len - from);
+}
+
+static const char *header_end_sse2(const char *data, size_t len) {
+    const __m128i cr = _mm_set1_epi8('\r');
+    const __m128i lf = _mm_set1_epi8('\n');
+    size_t i = 0;
+
+    for (; i + 33 <= len; i += 32) {
+        __m128i low = _mm_and_si128(
+            _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(data + i)), lf),
+            _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(data + i + 1)), cr));
+        __m128i high = _mm_and_si128(
+            _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(data + i + 16)), lf),
+            _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(data + i + 17)), cr));
+        unsigned mask = _mm_movemask_epi8(_mm_or_si128(low, high));
+        if (!mask) {
+            continue;
+        }
+        mask = _mm_movemask_epi8(low) | _mm_movemask_epi8(high) << 16;
+        for (; mask; mask &= mask - 1) {
+            const char *found = header_end_around(data, len, i + __builtin_ctz(mask));
+            if (found) {
+                return found;
+            }
+        }
+    }
+    return header_end_tail(data, len, i);
+}
+
+static const char *char2_sse2(const char *data, size_t len, char c1, char c2) {
+    const __m128i first = _mm_set1_epi8(c1);
+    const __m128i second = _mm_set1_epi8(c2);
+    size_t i = 0;
+
+    for (; i + 16 <= len; i += 16) {
+        __m128i block = _mm_loadu_si128((const __m128i *)(data + i));
+        unsigned mask = _mm_movemask_epi8(_mm_or_si128(_mm_cmpeq_epi8(block, first),
+                                                       _mm_cmpeq_epi8(block, second)));
+        if (mask) {
+            return data + i + __builtin_ctz(mask);
+        }
+    }
+    return char2_scalar(data + i, len - i, c1, c2);
+}
+
+// Set bit 5 of every byte in 'A'..'Z'; bytes above 0x7f compare as negative
+static inline __m128i lower_sse2(__m128i block) {
+    __m128i upper = _mm_and_si128(_mm_cmpgt_epi8(block, _mm_set1_epi8('A' - 1)),
+                                  _mm_cmplt_epi8(block, _mm_set1_epi8('Z' + 1)));
+    return _mm_or_si128(block, _mm_and_si128(upper, _mm_set1_epi8(0x20)));
+}
+
+static int casecmp_eq_sse2(const char *a, const char *b, size_t len) {
+    size_t i = 0;
+
+    for (; i + 16 <= len; i += 16) {
+        __m128i block_a = lower_sse2(_mm_loadu_si128((const __m128i *)(a + i)));
+        __m128i block_b = lower_sse2(_mm_loadu_si128((const __m128i *)(b + i)));
+        if (_mm_movemask_epi8(_mm_cmpeq_epi8(block_a, block_b)) != 0xffff) {
+            return 0;
+        }
+    }
+    return casecmp_eq_scalar(a + i, b + i, len - i);
+}
+
+static const scan_impl_t scan_sse2 = {
+    "sse2", crlf_scalar, header_end_sse2, char2_sse2, casecmp_eq_sse2,
+};
+
+// AVX2, the same kernels on 32-byte blocks. Tails go to the scalar code:
+// the SSE2 functions are not VEX-encoded and mixing them in here is slower.
+
+__attribute__((target("avx2")))
+static const char *header_end_avx2(const char *data, size_t len) {
+    const __m256i cr = _mm256_set1_epi8('\r');
+    const __m256i lf = _mm256_set1_epi8('\n');
+    size_t i = 0;
+
+    for (; i + 65 <= len; i += 64) {
+        __m256i low = _mm256_and_si256(
+            _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *)(data + i)), lf),
+            _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *)(data + i + 1)), cr));
+        __m256i high = _mm256_and_si256(
+            _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *)(data + i + 32)), lf),
+            _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *)(data + i + 33)), cr));
+        if (_mm256_testz_si256(_mm256_or_si256(low, high), _mm256_or_si256(low, high))) {
+            continue;
+        }
+        uint64_t mask = (uint32_t)_mm256_movemask_epi8(low) |
+                        (uint64_t)(uint32_t)_mm256_movemask_epi8(high) << 32;
+        for (; mask; mask &= mask - 1) {
+            const char *found = header_end_around(data, len, i + __builtin_ctzll(mask));
+            if (found) {
+                return found;
+            }
+        }
+    }
+    return header_end_tail(data, len, i);
+}
+
+__attribute__((target("avx2")))
+static const char *char2_avx2(const char *data, size_t len, char c1, char c2) {
+    const __m256i first = _mm256_set1_epi8(c1);
+    const __m256i second = _mm256_set1_epi8(c2);
+    size_t i = 0;
+
+    for (; i + 32 <= len; i += 32) {
+        __m256i block = _mm256_loadu_si256((const __m256i *)(data + i));
+        unsigned mask = (unsigned)_mm256_movemask_epi8(
+            _mm256_or_si256(_mm256_cmpeq_epi8(block, first), _mm256_cmpeq_epi8(block, second)));
+        if (mask) {
+            return data + i + __builtin_ctz(mask);
+        }
+    }
+    return char2_scalar(data + i, len - i, c1, c2);
+}
+
+__attribute__((target("avx2")))
+static inline __m256i lower_avx2(__m256i block) {
+    __m256i upper = _mm256_and_si256(_mm256_cmpgt_epi8(block, _mm256_set1_epi8('A' - 1)),
+                                     _mm256_cmpgt_epi8(_mm256_set1_epi8('Z' + 1), block));
+    return _mm256_or_si256(block, _mm256_and_si256(upper, _mm256_set1_epi8(0x20)));
+}
+
+__attribute__((target("avx2")))
+static int casecmp_eq_avx2(const char *a, const char *b, size_t len) {
+    size_t i = 0;
+
+    for (; i + 32 <= len; i += 32) {
+        __m256i block_a = lower_avx2(_mm256_loadu_si256((const __m256i *)(a + i)));
+        __m256i block_b = lower_avx2(_mm256_loadu_si256((const __m256i *)(b + i)));
+        if ((unsigned)_mm256_movemask_epi8(_mm256_cmpeq_epi8(block_a, block_b)) != 0xffffffffu) {
+            return 0;
+        }
+    }
+    return casecmp_eq_scalar(a + i, b + i, len - i);
+}
+
+static const scan_impl_t scan_avx2 = {
+    "avx2", crlf_scalar, header_end_avx2, char2_avx2, casecmp_eq_avx2,
+};
+
+#endif
+
+static const scan_impl_t *scan_impl = &scan_scalar;
+
+void scan_init(void) {
+#ifdef SCAN_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        scan_impl = &scan_avx2;
+    } else if (__builtin_cpu_supports("sse2")) {
+        scan_impl = &scan_sse2;
+    }
+#endif
+}
+
+/*
+ * Force one implementation by name, for benchmarks. Returns -1 if it is
+ * unknown or the CPU lacks it.
+ */
+int scan_select(const char *name) {
+    if (strcmp(name, "scalar") == 0) {
+        scan_impl = &scan_scalar;
+        return 0;
+    }
+#ifdef SCAN_X86
+    __builtin_cpu_init();
+    if (strcmp(name, "sse2") == 0 && __builtin_cpu_supports("sse2")) {
+        scan_impl = &scan_sse2;
+        return 0;
+    }
+    if (strcmp(name, "avx2") == 0 && __builtin_cpu_supports("avx2")) {
+        scan_impl = &scan_avx2;
+        return 0;
+    }
+#endif
+    return -1;
+}
+
+const char *scan_impl_name(void) {
+    return scan_impl->name;
+}
+
+// First "\r\n" in data, or NULL
+const char *scan_crlf(const char *data, size_t len) {
+    return scan_impl->crlf(data, len);
+}
+
+// First "\r\n\r\n" in data, or NULL
+const char *scan_header_end(const char *data, size_t len) {
+    return scan_impl->header_end(data, len);
+}
+
+// First byte of data equal to c1 or c2, or NULL
+const char *scan_char2(const char *data, size_t len, char c1, char c2) {
+    return scan_impl->char2(data, len, c1, c2);
+}
+
+// Whether len bytes of a and b are equal ignoring ASCII case
+int scan_casecmp_eq(const char *a, const char *b, size_t len) {
+    return scan_impl->casecmp_eq(a, b, len);
+}
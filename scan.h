@@ -0,0 +1,18 @@
+#ifndef SCAN_H
+#define SCAN_H
+
+#include <stddef.h>
+
+// Byte scanning kernels for HTTP headers. scan_init() picks the widest
+// implementation the CPU supports; until then the scalar one is used.
+
+// Function declarations
+void scan_init(void);
+int scan_select(const char *name);
+const char *scan_impl_name(void);
+const char *scan_crlf(const char *data, size_t len);
+const char *scan_header_end(const char *data, size_t len);
+const char *scan_char2(const char *data, size_t len, char c1, char c2);
+int scan_casecmp_eq(const char *a, const char *b, size_t len);
+
+#endif
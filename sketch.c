@@ -0,0 +1,91 @@
+/**
+ * Frequency sketch for TinyLFU admission. Each key hash picks one 4-bit
+ * counter in each of SKETCH_DEPTH rows and its estimate is the smallest of
+ * them. Sized at one word per tracked key, as in Caffeine, the rows share
+ * the table and collisions only ever overestimate.
+ */
+
+#include "sketch.h"
+
+static const uint64_t row_seeds[SKETCH_DEPTH] = {
+    0xc3a5c85c97cb3127ULL, 0xb492b66fbe98f273ULL,
+    0x9ae16a3b2f90404fULL, 0xcbf29ce484222325ULL,
+};
+
+/*
+ * Allocate a sketch for about capacity distinct keys
+ */
+int sketch_init(sketch_t *sketch, size_t capacity) {
+    size_t words = 16;
+    while (words < capacity) {
+        words *= 2;
+    }
+
+    memset(sketch, 0, sizeof(sketch_t));
+    sketch->table = calloc(words, sizeof(uint64_t));
+    if (!sketch->table) {
+        perror("calloc");
+        return -1;
+    }
+    sketch->mask = words - 1;
+    size_t sample_size = capacity * SKETCH_SAMPLE_FACTOR;
+    sketch->sample_size = sample_size < UINT32_MAX ? sample_size : UINT32_MAX;
+    return 0;
+}
+
+void sketch_destroy(sketch_t *sketch) {
+    free(sketch->table);
+    sketch->table = NULL;
+}
+
+// Word and nibble of a key's counter in one row
+static uint64_t *counter_of(const sketch_t *sketch, uint64_t hash, int row, int *shift) {
+    uint64_t h = (hash ^ row_seeds[row]) * 0x9e3779b97f4a7c15ULL;
+    h ^= h >> 29;
+    *shift = (h & 15) * 4;
+    return &sketch->table[(h >> 4) & sketch->mask];
+}
+
+// Halve every counter, dropping the remainder of each
+static void sketch_age(sketch_t *sketch) {
+    for (size_t i = 0; i <= sketch->mask; i++) {
+        sketch->table[i] = (sketch->table[i] >> 1) & 0x7777777777777777ULL;
+    }
+    sketch->additions /= 2;
+}
+
+/*
+ * Count one more sighting of a key
+ */
+void sketch_increment(sketch_t *sketch, uint64_t hash) {
+    int added = 0;
+    for (int row = 0; row < SKETCH_DEPTH; row++) {
+        int shift;
+        uint64_t *word = counter_of(sketch, hash, row, &shift);
+        if (((*word >> shift) & 15) < SKETCH_COUNTER_MAX) {
+            *word += 1ULL << shift;
+            added = 1;
+        }
+    }
+
+    if (added && ++sketch->additions >= sketch->sample_size) {
+        sketch_age(sketch);
+    }
+}
+
+/*
+ * Estimated sightings of a key since counters were last halved, at most
+ * SKETCH_COUNTER_MAX
+ */
+int sketch_frequency(const sketch_t *sketch, uint64_t hash) {
+    int frequency = SKETCH_COUNTER_MAX;
+    for (int row = 0; row < SKETCH_DEPTH; row++) {
+        int shift;
+        uint64_t *word = counter_of(sketch, hash, row, &shift);
+        int count = (*word >> shift) & 15;
+        if (count < frequency) {
+            frequency = count;
+        }
+    }
+    return frequency;
+}
@@ -0,0 +1,29 @@
+#ifndef SKETCH_H
+#define SKETCH_H
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdint.h>
+
+#define SKETCH_DEPTH 4                  // counters updated per key, one per row
+#define SKETCH_COUNTER_MAX 15           // counters are 4 bits
+#define SKETCH_SAMPLE_FACTOR 10         // additions per tracked key before counters halve
+
+// Count-min sketch of how often keys were seen, 16 four-bit counters to a
+// word. Halving every counter once sample_size keys have been added lets
+// old popularity fade.
+typedef struct {
+    uint64_t *table;
+    size_t mask;                // words - 1, words is a power of two
+    uint32_t additions;         // since the last halving
+    uint32_t sample_size;
+} sketch_t;
+
+// Function declarations
+int sketch_init(sketch_t *sketch, size_t capacity);
+void sketch_destroy(sketch_t *sketch);
+void sketch_increment(sketch_t *sketch, uint64_t hash);
+int sketch_frequency(const sketch_t *sketch, uint64_t hash);
+
+#endif
@@ -0,0 +1,244 @@
+/**
+ * Size-class slab allocator for cache entries. Memory is reserved once and
+ * handed out in fixed-size pages, each page serving a single size class.
+ * A page whose items are all free goes back to the shared pool so any class
+ * can reuse it, which keeps fragmentation bounded. Unless huge pages are
+ * asked for, the arena is a shared mapping of a memfd, so items can be sent
+ * to sockets with sendfile().
+ */
+
+#include "slab.h"
+
+static size_t round_up(size_t value, size_t multiple) {
+    return (value + multiple - 1) / multiple * multiple;
+}
+
+/*
+ * Reserve the arena, backed by huge pages if asked and available, otherwise
+ * by a memfd if one can be made
+ */
+static char *reserve_arena(size_t size, int *huge_pages, int *fd) {
+    char *arena = MAP_FAILED;
+    *fd = -1;
+
+    if (*huge_pages) {
+        // Without MAP_NORESERVE the huge pages are reserved now, so a short
+        // pool fails here instead of faulting later
+        arena = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                     MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+        if (arena == MAP_FAILED) {
+            // No reserved huge pages, fall back to transparent huge pages
+            *huge_pages = 0;
+        }
+    }
+
+    if (arena == MAP_FAILED && !*huge_pages) {
+        // The file stays sparse, pages are allocated as they are written
+        *fd = memfd_create("htproxy-cache", MFD_CLOEXEC);
+        if (*fd >= 0) {
+            if (ftruncate(*fd, size) == 0) {
+                arena = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_NORESERVE,
+                             *fd, 0);
+            }
+            if (arena == MAP_FAILED) {
+                close(*fd);
+                *fd = -1;
+            } else {
+                return arena;
+            }
+        }
+    }
+
+    if (arena == MAP_FAILED) {
+        arena = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                     MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+        if (arena == MAP_FAILED) {
+            return NULL;
+        }
+#ifdef MADV_HUGEPAGE
+        madvise(arena, size, MADV_HUGEPAGE);
+#endif
+    }
+
+    return arena;
+}
+
+int slab_init(slab_t *slab, size_t mem_limit, size_t page_size, int huge_pages) {
+    memset(slab, 0, sizeof(slab_t));
+
+    if (huge_pages) {
+        page_size = round_up(page_size, SLAB_HUGE_PAGE_SIZE);
+    }
+    slab->page_size = page_size;
+    slab->num_pages = mem_limit / page_size;
+    if (slab->num_pages < 1) {
+        slab->num_pages = 1;
+    }
+    slab->arena_size = (size_t)slab->num_pages * page_size;
+    slab->free_pages = -1;
+
+    slab->huge_pages = huge_pages;
+    slab->file_page = sysconf(_SC_PAGESIZE);
+    slab->arena = reserve_arena(slab->arena_size, &slab->huge_pages, &slab->fd);
+    if (!slab->arena) {
+        perror("mmap");
+        return -1;
+    }
+
+    slab->pages = calloc(slab->num_pages, sizeof(slab_page_t));
+    if (!slab->pages) {
+        perror("calloc");
+        munmap(slab->arena, slab->arena_size);
+        if (slab->fd >= 0) {
+            close(slab->fd);
+        }
+        return -1;
+    }
+
+    // Size classes grow geometrically, the last one takes a whole page
+    size_t item_size = SLAB_MIN_ITEM_SIZE;
+    while (slab->num_classes < SLAB_MAX_CLASSES - 1 && item_size < page_size / 2) {
+        slab->classes[slab->num_classes].item_size = item_size;
+        slab->classes[slab->num_classes].items_per_page = page_size / item_size;
+        slab->num_classes++;
+        item_size = round_up(item_size * SLAB_GROWTH_FACTOR, 8);
+    }
+    slab->classes[slab->num_classes].item_size = page_size;
+    slab->classes[slab->num_classes].items_per_page = 1;
+    slab->num_classes++;
+
+    return 0;
+}
+
+void slab_destroy(slab_t *slab) {
+    if (slab->arena) {
+        munmap(slab->arena, slab->arena_size);
+        if (slab->fd >= 0) {
+            close(slab->fd);
+        }
+    }
+    free(slab->pages);
+    memset(slab, 0, sizeof(slab_t));
+}
+
+static int class_for_size(slab_t *slab, size_t size) {
+    for (int i = 0; i < slab->num_classes; i++) {
+        if (slab->classes[i].item_size >= size) {
+            return i;
+        }
+    }
+    return -1; // Larger than a page
+}
+
+/*
+ * Bytes actually consumed by an allocation of the given size, 0 if it can
+ * never be satisfied
+ */
+size_t slab_class_size(slab_t *slab, size_t size) {
+    int class_id = class_for_size(slab, size);
+    return class_id < 0 ? 0 : slab->classes[class_id].item_size;
+}
+
+static void free_list_push(slab_class_t *class, slab_free_item_t *item) {
+    item->prev = NULL;
+    item->next = class->free_items;
+    if (class->free_items) {
+        class->free_items->prev = item;
+    }
+    class->free_items = item;
+}
+
+static void free_list_remove(slab_class_t *class, slab_free_item_t *item) {
+    if (item->prev) {
+        item->prev->next = item->next;
+    } else {
+        class->free_items = item->next;
+    }
+    if (item->next) {
+        item->next->prev = item->prev;
+    }
+}
+
+// Page an item was carved from
+int slab_page_of(slab_t *slab, const void *item) {
+    return ((const char *)item - slab->arena) / slab->page_size;
+}
+
+/*
+ * Hand a pool page to a class and put all its items on the free list
+ */
+static int assign_page(slab_t *slab, int class_id) {
+    int page;
+    if (slab->free_pages >= 0) {
+        page = slab->free_pages;
+        slab->free_pages = slab->pages[page].next_free;
+    } else if (slab->fresh_pages < slab->num_pages) {
+        page = slab->fresh_pages++;
+    } else {
+        return -1; // Memory budget exhausted
+    }
+
+    slab_class_t *class = &slab->classes[class_id];
+    char *base = slab->arena + (size_t)page * slab->page_size;
+
+    slab->pages[page].class_id = class_id;
+    slab->pages[page].used = 0;
+    for (int i = class->items_per_page - 1; i >= 0; i--) {
+        free_list_push(class, (slab_free_item_t *)(base + (size_t)i * class->item_size));
+    }
+    return page;
+}
+
+void *slab_alloc(slab_t *slab, size_t size) {
+    int class_id = class_for_size(slab, size);
+    if (class_id < 0) {
+        return NULL;
+    }
+
+    slab_class_t *class = &slab->classes[class_id];
+    if (!class->free_items && assign_page(slab, class_id) < 0) {
+        return NULL;
+    }
+
+    slab_free_item_t *item = class->free_items;
+    free_list_remove(class, item);
+    slab->pages[slab_page_of(slab, item)].used++;
+    return item;
+}
+
+void slab_free(slab_t *slab, void *ptr) {
+    int page = slab_page_of(slab, ptr);
+    slab_page_t *meta = &slab->pages[page];
+    slab_class_t *class = &slab->classes[meta->class_id];
+
+    free_list_push(class, ptr);
+    meta->used--;
+
+    if (meta->used == 0) {
+        // Whole page is free, release it to the pool for any class
+        char *base = slab->arena + (size_t)page * slab->page_size;
+        for (int i = 0; i < class->items_per_page; i++) {
+            free_list_remove(class, (slab_free_item_t *)(base + (size_t)i * class->item_size));
+        }
+        meta->class_id = -1;
+        meta->next_free = slab->free_pages;
+        slab->free_pages = page;
+    }
+}
+
+/*
+ * Drop the whole memfd pages inside an item before it is freed. Pages a
+ * socket still holds from sendfile() keep what was sent, and the item is
+ * written to fresh pages when it is reused.
+ */
+void slab_discard(slab_t *slab, void *ptr, size_t len) {
+    if (slab->fd < 0) {
+        return;
+    }
+    size_t start = round_up((char *)ptr - slab->arena, slab->file_page);
+    size_t end = ((char *)ptr - slab->arena + len) / slab->file_page * slab->file_page;
+    if (end > start &&
+        fallocate(slab->fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, start, end - start) < 0) {
+        perror("fallocate");
+    }
+}
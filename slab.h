@@ -0,0 +1,62 @@
+#ifndef SLAB_H
+#define SLAB_H
+
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+
+#define SLAB_PAGE_SIZE (1024 * 1024)            // 1 MiB, pages are carved into items
+#define SLAB_HUGE_PAGE_SIZE (2 * 1024 * 1024)   // x86-64 huge page
+#define SLAB_MIN_ITEM_SIZE 64
+#define SLAB_GROWTH_FACTOR 1.25                 // ratio between neighbouring size classes
+#define SLAB_MAX_CLASSES 64
+
+// Free items are kept on a doubly-linked list stored inside the item itself
+typedef struct slab_free_item {
+    struct slab_free_item *prev;
+    struct slab_free_item *next;
+} slab_free_item_t;
+
+typedef struct {
+    size_t item_size;
+    int items_per_page;
+    slab_free_item_t *free_items;
+} slab_class_t;
+
+typedef struct {
+    int class_id;               // -1 while the page is not assigned to a class
+    int used;                   // items currently handed out
+    int next_free;              // next page on the released list
+} slab_page_t;
+
+typedef struct {
+    char *arena;                // one reservation, page_size aligned
+    size_t arena_size;
+    size_t page_size;
+    int num_pages;
+    int fresh_pages;            // pages never assigned so far
+    int free_pages;             // head of the released page list, -1 if empty
+    slab_page_t *pages;
+    slab_class_t classes[SLAB_MAX_CLASSES];
+    int num_classes;
+    int huge_pages;             // arena is backed by huge pages
+    int fd;                     // memfd behind the arena, -1 if it is anonymous memory
+    size_t file_page;           // page size of the memfd
+} slab_t;
+
+// Function declarations
+int slab_init(slab_t *slab, size_t mem_limit, size_t page_size, int huge_pages);
+void slab_destroy(slab_t *slab);
+size_t slab_class_size(slab_t *slab, size_t size);
+int slab_page_of(slab_t *slab, const void *item);
+void *slab_alloc(slab_t *slab, size_t size);
+void slab_free(slab_t *slab, void *item);
+void slab_discard(slab_t *slab, void *ptr, size_t len);
+
+#endif
@@ -6,8 +6,10 @@
 
 /* 
  * This function is adapted from practical 8 server.c
+ * With reuse_port set, several sockets can bind the same port and the
+ * kernel load-balances new connections between them.
  */
-int create_listening_socket(char *port) {
+int create_listening_socket(char *port, int reuse_port) {
     int sockfd, s;
     struct addrinfo hints, *res;
     
@@ -37,6 +39,13 @@ int create_listening_socket(char *port) {
         exit(EXIT_FAILURE);
     }
     
+    // Each worker binds its own listener on the same port
+    if (reuse_port &&
+        setsockopt(sockfd, SOL_SOCKET, SO_REUSEPORT, &enable, sizeof(int)) < 0) {
+        perror("setsockopt");
+        exit(EXIT_FAILURE);
+    }
+    
     // Bind address to the socket
     if (bind(sockfd, res->ai_addr, res->ai_addrlen) < 0) {
         perror("bind");
@@ -49,71 +58,32 @@ int create_listening_socket(char *port) {
 
 /* 
  * This function is adapted from practical 8 client.c
+ * Addresses come from the resolver, starting at *next_addr, which is moved
+ * past the one used so a failed connect can go on with the rest. The
+ * returned socket is non-blocking and its connect may still be in
+ * progress; the caller waits for it to become writable.
  */
-int connect_to_origin_server(char *host) {
-    int sockfd, s;
-    struct addrinfo hints, *servinfo, *p;
-    
-    // Check if host is enclosed in square brackets
-    char *real_host = host;
-    char *stripped_host = NULL;
-    
-    // strip the brackets for getaddrinfo
-    size_t host_len = strlen(host);
-    if (host_len > 2 && host[0] == '[' && host[host_len - 1] == ']') {
-        stripped_host = malloc(host_len - 1);
-        if (!stripped_host) {
-            perror("malloc");
-            return -1;
-        }
-        
-        strncpy(stripped_host, host + 1, host_len - 2);
-        stripped_host[host_len - 2] = '\0';
-        
-        real_host = stripped_host;
-    }
-    
-    // Create address
-    memset(&hints, 0, sizeof hints);
-    hints.ai_family = AF_UNSPEC;     // Allow IPv4 or IPv6
-    hints.ai_socktype = SOCK_STREAM; // TCP
-    
-    // Get server address info
-    s = getaddrinfo(real_host, "80", &hints, &servinfo);
-    if (s != 0) {
-        fprintf(stderr, "getaddrinfo: %s\n", gai_strerror(s));
-        if (stripped_host) {
-            free(stripped_host);
-        }
-        return -1;
-    }
+int connect_to_origin_server(addr_list_t *addrs, int *next_addr) {
+    int sockfd;
     
     // Connect to the first valid result
-    for (p = servinfo; p != NULL; p = p->ai_next) {
-        sockfd = socket(p->ai_family, p->ai_socktype, p->ai_protocol);
+    while (*next_addr < addrs->count) {
+        struct sockaddr *addr = (struct sockaddr *)&addrs->addrs[*next_addr];
+        socklen_t addr_len = addrs->addr_lens[*next_addr];
+        (*next_addr)++;
+        
+        sockfd = socket(addr->sa_family, SOCK_STREAM | SOCK_NONBLOCK, 0);
         if (sockfd == -1) {
             continue;
         }
         
-        if (connect(sockfd, p->ai_addr, p->ai_addrlen) != -1) {
-            break; // Success
+        if (connect(sockfd, addr, addr_len) != -1 || errno == EINPROGRESS) {
+            return sockfd; // Success, or will complete asynchronously
         }
         
         close(sockfd);
     }
     
-    if (p == NULL) {
-        fprintf(stderr, "Failed to connect to origin server\n");
-        freeaddrinfo(servinfo);
-        if (stripped_host) {
-            free(stripped_host);
-        }
-        return -1;
-    }
-    
-    freeaddrinfo(servinfo);
-    if (stripped_host) {
-        free(stripped_host);
-    }
-    return sockfd;
-}
\ No newline at end of file
+    fprintf(stderr, "Failed to connect to origin server\n");
+    return -1;
+}
@@ -0,0 +1,210 @@
+/**
+ * Counters and latency histograms kept per thread and combined only when a
+ * report is asked for. As in an HDR histogram each power of two is split
+ * into 16 equal buckets, about 6% precision at any magnitude, so recording
+ * a value is a shift and an increment.
+ */
+
+#include "stats.h"
+
+static const char *counter_names[STAT_NUM_COUNTERS] = {
+    [STAT_REQUESTS] = "requests",
+    [STAT_HITS] = "hits",
+    [STAT_DISK_HITS] = "disk_hits",
+    [STAT_MISSES] = "misses",
+    [STAT_STALE] = "stale",
+    [STAT_STALE_SERVED] = "stale_served",
+    [STAT_REVALIDATED] = "revalidated",
+    [STAT_EVICTIONS] = "evictions",
+    [STAT_REJECTED] = "rejected",
+    [STAT_BYTES_FROM_CLIENTS] = "bytes_from_clients",
+    [STAT_BYTES_TO_CLIENTS] = "bytes_to_clients",
+    [STAT_BYTES_FROM_ORIGINS] = "bytes_from_origins",
+    [STAT_BYTES_TO_ORIGINS] = "bytes_to_origins",
+};
+
+static const char *phase_names[PHASE_NUM] = {
+    [PHASE_PARSE] = "parse",
+    [PHASE_LOOKUP] = "cache_lookup",
+    [PHASE_DNS] = "dns",
+    [PHASE_CONNECT] = "connect",
+    [PHASE_FIRST_BYTE] = "first_byte",
+    [PHASE_TOTAL] = "total",
+};
+
+static pthread_mutex_t registry_lock = PTHREAD_MUTEX_INITIALIZER;
+static stats_t *all_stats = NULL;
+static __thread stats_t *thread_stats = NULL;
+
+static stats_t *get_thread_stats(void) {
+    if (thread_stats) {
+        return thread_stats;
+    }
+
+    stats_t *stats = calloc(1, sizeof(stats_t));
+    if (!stats) {
+        return NULL;
+    }
+    pthread_mutex_lock(&registry_lock);
+    stats->next = all_stats;
+    all_stats = stats;
+    pthread_mutex_unlock(&registry_lock);
+
+    thread_stats = stats;
+    return stats;
+}
+
+// Only the owning thread writes, a relaxed store keeps readers from tearing
+static inline void add(uint64_t *value, uint64_t n) {
+    __atomic_store_n(value, *value + n, __ATOMIC_RELAXED);
+}
+
+void stats_count(stat_counter_t counter, uint64_t n) {
+    stats_t *stats = get_thread_stats();
+    if (stats) {
+        add(&stats->counters[counter], n);
+    }
+}
+
+/*
+ * Bucket of a value: exact below STATS_SUB_BUCKETS, then STATS_SUB_BUCKETS
+ * equal steps for each power of two
+ */
+static int bucket_index(uint64_t value) {
+    if (value < STATS_SUB_BUCKETS) {
+        return value;
+    }
+    int exponent = 63 - __builtin_clzll(value);     // at least 4
+    if (exponent >= STATS_MAX_EXPONENT) {
+        return STATS_HISTOGRAM_BUCKETS - 1;
+    }
+    int step = (value >> (exponent - 4)) - STATS_SUB_BUCKETS;
+    return STATS_SUB_BUCKETS * (exponent - 3) + step;
+}
+
+// Largest value that falls in a bucket
+static uint64_t bucket_limit(int index) {
+    if (index < STATS_SUB_BUCKETS) {
+        return index;
+    }
+    int exponent = index / STATS_SUB_BUCKETS + 3;
+    uint64_t step = index % STATS_SUB_BUCKETS + STATS_SUB_BUCKETS;
+    return ((step + 1) << (exponent - 4)) - 1;
+}
+
+/*
+ * Record the time since start_us for a phase. Returns the current time, for
+ * a phase that starts here.
+ */
+uint64_t stats_record(stat_phase_t phase, uint64_t start_us) {
+    uint64_t now = stats_now_us();
+    stats_t *stats = get_thread_stats();
+    if (stats) {
+        add(&stats->histograms[phase][bucket_index(now > start_us ? now - start_us : 0)], 1);
+    }
+    return now;
+}
+
+// Smallest bucket limit at or below which the given fraction of values lie
+static uint64_t percentile(const uint64_t *histogram, uint64_t count, double fraction) {
+    uint64_t wanted = (uint64_t)(count * fraction + 0.5);
+    if (wanted == 0) {
+        wanted = 1;
+    }
+    uint64_t seen = 0;
+    for (int i = 0; i < STATS_HISTOGRAM_BUCKETS; i++) {
+        seen += histogram[i];
+        if (seen >= wanted) {
+            return bucket_limit(i);
+        }
+    }
+    return bucket_limit(STATS_HISTOGRAM_BUCKETS - 1);
+}
+
+static void write_histogram(FILE *out, const char *name, const uint64_t *histogram) {
+    uint64_t count = 0;
+    int last = -1;
+    for (int i = 0; i < STATS_HISTOGRAM_BUCKETS; i++) {
+        count += histogram[i];
+        if (histogram[i]) {
+            last = i;
+        }
+    }
+
+    fprintf(out, "    \"%s\": {\"count\": %lu", name, (unsigned long)count);
+    if (count > 0) {
+        fprintf(out, ", \"p50\": %lu, \"p90\": %lu, \"p99\": %lu, \"p999\": %lu, \"max\": %lu",
+                (unsigned long)percentile(histogram, count, 0.5),
+                (unsigned long)percentile(histogram, count, 0.9),
+                (unsigned long)percentile(histogram, count, 0.99),
+                (unsigned long)percentile(histogram, count, 0.999),
+                (unsigned long)bucket_limit(last));
+    }
+
+    // Non-empty buckets as [upper limit, count]
+    fprintf(out, ", \"buckets\": [");
+    int first = 1;
+    for (int i = 0; i <= last; i++) {
+        if (histogram[i]) {
+            fprintf(out, "%s[%lu, %lu]", first ? "" : ", ", (unsigned long)bucket_limit(i),
+                    (unsigned long)histogram[i]);
+            first = 0;
+        }
+    }
+    fprintf(out, "]}");
+}
+
+/*
+ * Sum every thread's counters and histograms into a JSON document. Returns
+ * a malloc()ed buffer of len bytes, or NULL.
+ */
+char *stats_report(const stats_gauges_t *gauges, size_t *len) {
+    stats_t *total = calloc(1, sizeof(stats_t));
+    if (!total) {
+        return NULL;
+    }
+
+    pthread_mutex_lock(&registry_lock);
+    for (stats_t *stats = all_stats; stats; stats = stats->next) {
+        for (int i = 0; i < STAT_NUM_COUNTERS; i++) {
+            total->counters[i] += __atomic_load_n(&stats->counters[i], __ATOMIC_RELAXED);
+        }
+        for (int phase = 0; phase < PHASE_NUM; phase++) {
+            for (int i = 0; i < STATS_HISTOGRAM_BUCKETS; i++) {
+                total->histograms[phase][i] +=
+                    __atomic_load_n(&stats->histograms[phase][i], __ATOMIC_RELAXED);
+            }
+        }
+    }
+    pthread_mutex_unlock(&registry_lock);
+
+    char *report = NULL;
+    FILE *out = open_memstream(&report, len);
+    if (!out) {
+        free(total);
+        return NULL;
+    }
+
+    fprintf(out, "{\n  \"counters\": {\n");
+    for (int i = 0; i < STAT_NUM_COUNTERS; i++) {
+        fprintf(out, "    \"%s\": %lu%s\n", counter_names[i], (unsigned long)total->counters[i],
+                i + 1 < STAT_NUM_COUNTERS ? "," : "");
+    }
+    fprintf(out, "  },\n");
+    if (gauges->cache_entries >= 0) {
+        fprintf(out, "  \"cache\": {\"entries\": %ld, \"bytes\": %ld},\n", gauges->cache_entries,
+                gauges->cache_bytes);
+    }
+    fprintf(out, "  \"dns\": {\"hits\": %lu, \"misses\": %lu},\n",
+            (unsigned long)gauges->dns_hits, (unsigned long)gauges->dns_misses);
+    fprintf(out, "  \"latency_us\": {\n");
+    for (int phase = 0; phase < PHASE_NUM; phase++) {
+        write_histogram(out, phase_names[phase], total->histograms[phase]);
+        fprintf(out, "%s\n", phase + 1 < PHASE_NUM ? "," : "");
+    }
+    fprintf(out, "  }\n}\n");
+    fclose(out);
+
+    free(total);
+    return report;
+}
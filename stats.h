@@ -0,0 +1,69 @@
+#ifndef STATS_H
+#define STATS_H
+
+#include "htproxy.h"
+
+#include <time.h>
+
+#define STATS_PATH "/__htproxy/stats"  // request target answered by the proxy itself
+#define STATS_SUB_BUCKETS 16            // linear steps per power of two, ~6% precision
+#define STATS_MAX_EXPONENT 40           // histograms reach 2^40 us, about 12 days
+#define STATS_HISTOGRAM_BUCKETS (STATS_SUB_BUCKETS * (STATS_MAX_EXPONENT - 2))
+
+// Event counters
+typedef enum {
+    STAT_REQUESTS,              // requests parsed
+    STAT_HITS,                  // served fresh from memory
+    STAT_DISK_HITS,             // served from the disk tier
+    STAT_MISSES,                // went to the origin or joined a fetch
+    STAT_STALE,                 // entry found expired
+    STAT_STALE_SERVED,          // expired entry served (stale-while-revalidate, stale-if-error)
+    STAT_REVALIDATED,           // expired entry confirmed by a 304
+    STAT_EVICTIONS,
+    STAT_REJECTED,              // new entry evicted by W-TinyLFU admission
+    STAT_BYTES_FROM_CLIENTS,
+    STAT_BYTES_TO_CLIENTS,
+    STAT_BYTES_FROM_ORIGINS,
+    STAT_BYTES_TO_ORIGINS,
+    STAT_NUM_COUNTERS,
+} stat_counter_t;
+
+// Request phases timed in microseconds
+typedef enum {
+    PHASE_PARSE,                // first request byte to complete header
+    PHASE_LOOKUP,               // cache lock and lookup
+    PHASE_DNS,                  // origin resolution, when not pooled
+    PHASE_CONNECT,              // TCP connect to the origin
+    PHASE_FIRST_BYTE,           // complete header to first response byte sent
+    PHASE_TOTAL,                // first request byte to response done
+    PHASE_NUM,
+} stat_phase_t;
+
+// One thread's counters and histograms. Only the owner writes them; a
+// report reads every registered thread's without stopping it.
+typedef struct stats {
+    uint64_t counters[STAT_NUM_COUNTERS];
+    uint64_t histograms[PHASE_NUM][STATS_HISTOGRAM_BUCKETS];
+    struct stats *next;         // next registered thread
+} stats_t;
+
+// Values outside the per-thread counters, filled in by the caller
+typedef struct {
+    long cache_entries;         // -1 without a cache
+    long cache_bytes;
+    uint64_t dns_hits;
+    uint64_t dns_misses;
+} stats_gauges_t;
+
+static inline uint64_t stats_now_us(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
+// Function declarations
+void stats_count(stat_counter_t counter, uint64_t n);
+uint64_t stats_record(stat_phase_t phase, uint64_t start_us);
+char *stats_report(const stats_gauges_t *gauges, size_t *len);
+
+#endif